@@ -46,6 +46,7 @@ typedef struct SpiceGstDecoder {
     GstAppSink *appsink;
     GstElement *pipeline;
     GstClock *clock;
+    VideoDecoderTuning tuning;
 
     /* ---------- Decoding and display queues ---------- */
 
@@ -54,6 +55,7 @@ typedef struct SpiceGstDecoder {
     GMutex queues_mutex;
     GQueue *decoding_queue;
     SpiceGstFrame *display_frame;
+    GMainContext *context; /* where the channel runs, for the timer */
     guint timer_id;
     guint pending_samples;
 } SpiceGstDecoder;
@@ -132,25 +134,18 @@ static int spice_gst_buffer_get_stride(GstBuffer *buffer)
     return video && video->n_planes > 0 ? video->stride[0] : SPICE_UNKNOWN_STRIDE;
 }
 
-/* main context */
-static gboolean display_frame(gpointer video_decoder)
+/* Displays the decoded frame and frees it.
+ *
+ * main context
+ */
+static void display_gst_frame(SpiceGstDecoder *decoder, SpiceGstFrame *gstframe)
 {
-    SpiceGstDecoder *decoder = (SpiceGstDecoder*)video_decoder;
-    SpiceGstFrame *gstframe;
     GstCaps *caps;
     gint width, height;
     GstStructure *s;
     GstBuffer *buffer;
     GstMapInfo mapinfo;
 
-    g_mutex_lock(&decoder->queues_mutex);
-    decoder->timer_id = 0;
-    gstframe = decoder->display_frame;
-    decoder->display_frame = NULL;
-    g_mutex_unlock(&decoder->queues_mutex);
-    /* If the queue is empty we don't even need to reschedule */
-    g_return_val_if_fail(gstframe, G_SOURCE_REMOVE);
-
     if (!gstframe->decoded_sample) {
         spice_warning("got a frame without a sample!");
         goto error;
@@ -175,12 +170,32 @@ static gboolean display_frame(gpointer video_decoder)
         goto error;
     }
 
+    /* The frame is copied into the surface only now that it is due. It is
+     * not decoded in place: the decoder runs frames ahead of the
+     * presentation, and the surface is drawn on meanwhile. */
     stream_display_frame(decoder->base.stream, gstframe->encoded_frame,
                          width, height, spice_gst_buffer_get_stride(buffer), mapinfo.data);
     gst_buffer_unmap(buffer, &mapinfo);
 
  error:
     free_gst_frame(gstframe);
+}
+
+/* main context */
+static gboolean display_frame(gpointer video_decoder)
+{
+    SpiceGstDecoder *decoder = (SpiceGstDecoder*)video_decoder;
+    SpiceGstFrame *gstframe;
+
+    g_mutex_lock(&decoder->queues_mutex);
+    decoder->timer_id = 0;
+    gstframe = decoder->display_frame;
+    decoder->display_frame = NULL;
+    g_mutex_unlock(&decoder->queues_mutex);
+    /* If the queue is empty we don't even need to reschedule */
+    g_return_val_if_fail(gstframe, G_SOURCE_REMOVE);
+
+    display_gst_frame(decoder, gstframe);
     schedule_frame(decoder);
     return G_SOURCE_REMOVE;
 }
@@ -283,6 +298,11 @@ static void fetch_pending_sample(SpiceGstDecoder *decoder)
 /* main loop or GStreamer streaming thread */
 static void schedule_frame(SpiceGstDecoder *decoder)
 {
+    /* the frames are pulled by spice_gst_decoder_present() instead */
+    if (stream_is_paced(decoder->base.stream)) {
+        return;
+    }
+
     guint32 now = stream_get_time(decoder->base.stream);
     g_mutex_lock(&decoder->queues_mutex);
 
@@ -297,18 +317,22 @@ static void schedule_frame(SpiceGstDecoder *decoder)
         }
 
         if (spice_mmtime_diff(gstframe->encoded_frame->mm_time, now) >= 0) {
-            decoder->timer_id = g_spice_timeout_add(gstframe->encoded_frame->mm_time - now,
-                                                    display_frame, decoder);
+            decoder->timer_id = g_spice_context_timeout_add_full(decoder->context,
+                                                                 G_PRIORITY_DEFAULT,
+                                                                 gstframe->encoded_frame->mm_time - now,
+                                                                 display_frame, decoder, NULL);
         } else if (decoder->display_frame && !decoder->pending_samples) {
             /* Still attempt to display the least out of date frame so the
              * video is not completely frozen for an extended period of time.
              */
-            decoder->timer_id = g_spice_timeout_add(0, display_frame, decoder);
+            decoder->timer_id = g_spice_context_timeout_add_full(decoder->context,
+                                                                 G_PRIORITY_DEFAULT, 0,
+                                                                 display_frame, decoder, NULL);
         } else {
             SPICE_DEBUG("%s: rendering too late by %u ms (ts: %u, mmtime: %u), dropping",
                         __FUNCTION__, now - gstframe->encoded_frame->mm_time,
                         gstframe->encoded_frame->mm_time, now);
-            stream_dropped_frame_on_playback(decoder->base.stream);
+            stream_dropped_frame_on_playback(decoder->base.stream, gstframe->encoded_frame);
             decoder->display_frame = NULL;
             free_gst_frame(gstframe);
         }
@@ -452,6 +476,8 @@ sink_event_probe(GstPad *pad, GstPadProbeInfo *info, gpointer data)
                    frame->mm_time, frame->size, frame->creation_time,
                    g_get_monotonic_time() - frame->creation_time,
                    decoder->decoding_queue->length, gstframe->queue_len);
+            stream_record_decode_time(decoder->base.stream,
+                                      g_get_monotonic_time() - frame->creation_time);
 
             if (!decoder->appsink) {
                 /* The sink will display the frame directly so this
@@ -474,13 +500,64 @@ static inline const char *gst_element_name(GstElement *element)
    return f ? GST_OBJECT_NAME(f) : GST_OBJECT_NAME(element);
 }
 
-/* This function is used to set a probe on the sink */
+/* Sets the property if the element has it, from its string representation */
+static void set_element_arg(GstElement *element, const gchar *name, const gchar *value)
+{
+    if (g_object_class_find_property(G_OBJECT_GET_CLASS(element), name) == NULL) {
+        return;
+    }
+    SPICE_DEBUG("setting %s %s=%s", gst_element_name(element), name, value);
+    gst_util_set_object_arg(G_OBJECT(element), name, value);
+}
+
+/* Applies the channel's decoding settings, see VideoDecoderTuning */
+static void tune_element(SpiceGstDecoder *decoder, GstElement *element)
+{
+    const VideoDecoderTuning *tuning = &decoder->tuning;
+    const char *name = gst_element_name(element);
+    gchar *value;
+
+    if (g_str_has_prefix(name, "avdec_")) {
+        if (tuning->threads) {
+            value = g_strdup_printf("%u", tuning->threads);
+            set_element_arg(element, "max-threads", value);
+            g_free(value);
+        }
+        if (tuning->low_latency) {
+            /* frame threading delays the output by one frame per thread */
+            set_element_arg(element, "thread-type", "slice");
+            set_element_arg(element, "output-corrupt", "true");
+        }
+    } else if (g_str_equal(name, "vp8dec") || g_str_equal(name, "vp9dec")) {
+        if (tuning->threads) {
+            value = g_strdup_printf("%u", tuning->threads);
+            set_element_arg(element, "threads", value);
+            g_free(value);
+        }
+        if (tuning->low_latency) {
+            /* VPX_DL_REALTIME */
+            set_element_arg(element, "deadline", "1");
+        }
+    } else if (g_str_equal(name, "queue") || g_str_equal(name, "queue2") ||
+               g_str_equal(name, "multiqueue")) {
+        if (tuning->queue_depth) {
+            value = g_strdup_printf("%u", tuning->queue_depth);
+            set_element_arg(element, "max-size-buffers", value);
+            set_element_arg(element, "max-size-bytes", "0");
+            set_element_arg(element, "max-size-time", "0");
+            g_free(value);
+        }
+    }
+}
+
+/* This function is used to tune the new elements and set a probe on the sink */
 static void
 deep_element_added_cb(GstBin *pipeline, GstBin *bin, GstElement *element,
                       SpiceGstDecoder *decoder)
 {
      SPICE_DEBUG("A new element was added to Gstreamer's pipeline (%s)",
                  gst_element_name(element));
+    tune_element(decoder, element);
     /* Attach a probe to the sink to update the statistics */
     if (GST_IS_BASE_SINK(element)) {
         GstPad *pad = gst_element_get_static_pad(element, "sink");
@@ -605,11 +682,63 @@ static void spice_gst_decoder_reschedule(VideoDecoder *video_decoder)
     g_mutex_unlock(&decoder->queues_mutex);
 
     if (timer_id != 0) {
-        g_spice_source_remove(timer_id);
+        g_spice_context_source_remove(decoder->context, timer_id);
     }
     schedule_frame(decoder);
 }
 
+/* main context */
+static void spice_gst_decoder_present(VideoDecoder *video_decoder)
+{
+    SpiceGstDecoder *decoder = (SpiceGstDecoder*)video_decoder;
+    SpiceGstFrame *gstframe = NULL;
+
+    if (!decoder->appsink) {
+        return;
+    }
+    guint32 now = stream_get_time(decoder->base.stream);
+
+    /* Pull the decoded frames until the first one that is not due yet,
+     * only keeping the most recent one.
+     */
+    g_mutex_lock(&decoder->queues_mutex);
+    while (TRUE) {
+        while (decoder->display_frame == NULL && decoder->pending_samples) {
+            fetch_pending_sample(decoder);
+        }
+        if (!decoder->display_frame ||
+            spice_mmtime_diff(decoder->display_frame->encoded_frame->mm_time, now) > 0) {
+            break;
+        }
+        if (gstframe) {
+            SPICE_DEBUG("%s: superseded frame (ts: %u, mmtime: %u), dropping",
+                        __FUNCTION__, gstframe->encoded_frame->mm_time, now);
+            stream_dropped_frame_on_playback(decoder->base.stream, gstframe->encoded_frame);
+            free_gst_frame(gstframe);
+        }
+        gstframe = decoder->display_frame;
+        decoder->display_frame = NULL;
+    }
+    g_mutex_unlock(&decoder->queues_mutex);
+
+    if (gstframe) {
+        display_gst_frame(decoder, gstframe);
+    }
+}
+
+/* main context */
+static guint spice_gst_decoder_queue_length(VideoDecoder *video_decoder)
+{
+    SpiceGstDecoder *decoder = (SpiceGstDecoder*)video_decoder;
+    guint length;
+
+    g_mutex_lock(&decoder->queues_mutex);
+    length = decoder->decoding_queue->length + (decoder->display_frame ? 1 : 0);
+    g_mutex_unlock(&decoder->queues_mutex);
+
+    return length;
+}
+
 /* main context */
 static void spice_gst_decoder_destroy(VideoDecoder *video_decoder)
 {
@@ -625,8 +754,9 @@ static void spice_gst_decoder_destroy(VideoDecoder *video_decoder)
      * scheduled display_frame() call and drop the queued frames.
      */
     if (decoder->timer_id) {
-        g_spice_source_remove(decoder->timer_id);
+        g_spice_context_source_remove(decoder->context, decoder->timer_id);
     }
+    g_clear_pointer(&decoder->context, g_main_context_unref);
     g_mutex_clear(&decoder->queues_mutex);
     g_queue_free_full(decoder->decoding_queue, (GDestroyNotify)free_gst_frame);
     if (decoder->display_frame) {
@@ -723,7 +853,7 @@ static gboolean spice_gst_decoder_queue_frame(VideoDecoder *video_decoder,
 
     if (decoder->appsrc == NULL) {
         spice_warning("Error: Playbin has not yet initialized the Appsrc element");
-        stream_dropped_frame_on_playback(decoder->base.stream);
+        stream_dropped_frame_on_playback(decoder->base.stream, frame);
         spice_frame_free(frame);
         return TRUE;
     }
@@ -750,7 +880,8 @@ static gboolean spice_gst_decoder_queue_frame(VideoDecoder *video_decoder,
 
     if (gst_app_src_push_buffer(decoder->appsrc, buffer) != GST_FLOW_OK) {
         SPICE_DEBUG("GStreamer error: unable to push frame");
-        stream_dropped_frame_on_playback(decoder->base.stream);
+        /* the frame belonged to the buffer */
+        stream_dropped_frame_on_playback(decoder->base.stream, NULL);
     }
     return TRUE;
 }
@@ -783,11 +914,16 @@ VideoDecoder* create_gstreamer_decoder(int codec_type, display_stream *stream)
         decoder->base.destroy = spice_gst_decoder_destroy;
         decoder->base.reschedule = spice_gst_decoder_reschedule;
         decoder->base.queue_frame = spice_gst_decoder_queue_frame;
+        decoder->base.present = spice_gst_decoder_present;
+        decoder->base.queue_length = spice_gst_decoder_queue_length;
         decoder->base.codec_type = codec_type;
         decoder->base.stream = stream;
         decoder->last_mm_time = stream_get_time(stream);
+        stream_get_decoder_tuning(stream, &decoder->tuning);
         g_mutex_init(&decoder->queues_mutex);
         decoder->decoding_queue = g_queue_new();
+        if (spice_thread_context())
+            decoder->context = g_main_context_ref(spice_thread_context());
 
         if (!create_pipeline(decoder)) {
             decoder->base.destroy((VideoDecoder*)decoder);
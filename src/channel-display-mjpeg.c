@@ -25,25 +25,61 @@
 
 /* MJpeg decoder implementation */
 
+/* How many frames may be waiting to be decoded or displayed at once */
+#define MJPEG_MAX_FRAMES_AHEAD 3
+
+typedef struct MJpegOutput {
+    SpiceFrame *frame;
+    guint generation;
+
+    /* the decoded frame, or no data if decoding failed */
+    JDIMENSION width;
+    JDIMENSION height;
+    uint8_t *data;
+    uint32_t size;
+} MJpegOutput;
+
 typedef struct MJpegDecoder {
     VideoDecoder base;
 
     /* ---------- The builtin mjpeg decoder ---------- */
 
+    /* only used by the decoding thread */
     struct jpeg_source_mgr         mjpeg_src;
     struct jpeg_decompress_struct  mjpeg_cinfo;
     struct jpeg_error_mgr          mjpeg_jerr;
+    SpiceFrame *cur_frame;
 
     /* ---------- Frame queue ---------- */
 
+    /* frames not yet handed to the decoding thread */
     GQueue *msgq;
-    SpiceFrame *cur_frame;
+    guint32 last_mm_time;
+    gboolean has_last_frame;
     guint timer_id;
 
-    /* ---------- Output frame data ---------- */
+    /* ---------- Decoding thread ---------- */
+
+    GThread *thread;
+    GMutex lock;
+    GCond cond;
+
+    /* all the fields below are protected by lock */
+    gboolean quit;
+    gboolean busy;
+    guint generation;
+    GQueue *workq;
+    GQueue *decodedq;
+    GQueue *spare;
+    GMainContext *context; /* where the channel runs, for the idle */
+    guint idle_id;
+
+    /* ---------- Decoding cost estimation ---------- */
 
-    uint8_t *out_frame;
-    uint32_t out_size;
+    /* moving average of the time it takes to decode the frames of
+     * decode_pixels pixels, in microseconds */
+    gint64 decode_time;
+    guint32 decode_pixels;
 } MJpegDecoder;
 
 
@@ -78,10 +114,13 @@ static void mjpeg_src_term(struct jpeg_decompress_struct *cinfo)
 
 static void mjpeg_decoder_schedule(MJpegDecoder *decoder);
 
-/* main context */
-static gboolean mjpeg_decoder_decode_frame(gpointer video_decoder)
+/* Decodes cur_frame into output.
+ *
+ * decoding thread
+ */
+static gboolean mjpeg_decoder_decode_frame(MJpegDecoder *decoder,
+                                           MJpegOutput *output)
 {
-    MJpegDecoder *decoder = (MJpegDecoder*)video_decoder;
     JDIMENSION width, height;
     uint8_t *dest;
     uint8_t *lines[4];
@@ -89,12 +128,12 @@ static gboolean mjpeg_decoder_decode_frame(gpointer video_decoder)
     jpeg_read_header(&decoder->mjpeg_cinfo, 1);
     width = decoder->mjpeg_cinfo.image_width;
     height = decoder->mjpeg_cinfo.image_height;
-    if (decoder->out_size < width * height * 4) {
-        g_free(decoder->out_frame);
-        decoder->out_size = width * height * 4;
-        decoder->out_frame = g_malloc(decoder->out_size);
+    if (output->size < width * height * 4) {
+        g_free(output->data);
+        output->size = width * height * 4;
+        output->data = g_malloc(output->size);
     }
-    dest = decoder->out_frame;
+    dest = output->data;
 
 #ifdef JCS_EXTENSIONS
     // requires jpeg-turbo
@@ -121,7 +160,7 @@ static gboolean mjpeg_decoder_decode_frame(gpointer video_decoder)
      */
     if (decoder->mjpeg_cinfo.rec_outbuf_height > G_N_ELEMENTS(lines)) {
         jpeg_abort_decompress(&decoder->mjpeg_cinfo);
-        g_return_val_if_reached(G_SOURCE_REMOVE);
+        g_return_val_if_reached(FALSE);
     }
 
     while (decoder->mjpeg_cinfo.output_scanline < decoder->mjpeg_cinfo.output_height) {
@@ -151,50 +190,235 @@ static gboolean mjpeg_decoder_decode_frame(gpointer video_decoder)
             }
         }
 #endif
-        dest = &(decoder->out_frame[decoder->mjpeg_cinfo.output_scanline * width * 4]);
+        dest = &(output->data[decoder->mjpeg_cinfo.output_scanline * width * 4]);
     }
     jpeg_finish_decompress(&decoder->mjpeg_cinfo);
 
-    /* Display the frame and dispose of it */
-    stream_display_frame(decoder->base.stream, decoder->cur_frame,
-                         width, height, SPICE_UNKNOWN_STRIDE, decoder->out_frame);
-    g_clear_pointer(&decoder->cur_frame, spice_frame_free);
+    output->width = width;
+    output->height = height;
+    return TRUE;
+}
+
+static gboolean mjpeg_decoder_frame_decoded(gpointer video_decoder);
+
+/* decoding thread */
+static gpointer mjpeg_decoder_thread(gpointer video_decoder)
+{
+    MJpegDecoder *decoder = (MJpegDecoder*)video_decoder;
+
+    g_mutex_lock(&decoder->lock);
+    while (!decoder->quit) {
+        SpiceFrame *frame = g_queue_pop_head(decoder->workq);
+        if (frame == NULL) {
+            g_cond_wait(&decoder->cond, &decoder->lock);
+            continue;
+        }
+
+        MJpegOutput *output = g_queue_pop_head(decoder->spare);
+        if (output == NULL) {
+            output = g_new0(MJpegOutput, 1);
+        }
+        output->frame = frame;
+        output->generation = decoder->generation;
+        output->width = output->height = 0;
+        decoder->busy = TRUE;
+        g_mutex_unlock(&decoder->lock);
+
+        /* The frame still belongs to the main context which is the only one
+         * allowed to free it, so only its data gets accessed here.
+         */
+        gint64 start = g_get_monotonic_time();
+        decoder->cur_frame = frame;
+        gboolean decoded = mjpeg_decoder_decode_frame(decoder, output);
+        decoder->cur_frame = NULL;
+        gint64 elapsed = g_get_monotonic_time() - start;
+
+        if (decoded) {
+            stream_record_decode_time(decoder->base.stream, elapsed);
+        }
+
+        g_mutex_lock(&decoder->lock);
+        decoder->busy = FALSE;
+        if (decoded) {
+            /* the cost mostly depends on the frame size, start over when it changes */
+            guint32 pixels = output->width * output->height;
+            if (decoder->decode_pixels != pixels) {
+                decoder->decode_pixels = pixels;
+                decoder->decode_time = elapsed;
+            } else {
+                decoder->decode_time += (elapsed - decoder->decode_time) / 8;
+            }
+        }
+        g_queue_push_tail(decoder->decodedq, output);
+        if (decoder->idle_id == 0) {
+            decoder->idle_id = g_spice_context_idle_add(decoder->context,
+                                                        mjpeg_decoder_frame_decoded, decoder);
+        }
+    }
+    g_mutex_unlock(&decoder->lock);
+
+    return NULL;
+}
+
+/* Disposes of the frame and keeps the output buffer for a later frame.
+ *
+ * main context, with the lock held
+ */
+static void mjpeg_decoder_release_output(MJpegDecoder *decoder, MJpegOutput *output)
+{
+    g_clear_pointer(&output->frame, spice_frame_free);
+    if (g_queue_get_length(decoder->spare) < MJPEG_MAX_FRAMES_AHEAD) {
+        g_queue_push_tail(decoder->spare, output);
+    } else {
+        g_free(output->data);
+        g_free(output);
+    }
+}
+
+/* Returns the oldest frame ready for display, discarding the ones that
+ * could not be decoded or that predate the last reset.
+ *
+ * main context, with the lock held
+ */
+static MJpegOutput *mjpeg_decoder_peek_output(MJpegDecoder *decoder)
+{
+    MJpegOutput *output;
+
+    while ((output = g_queue_peek_head(decoder->decodedq)) != NULL) {
+        if (output->generation == decoder->generation && output->width != 0) {
+            return output;
+        }
+        g_queue_pop_head(decoder->decodedq);
+        mjpeg_decoder_release_output(decoder, output);
+    }
+    return NULL;
+}
+
+/* Returns the expected time to decode a frame in milliseconds.
+ *
+ * with the lock held
+ */
+static guint32 mjpeg_decoder_decode_cost(MJpegDecoder *decoder)
+{
+    return (decoder->decode_time + 999) / 1000;
+}
+
+/* main context */
+static void mjpeg_decoder_display_output(MJpegDecoder *decoder, MJpegOutput *output)
+{
+    stream_display_frame(decoder->base.stream, output->frame,
+                         output->width, output->height,
+                         SPICE_UNKNOWN_STRIDE, output->data);
+
+    g_mutex_lock(&decoder->lock);
+    mjpeg_decoder_release_output(decoder, output);
+    g_mutex_unlock(&decoder->lock);
+}
+
+/* main context */
+static gboolean mjpeg_decoder_display_frame(gpointer video_decoder)
+{
+    MJpegDecoder *decoder = (MJpegDecoder*)video_decoder;
+    MJpegOutput *output;
+
     decoder->timer_id = 0;
 
+    g_mutex_lock(&decoder->lock);
+    output = mjpeg_decoder_peek_output(decoder);
+    if (output) {
+        g_queue_pop_head(decoder->decodedq);
+    }
+    g_mutex_unlock(&decoder->lock);
+
+    if (output) {
+        mjpeg_decoder_display_output(decoder, output);
+    }
+
     /* Schedule the next frame */
     mjpeg_decoder_schedule(decoder);
 
     return G_SOURCE_REMOVE;
 }
 
+/* main context */
+static gboolean mjpeg_decoder_frame_decoded(gpointer video_decoder)
+{
+    MJpegDecoder *decoder = (MJpegDecoder*)video_decoder;
+
+    g_mutex_lock(&decoder->lock);
+    decoder->idle_id = 0;
+    g_mutex_unlock(&decoder->lock);
+
+    mjpeg_decoder_schedule(decoder);
+
+    return G_SOURCE_REMOVE;
+}
+
 /* ---------- VideoDecoder's queue scheduling ---------- */
 
-static void mjpeg_decoder_schedule(MJpegDecoder *decoder)
+/* Hands as many frames to the decoding thread as the queue bound allows,
+ * dropping those that cannot be decoded in time.
+ *
+ * main context, with the lock held
+ */
+static void mjpeg_decoder_feed_thread(MJpegDecoder *decoder, guint32 time)
 {
-    if (decoder->timer_id) {
-        return;
+    guint32 cost = mjpeg_decoder_decode_cost(decoder);
+    /* the frames the thread will decode before getting to the new ones */
+    guint backlog = g_queue_get_length(decoder->workq) + (decoder->busy ? 1 : 0);
+    guint pending = backlog + g_queue_get_length(decoder->decodedq);
+    SpiceFrame *frame;
+
+    while (pending < MJPEG_MAX_FRAMES_AHEAD &&
+           (frame = g_queue_pop_head(decoder->msgq)) != NULL) {
+        SpiceFrame *next = g_queue_peek_head(decoder->msgq);
+        /* when the thread will start decoding this frame */
+        guint32 start = time + backlog * cost;
+
+        if (spice_mmtime_diff(start, frame->mm_time) > 0) {
+            SPICE_DEBUG("%s: rendering too late by %u ms (ts: %u, mmtime: %u), dropping ",
+                        __FUNCTION__, start - frame->mm_time,
+                        frame->mm_time, time);
+        } else if (next != NULL &&
+                   spice_mmtime_diff(start + 2 * cost, next->mm_time) > 0 &&
+                   spice_mmtime_diff(start + cost, next->mm_time) <= 0) {
+            /* Decoding this frame would make the next one late, while
+             * skipping it leaves enough time to decode the next one.
+             */
+            SPICE_DEBUG("%s: no time to decode the frame in %u ms (ts: %u, next: %u), dropping",
+                        __FUNCTION__, cost, frame->mm_time, next->mm_time);
+        } else {
+            g_queue_push_tail(decoder->workq, frame);
+            g_cond_signal(&decoder->cond);
+            backlog++;
+            pending++;
+            continue;
+        }
+        stream_dropped_frame_on_playback(decoder->base.stream, frame);
+        spice_frame_free(frame);
     }
+}
 
+/* main context */
+static void mjpeg_decoder_schedule(MJpegDecoder *decoder)
+{
     guint32 time = stream_get_time(decoder->base.stream);
-    SpiceFrame *frame = decoder->cur_frame;
-    decoder->cur_frame = NULL;
-    do {
-        if (frame) {
-            if (spice_mmtime_diff(time, frame->mm_time) <= 0) {
-                guint32 d = frame->mm_time - time;
-                decoder->cur_frame = frame;
-                decoder->timer_id = g_spice_timeout_add(d, mjpeg_decoder_decode_frame, decoder);
-                break;
-            }
+    MJpegOutput *output;
 
-            SPICE_DEBUG("%s: rendering too late by %u ms (ts: %u, mmtime: %u), dropping ",
-                        __FUNCTION__, time - frame->mm_time,
-                        frame->mm_time, time);
-            stream_dropped_frame_on_playback(decoder->base.stream);
-            spice_frame_free(frame);
-        }
-        frame = g_queue_pop_head(decoder->msgq);
-    } while (frame);
+    g_mutex_lock(&decoder->lock);
+    mjpeg_decoder_feed_thread(decoder, time);
+    output = mjpeg_decoder_peek_output(decoder);
+    g_mutex_unlock(&decoder->lock);
+
+    if (output == NULL || decoder->timer_id ||
+        stream_is_paced(decoder->base.stream)) {
+        return;
+    }
+
+    /* The frame is decoded already, display it on time */
+    guint32 d = spice_mmtime_diff(output->frame->mm_time, time) > 0 ?
+                output->frame->mm_time - time : 0;
+    decoder->timer_id = g_spice_timeout_add(d, mjpeg_decoder_display_frame, decoder);
 }
 
 
@@ -204,15 +428,29 @@ static void spice_frame_unref_func(gpointer data, gpointer user_data)
     spice_frame_free(data);
 }
 
+/* mjpeg_decoder_drop_queue() helper */
+static void mjpeg_output_release_func(gpointer data, gpointer user_data)
+{
+    mjpeg_decoder_release_output(user_data, data);
+}
+
 static void mjpeg_decoder_drop_queue(MJpegDecoder *decoder)
 {
     if (decoder->timer_id != 0) {
         g_spice_source_remove(decoder->timer_id);
         decoder->timer_id = 0;
     }
-    g_clear_pointer(&decoder->cur_frame, spice_frame_free);
     g_queue_foreach(decoder->msgq, spice_frame_unref_func, NULL);
     g_queue_clear(decoder->msgq);
+
+    g_mutex_lock(&decoder->lock);
+    /* the frame being decoded, if any, will be discarded once done */
+    decoder->generation++;
+    g_queue_foreach(decoder->workq, spice_frame_unref_func, NULL);
+    g_queue_clear(decoder->workq);
+    g_queue_foreach(decoder->decodedq, mjpeg_output_release_func, decoder);
+    g_queue_clear(decoder->decodedq);
+    g_mutex_unlock(&decoder->lock);
 }
 
 /* ---------- VideoDecoder's public API ---------- */
@@ -221,19 +459,18 @@ static gboolean mjpeg_decoder_queue_frame(VideoDecoder *video_decoder,
                                           SpiceFrame *frame, int32_t margin)
 {
     MJpegDecoder *decoder = (MJpegDecoder*)video_decoder;
-    SpiceFrame *last_frame;
-
-    last_frame = g_queue_peek_tail(decoder->msgq);
-    if (last_frame) {
-        if (spice_mmtime_diff(frame->mm_time, last_frame->mm_time) < 0) {
-            /* This should really not happen */
-            SPICE_DEBUG("new-frame-time < last-frame-time (%u < %u):"
-                        " resetting stream",
-                        frame->mm_time,
-                        last_frame->mm_time);
-            mjpeg_decoder_drop_queue(decoder);
-        }
+
+    if (decoder->has_last_frame &&
+        spice_mmtime_diff(frame->mm_time, decoder->last_mm_time) < 0) {
+        /* This should really not happen */
+        SPICE_DEBUG("new-frame-time < last-frame-time (%u < %u):"
+                    " resetting stream",
+                    frame->mm_time,
+                    decoder->last_mm_time);
+        mjpeg_decoder_drop_queue(decoder);
     }
+    decoder->last_mm_time = frame->mm_time;
+    decoder->has_last_frame = TRUE;
 
     /* Dropped MJPEG frames don't impact the ones that come after.
      * So drop late frames as early as possible to save on processing time.
@@ -249,6 +486,54 @@ static gboolean mjpeg_decoder_queue_frame(VideoDecoder *video_decoder,
     return TRUE;
 }
 
+/* main context */
+static void mjpeg_decoder_present(VideoDecoder *video_decoder)
+{
+    MJpegDecoder *decoder = (MJpegDecoder*)video_decoder;
+    guint32 time = stream_get_time(decoder->base.stream);
+    MJpegOutput *output, *next;
+
+    g_mutex_lock(&decoder->lock);
+    output = mjpeg_decoder_peek_output(decoder);
+    if (output && spice_mmtime_diff(time, output->frame->mm_time) >= 0) {
+        g_queue_pop_head(decoder->decodedq);
+
+        /* Only display the most recent of the frames that are due */
+        while ((next = mjpeg_decoder_peek_output(decoder)) != NULL &&
+               spice_mmtime_diff(time, next->frame->mm_time) >= 0) {
+            SPICE_DEBUG("%s: superseded frame (ts: %u, mmtime: %u), dropping",
+                        __FUNCTION__, output->frame->mm_time, time);
+            stream_dropped_frame_on_playback(decoder->base.stream, output->frame);
+            mjpeg_decoder_release_output(decoder, output);
+            output = g_queue_pop_head(decoder->decodedq);
+        }
+    } else {
+        /* keep it for a later display frame */
+        output = NULL;
+    }
+    g_mutex_unlock(&decoder->lock);
+
+    if (output) {
+        mjpeg_decoder_display_output(decoder, output);
+    }
+    mjpeg_decoder_schedule(decoder);
+}
+
+static guint mjpeg_decoder_queue_length(VideoDecoder *video_decoder)
+{
+    MJpegDecoder *decoder = (MJpegDecoder*)video_decoder;
+    guint length;
+
+    g_mutex_lock(&decoder->lock);
+    length = g_queue_get_length(decoder->msgq) +
+             g_queue_get_length(decoder->workq) +
+             g_queue_get_length(decoder->decodedq) +
+             (decoder->busy ? 1 : 0);
+    g_mutex_unlock(&decoder->lock);
+
+    return length;
+}
+
 static void mjpeg_decoder_reschedule(VideoDecoder *video_decoder)
 {
     MJpegDecoder *decoder = (MJpegDecoder*)video_decoder;
@@ -261,14 +546,39 @@ static void mjpeg_decoder_reschedule(VideoDecoder *video_decoder)
     mjpeg_decoder_schedule(decoder);
 }
 
+/* mjpeg_decoder_destroy() helper */
+static void mjpeg_output_free(gpointer data)
+{
+    MJpegOutput *output = data;
+
+    g_clear_pointer(&output->frame, spice_frame_free);
+    g_free(output->data);
+    g_free(output);
+}
+
 static void mjpeg_decoder_destroy(VideoDecoder* video_decoder)
 {
     MJpegDecoder *decoder = (MJpegDecoder*)video_decoder;
 
     mjpeg_decoder_drop_queue(decoder);
+
+    g_mutex_lock(&decoder->lock);
+    decoder->quit = TRUE;
+    g_cond_signal(&decoder->cond);
+    g_mutex_unlock(&decoder->lock);
+    g_thread_join(decoder->thread);
+
+    if (decoder->idle_id != 0) {
+        g_spice_context_source_remove(decoder->context, decoder->idle_id);
+    }
+    g_clear_pointer(&decoder->context, g_main_context_unref);
     g_queue_free(decoder->msgq);
+    g_queue_free(decoder->workq);
+    g_queue_free_full(decoder->decodedq, mjpeg_output_free);
+    g_queue_free_full(decoder->spare, mjpeg_output_free);
+    g_mutex_clear(&decoder->lock);
+    g_cond_clear(&decoder->cond);
     jpeg_destroy_decompress(&decoder->mjpeg_cinfo);
-    g_free(decoder->out_frame);
     g_free(decoder);
 }
 
@@ -282,10 +592,19 @@ VideoDecoder* create_mjpeg_decoder(int codec_type, display_stream *stream)
     decoder->base.destroy = mjpeg_decoder_destroy;
     decoder->base.reschedule = mjpeg_decoder_reschedule;
     decoder->base.queue_frame = mjpeg_decoder_queue_frame;
+    decoder->base.present = mjpeg_decoder_present;
+    decoder->base.queue_length = mjpeg_decoder_queue_length;
     decoder->base.codec_type = codec_type;
     decoder->base.stream = stream;
 
     decoder->msgq = g_queue_new();
+    decoder->workq = g_queue_new();
+    decoder->decodedq = g_queue_new();
+    decoder->spare = g_queue_new();
+    g_mutex_init(&decoder->lock);
+    g_cond_init(&decoder->cond);
+    if (spice_thread_context())
+        decoder->context = g_main_context_ref(spice_thread_context());
 
     decoder->mjpeg_cinfo.err = jpeg_std_error(&decoder->mjpeg_jerr);
     jpeg_create_decompress(&decoder->mjpeg_cinfo);
@@ -299,6 +618,8 @@ VideoDecoder* create_mjpeg_decoder(int codec_type, display_stream *stream)
 
     /* All the other fields are initialized to zero by g_new0(). */
 
+    decoder->thread = g_thread_new("spice-mjpeg", mjpeg_decoder_thread, decoder);
+
     /* makes the draw-area visible */
     hand_pipeline_to_widget(stream, NULL);
 
@@ -46,8 +46,18 @@ struct SpiceFrame {
 
     /* stats */
     gint64 creation_time;
+    gboolean arrived_late;
 };
 
+/* Decoding settings of the video streams, see the SpiceDisplayChannel
+ * video-decoder-threads, video-low-latency and video-queue-depth
+ * properties. */
+typedef struct VideoDecoderTuning {
+    guint threads;
+    gboolean low_latency;
+    guint queue_depth;
+} VideoDecoderTuning;
+
 typedef struct VideoDecoder VideoDecoder;
 struct VideoDecoder {
     /* Releases the video decoder's resources */
@@ -68,6 +78,16 @@ struct VideoDecoder {
      */
     gboolean (*queue_frame)(VideoDecoder *video_decoder, SpiceFrame *frame, int margin);
 
+    /* Displays the most recent decoded frame that is due and drops the
+     * older ones. This replaces the decoder's own timers when the
+     * presentation is paced by the display's frame clock, see
+     * stream_is_paced().
+     */
+    void (*present)(VideoDecoder *video_decoder);
+
+    /* Returns the number of frames waiting to be decoded or displayed. */
+    guint (*queue_length)(VideoDecoder *video_decoder);
+
     /* The format of the encoded video. */
     int codec_type;
 
@@ -134,6 +154,18 @@ struct display_stream {
 
     uint32_t             playback_sync_drops_seq_len;
 
+    /* paced presentation */
+    uint32_t             present_mm_time;
+    uint32_t             num_presented;
+    uint32_t             num_late_on_playback;
+
+    /* telemetry, see spice_display_channel_get_stream_stats() */
+    uint32_t             margin_histogram[SPICE_DISPLAY_STREAM_MARGIN_BINS];
+    gint                 decode_time; /* atomic */
+    gint64               present_latency;
+    gint64               present_interval;
+    gint64               last_present_time;
+
     /* playback quality report to server */
     gboolean report_is_active;
     uint32_t report_id;
@@ -144,6 +176,7 @@ struct display_stream {
     uint32_t report_num_frames;
     uint32_t report_num_drops;
     uint32_t report_drops_seq_len;
+    gint report_playback_drops; /* atomic */
 };
 
 static const struct {
@@ -192,7 +225,10 @@ static const struct {
 G_STATIC_ASSERT(G_N_ELEMENTS(gst_opts) <= SPICE_VIDEO_CODEC_TYPE_ENUM_END);
 
 guint32 stream_get_time(display_stream *st);
-void stream_dropped_frame_on_playback(display_stream *st);
+void stream_dropped_frame_on_playback(display_stream *st, const SpiceFrame *frame);
+void stream_record_decode_time(display_stream *st, gint64 decode_time);
+gboolean stream_is_paced(display_stream *st);
+void stream_get_decoder_tuning(display_stream *st, VideoDecoderTuning *tuning);
 #define SPICE_UNKNOWN_STRIDE 0
 void stream_display_frame(display_stream *st, SpiceFrame *frame, uint32_t width, uint32_t height, int stride, uint8_t* data);
 guintptr get_window_handle(display_stream *st);
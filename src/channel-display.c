@@ -53,6 +53,9 @@
 
 struct _SpiceDisplayChannelPrivate {
     GHashTable                  *surfaces;
+    /* the primary and the mark are also read from the main context by
+     * spice_display_channel_get_primary(), set them with the lock held */
+    GMutex                      primary_lock;
     display_surface             *primary;
     display_cache               *images;
     display_cache               *palettes;
@@ -67,9 +70,47 @@ struct _SpiceDisplayChannelPrivate {
     GArray                      *monitors;
     guint                       monitors_max;
     gboolean                    enable_adaptive_streaming;
+    gboolean                    paced_presentation;
+    gboolean                    paced_presentation_requested;
+    gint64                      present_time;
+    VideoDecoderTuning          decoder_tuning;
+    guint                       stream_stats_interval;
+    gint64                      stream_stats_time;
     SpiceGlScanout scanout;
+    /* what the main context reads, copied from the channel when it notifies,
+     * the channel waiting meanwhile, see spice_display_channel_notify() */
+    SpiceGlScanout main_scanout;
+    guint                       main_n_streams;
+    SpiceSession                *session;
+    /* digests of the images to store on disk once decoded, by id */
+    GHashTable                  *store_digests;
+    /* messages held back while their images are decoded in threads */
+    GQueue                      decode_queue;
+    uint64_t                    decoded_id;
+    pixman_image_t              *decoded_image;
+    /* primary buffer updates not signaled yet, and since when */
+    pixman_region32_t           damage;
+    gint64                      damage_time;
 };
 
+typedef struct decode_queue_entry {
+    SpiceMsgIn     *in;
+    SpiceDecodeJob *job;
+    pixman_image_t *decoded;
+} decode_queue_entry;
+
+/* bounds the amount of read-ahead and of pending decoded images */
+#define DECODE_QUEUE_MAX_LEN 16
+
+/* the damage is signaled at least once per 60Hz frame, as its extents
+ * beyond that number of rectangles */
+#define DAMAGE_MAX_DELAY_US 16000
+#define DAMAGE_MAX_RECTS 64
+
+/* presents the stream frames anyway if the display frames stop coming,
+ * for instance when the window is hidden */
+#define PRESENT_MAX_DELAY_US 100000
+
 G_DEFINE_TYPE_WITH_PRIVATE(SpiceDisplayChannel, spice_display_channel, SPICE_TYPE_CHANNEL)
 
 /* Properties */
@@ -80,16 +121,24 @@ enum {
     PROP_MONITORS,
     PROP_MONITORS_MAX,
     PROP_GL_SCANOUT,
+    PROP_PACED_PRESENTATION,
+    PROP_N_VIDEO_STREAMS,
+    PROP_VIDEO_DECODER_THREADS,
+    PROP_VIDEO_LOW_LATENCY,
+    PROP_VIDEO_QUEUE_DEPTH,
+    PROP_STREAM_STATS_INTERVAL,
 };
 
 enum {
     SPICE_DISPLAY_PRIMARY_CREATE,
     SPICE_DISPLAY_PRIMARY_DESTROY,
     SPICE_DISPLAY_INVALIDATE,
+    SPICE_DISPLAY_INVALIDATE_REGION,
     SPICE_DISPLAY_MARK,
     SPICE_DISPLAY_GL_DRAW,
     SPICE_DISPLAY_STREAMING_MODE,
     SPICE_DISPLAY_OVERLAY,
+    SPICE_DISPLAY_STREAM_STATS,
 
     SPICE_DISPLAY_LAST_SIGNAL,
 };
@@ -100,9 +149,15 @@ static void spice_display_channel_up(SpiceChannel *channel);
 static void channel_set_handlers(SpiceChannelClass *klass);
 
 static void clear_surfaces(SpiceChannel *channel, gboolean keep_primary);
+static void display_flush_damage(SpiceChannel *channel);
 static void clear_streams(SpiceChannel *channel);
+static guint display_count_streams(SpiceDisplayChannelPrivate *c);
+static gboolean display_apply_paced_presentation(gpointer data);
 static display_surface *find_surface(SpiceDisplayChannelPrivate *c, guint32 surface_id);
 static void spice_display_channel_reset(SpiceChannel *channel, gboolean migrating);
+static void spice_display_handle_msg(SpiceChannel *channel, SpiceMsgIn *in);
+static void display_iterate_read(SpiceChannel *channel);
+static void display_decode_queue_clear(SpiceChannel *channel);
 static void spice_display_channel_set_capabilities(SpiceChannel *channel);
 static void destroy_canvas(display_surface *surface);
 static void display_stream_destroy(gpointer st);
@@ -155,6 +210,7 @@ static void spice_display_channel_dispose(GObject *object)
         close(c->scanout.fd);
         c->scanout.fd = -1;
     }
+    c->main_scanout.fd = -1;
 
     if (G_OBJECT_CLASS(spice_display_channel_parent_class)->dispose)
         G_OBJECT_CLASS(spice_display_channel_parent_class)->dispose(object);
@@ -165,8 +221,12 @@ static void spice_display_channel_finalize(GObject *object)
     SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(object)->priv;
 
     g_clear_pointer(&c->monitors, g_array_unref);
+    display_decode_queue_clear(SPICE_CHANNEL(object));
     clear_surfaces(SPICE_CHANNEL(object), FALSE);
+    pixman_region32_fini(&c->damage);
+    g_mutex_clear(&c->primary_lock);
     g_hash_table_unref(c->surfaces);
+    g_hash_table_unref(c->store_digests);
     clear_streams(SPICE_CHANNEL(object));
     g_clear_pointer(&c->palettes, cache_free);
 
@@ -180,6 +240,7 @@ static void spice_display_channel_constructed(GObject *object)
     SpiceSession *s = spice_channel_get_session(SPICE_CHANNEL(object));
 
     g_return_if_fail(s != NULL);
+    c->session = s;
     spice_session_get_caches(s, &c->images, &c->glz_window);
     c->palettes = cache_new(g_free);
 
@@ -208,11 +269,15 @@ static void spice_display_get_property(GObject    *object,
 
     switch (prop_id) {
     case PROP_WIDTH: {
+        g_mutex_lock(&c->primary_lock);
         g_value_set_uint(value, c->primary ? c->primary->width : 0);
+        g_mutex_unlock(&c->primary_lock);
         break;
     }
     case PROP_HEIGHT: {
+        g_mutex_lock(&c->primary_lock);
         g_value_set_uint(value, c->primary ? c->primary->height : 0);
+        g_mutex_unlock(&c->primary_lock);
         break;
     }
     case PROP_MONITORS: {
@@ -227,6 +292,24 @@ static void spice_display_get_property(GObject    *object,
         g_value_set_static_boxed(value, spice_display_channel_get_gl_scanout(channel));
         break;
     }
+    case PROP_PACED_PRESENTATION:
+        g_value_set_boolean(value, c->paced_presentation_requested);
+        break;
+    case PROP_N_VIDEO_STREAMS:
+        g_value_set_uint(value, c->main_n_streams);
+        break;
+    case PROP_VIDEO_DECODER_THREADS:
+        g_value_set_uint(value, c->decoder_tuning.threads);
+        break;
+    case PROP_VIDEO_LOW_LATENCY:
+        g_value_set_boolean(value, c->decoder_tuning.low_latency);
+        break;
+    case PROP_VIDEO_QUEUE_DEPTH:
+        g_value_set_uint(value, c->decoder_tuning.queue_depth);
+        break;
+    case PROP_STREAM_STATS_INTERVAL:
+        g_value_set_uint(value, c->stream_stats_interval);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
         break;
@@ -238,7 +321,25 @@ static void spice_display_set_property(GObject      *object,
                                        const GValue *value,
                                        GParamSpec   *pspec)
 {
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(object)->priv;
+
     switch (prop_id) {
+    case PROP_PACED_PRESENTATION:
+        c->paced_presentation_requested = g_value_get_boolean(value);
+        spice_channel_invoke(SPICE_CHANNEL(object), display_apply_paced_presentation);
+        break;
+    case PROP_VIDEO_DECODER_THREADS:
+        c->decoder_tuning.threads = g_value_get_uint(value);
+        break;
+    case PROP_VIDEO_LOW_LATENCY:
+        c->decoder_tuning.low_latency = g_value_get_boolean(value);
+        break;
+    case PROP_VIDEO_QUEUE_DEPTH:
+        c->decoder_tuning.queue_depth = g_value_get_uint(value);
+        break;
+    case PROP_STREAM_STATS_INTERVAL:
+        c->stream_stats_interval = g_value_get_uint(value);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
         break;
@@ -248,13 +349,38 @@ static void spice_display_set_property(GObject      *object,
 /* main or coroutine context */
 static void spice_display_channel_reset(SpiceChannel *channel, gboolean migrating)
 {
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+
+    /* the timer of a channel thread goes away with its context */
+    if (SPICE_CHANNEL(channel)->priv->thread != NULL && c->mark_false_event_id != 0) {
+        g_spice_source_remove(c->mark_false_event_id);
+        c->mark_false_event_id = 0;
+    }
+
     /* palettes, images, and glz_window are cleared in the session */
+    display_decode_queue_clear(channel);
+    g_hash_table_remove_all(c->store_digests);
     clear_streams(channel);
+    g_coroutine_object_notify(G_OBJECT(channel), "n-video-streams");
     clear_surfaces(channel, TRUE);
 
     SPICE_CHANNEL_CLASS(spice_display_channel_parent_class)->channel_reset(channel, migrating);
 }
 
+/* main context */
+static void spice_display_channel_notify(GObject *object, GParamSpec *pspec)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(object)->priv;
+
+    if (g_str_equal(pspec->name, "gl-scanout"))
+        c->main_scanout = c->scanout;
+    else if (g_str_equal(pspec->name, "n-video-streams"))
+        c->main_n_streams = display_count_streams(c);
+
+    if (G_OBJECT_CLASS(spice_display_channel_parent_class)->notify)
+        G_OBJECT_CLASS(spice_display_channel_parent_class)->notify(object, pspec);
+}
+
 static void spice_display_channel_class_init(SpiceDisplayChannelClass *klass)
 {
     GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
@@ -265,9 +391,12 @@ static void spice_display_channel_class_init(SpiceDisplayChannelClass *klass)
     gobject_class->get_property = spice_display_get_property;
     gobject_class->set_property = spice_display_set_property;
     gobject_class->constructed = spice_display_channel_constructed;
+    gobject_class->notify       = spice_display_channel_notify;
 
     channel_class->channel_up   = spice_display_channel_up;
     channel_class->channel_reset = spice_display_channel_reset;
+    channel_class->handle_msg   = spice_display_handle_msg;
+    channel_class->iterate_read = display_iterate_read;
 
     g_object_class_install_property
         (gobject_class, PROP_HEIGHT,
@@ -337,6 +466,114 @@ static void spice_display_channel_class_init(SpiceDisplayChannelClass *klass)
                             G_PARAM_READABLE |
                             G_PARAM_STATIC_STRINGS));
 
+    /**
+     * SpiceDisplayChannel:paced-presentation:
+     *
+     * When %TRUE, the video stream frames are no longer displayed on
+     * their own timers but by spice_display_channel_present(), which
+     * should then be called once per frame of the display, typically
+     * from a #GdkFrameClock tick.
+     *
+     * Since: 0.42
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_PACED_PRESENTATION,
+         g_param_spec_boolean("paced-presentation",
+                              "Paced presentation",
+                              "Whether the stream frames are presented by the display frames",
+                              FALSE,
+                              G_PARAM_READWRITE |
+                              G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceDisplayChannel:n-video-streams:
+     *
+     * The number of video streams currently played on the channel.
+     *
+     * Since: 0.42
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_N_VIDEO_STREAMS,
+         g_param_spec_uint("n-video-streams",
+                           "Number of video streams",
+                           "The number of video streams",
+                           0, G_MAXUINT, 0,
+                           G_PARAM_READABLE |
+                           G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceDisplayChannel:video-decoder-threads:
+     *
+     * The number of threads the GStreamer video decoders should use, or
+     * 0 to let them decide. This applies to the streams created after
+     * it is set.
+     *
+     * Since: 0.42
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_VIDEO_DECODER_THREADS,
+         g_param_spec_uint("video-decoder-threads",
+                           "Video decoder threads",
+                           "The number of threads of the video decoders",
+                           0, G_MAXINT, 0,
+                           G_PARAM_READWRITE |
+                           G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceDisplayChannel:video-low-latency:
+     *
+     * When %TRUE, the GStreamer video decoders are set up to output each
+     * frame as soon as it is decoded: the threads work on slices rather
+     * than on several frames at once, and damaged frames are shown
+     * rather than held back. This applies to the streams created after
+     * it is set.
+     *
+     * Since: 0.42
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_VIDEO_LOW_LATENCY,
+         g_param_spec_boolean("video-low-latency",
+                              "Video low latency",
+                              "Whether to favor latency over throughput when decoding",
+                              FALSE,
+                              G_PARAM_READWRITE |
+                              G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceDisplayChannel:video-queue-depth:
+     *
+     * The maximum number of frames the queues of the GStreamer pipelines
+     * can hold, or 0 for the GStreamer defaults. This applies to the
+     * streams created after it is set.
+     *
+     * Since: 0.42
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_VIDEO_QUEUE_DEPTH,
+         g_param_spec_uint("video-queue-depth",
+                           "Video queue depth",
+                           "The maximum number of frames in the decoding queues",
+                           0, G_MAXINT, 0,
+                           G_PARAM_READWRITE |
+                           G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceDisplayChannel:stream-stats-interval:
+     *
+     * The minimum time between two #SpiceDisplayChannel::stream-stats
+     * signals in milliseconds, or 0 to disable them.
+     *
+     * Since: 0.42
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_STREAM_STATS_INTERVAL,
+         g_param_spec_uint("stream-stats-interval",
+                           "Stream stats interval",
+                           "The interval between the stream stats signals in ms",
+                           0, G_MAXINT, 1000,
+                           G_PARAM_READWRITE |
+                           G_PARAM_STATIC_STRINGS));
+
     /**
      * SpiceDisplayChannel::display-primary-create:
      * @display: the #SpiceDisplayChannel that emitted the signal
@@ -394,6 +631,9 @@ static void spice_display_channel_class_init(SpiceDisplayChannelClass *klass)
      * The #SpiceDisplayChannel::display-invalidate signal is emitted
      * when the rectangular region x/y/w/h of the primary buffer is
      * updated.
+     *
+     * The updates are gathered and signaled at most once per frame,
+     * see #SpiceDisplayChannel::invalidate-region.
      **/
     signals[SPICE_DISPLAY_INVALIDATE] =
         g_signal_new("display-invalidate",
@@ -407,6 +647,32 @@ static void spice_display_channel_class_init(SpiceDisplayChannelClass *klass)
                      4,
                      G_TYPE_INT, G_TYPE_INT, G_TYPE_INT, G_TYPE_INT);
 
+    /**
+     * SpiceDisplayChannel::invalidate-region:
+     * @display: the #SpiceDisplayChannel that emitted the signal
+     * @rects: (array length=n_rects) (element-type SpiceDisplayRect):
+     * the updated rectangles
+     * @n_rects: the number of rectangles
+     *
+     * The #SpiceDisplayChannel::invalidate-region signal is emitted
+     * once for all the updates of the primary buffer done while
+     * processing the messages received together, or at least once per
+     * frame. The rectangles don't overlap. It is emitted before the
+     * #SpiceDisplayChannel::display-invalidate signals for the same
+     * rectangles.
+     *
+     * Since: 0.42
+     **/
+    signals[SPICE_DISPLAY_INVALIDATE_REGION] =
+        g_signal_new("invalidate-region",
+                     G_OBJECT_CLASS_TYPE(gobject_class),
+                     G_SIGNAL_RUN_FIRST,
+                     0, NULL, NULL,
+                     g_cclosure_user_marshal_VOID__POINTER_UINT,
+                     G_TYPE_NONE,
+                     2,
+                     G_TYPE_POINTER, G_TYPE_UINT);
+
     /**
      * SpiceDisplayChannel::display-mark:
      * @display: the #SpiceDisplayChannel that emitted the signal
@@ -502,6 +768,29 @@ static void spice_display_channel_class_init(SpiceDisplayChannelClass *klass)
                      1,
                      GST_TYPE_PIPELINE);
 
+    /**
+     * SpiceDisplayChannel::stream-stats:
+     * @display: the #SpiceDisplayChannel that emitted the signal
+     * @stats: (element-type SpiceDisplayStreamStats): the statistics of
+     * the video streams
+     *
+     * The #SpiceDisplayChannel::stream-stats signal is emitted
+     * periodically while video streams are played, at most once per
+     * #SpiceDisplayChannel:stream-stats-interval, with the same
+     * statistics as spice_display_channel_get_stream_stats().
+     *
+     * Since: 0.42
+     **/
+    signals[SPICE_DISPLAY_STREAM_STATS] =
+        g_signal_new("stream-stats",
+                     G_OBJECT_CLASS_TYPE(gobject_class),
+                     G_SIGNAL_RUN_FIRST,
+                     0, NULL, NULL,
+                     g_cclosure_marshal_VOID__BOXED,
+                     G_TYPE_NONE,
+                     1,
+                     G_TYPE_ARRAY);
+
     channel_set_handlers(SPICE_CHANNEL_CLASS(klass));
 }
 
@@ -544,12 +833,16 @@ gboolean spice_display_channel_get_primary(SpiceChannel *channel, guint32 surfac
     g_return_val_if_fail(primary != NULL, FALSE);
 
     SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
-    display_surface *surface = find_surface(c, surface_id);
+    display_surface *surface;
 
-    if (surface == NULL)
+    /* the channel may run in a thread of its own, and only the primary
+     * is looked at here rather than the other surfaces */
+    g_mutex_lock(&c->primary_lock);
+    surface = c->primary;
+    if (surface == NULL || surface->surface_id != surface_id) {
+        g_mutex_unlock(&c->primary_lock);
         return FALSE;
-
-    g_return_val_if_fail(surface->primary, FALSE);
+    }
 
     primary->format = surface->format;
     primary->width = surface->width;
@@ -558,6 +851,7 @@ gboolean spice_display_channel_get_primary(SpiceChannel *channel, guint32 surfac
     primary->shmid = -1;
     primary->data = surface->data;
     primary->marked = c->mark;
+    g_mutex_unlock(&c->primary_lock);
     CHANNEL_DEBUG(channel, "get primary %p", primary->data);
 
     return TRUE;
@@ -771,7 +1065,177 @@ spice_display_channel_get_gl_scanout(SpiceDisplayChannel *channel)
 {
     g_return_val_if_fail(SPICE_IS_DISPLAY_CHANNEL(channel), NULL);
 
-    return channel->priv->scanout.fd != -1 ? &channel->priv->scanout : NULL;
+    return channel->priv->main_scanout.fd != -1 ? &channel->priv->main_scanout : NULL;
+}
+
+static guint display_count_streams(SpiceDisplayChannelPrivate *c)
+{
+    guint n = 0;
+    int i;
+
+    for (i = 0; i < c->nstreams; i++) {
+        if (c->streams[i] != NULL)
+            n++;
+    }
+    return n;
+}
+
+/* channel context */
+static gboolean display_apply_paced_presentation(gpointer data)
+{
+    SpiceChannel *channel = data;
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    gboolean paced = !!c->paced_presentation_requested;
+    int i;
+
+    if (c->paced_presentation == paced)
+        return G_SOURCE_REMOVE;
+
+    CHANNEL_DEBUG(channel, "paced presentation: %d", paced);
+    c->paced_presentation = paced;
+    c->present_time = g_get_monotonic_time();
+    /* let the decoders arm or cancel their own timers */
+    for (i = 0; i < c->nstreams; i++) {
+        display_stream *st = c->streams[i];
+
+        if (st == NULL)
+            continue;
+        st->present_mm_time = 0;
+        st->video_decoder->reschedule(st->video_decoder);
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+/* channel context */
+static gboolean display_present(gpointer data)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(data)->priv;
+    int i;
+
+    if (!c->paced_presentation)
+        return G_SOURCE_REMOVE;
+
+    c->present_time = g_get_monotonic_time();
+
+    for (i = 0; i < c->nstreams; i++) {
+        display_stream *st = c->streams[i];
+        guint32 now;
+
+        if (st == NULL)
+            continue;
+        now = stream_get_time(st);
+        st->video_decoder->present(st->video_decoder);
+        st->present_mm_time = now ? now : 1;
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * spice_display_channel_present:
+ * @channel: a #SpiceDisplayChannel
+ *
+ * Displays, for each video stream, the most recent frame that is due,
+ * dropping the older ones. This should be called once per frame of the
+ * display when #SpiceDisplayChannel:paced-presentation is set, and does
+ * nothing otherwise.
+ *
+ * Since: 0.42
+ **/
+void spice_display_channel_present(SpiceDisplayChannel *channel)
+{
+    g_return_if_fail(SPICE_IS_DISPLAY_CHANNEL(channel));
+
+    if (!channel->priv->paced_presentation_requested)
+        return;
+
+    spice_channel_invoke(SPICE_CHANNEL(channel), display_present);
+}
+
+static void display_stream_get_stats(display_stream *st, SpiceDisplayStreamStats *stats)
+{
+    gint64 interval = st->present_interval;
+
+    stats->id = st->id;
+    stats->codec_type = st->video_decoder->codec_type;
+    stats->num_frames = st->num_input_frames;
+    stats->num_presented = st->num_presented;
+    stats->num_arrived_late = st->arrive_late_count;
+    stats->num_dropped_on_playback = st->num_drops_on_playback;
+    stats->num_late_on_playback = st->num_late_on_playback;
+    memcpy(stats->margin_histogram, st->margin_histogram, sizeof(stats->margin_histogram));
+    stats->decode_time = g_atomic_int_get(&st->decode_time);
+    stats->queue_length = st->video_decoder->queue_length(st->video_decoder);
+    stats->present_latency = st->present_latency;
+
+    /* account for the time since the last frame when the stream stalls */
+    if (st->last_present_time != 0) {
+        interval = MAX(interval, g_get_monotonic_time() - st->last_present_time);
+    }
+    stats->fps = interval > 0 ? G_USEC_PER_SEC / (gdouble)interval : 0;
+}
+
+/**
+ * spice_display_channel_get_stream_stats:
+ * @channel: a #SpiceDisplayChannel
+ *
+ * Retrieves the playback statistics of the video streams currently
+ * played on @channel.
+ *
+ * The streams of a channel running in a thread of its own (see
+ * #SpiceSession:threaded-channels) can't be inspected from another
+ * thread: use the #SpiceDisplayChannel::stream-stats signal instead,
+ * this returns an empty array for them.
+ *
+ * Returns: (transfer full) (element-type SpiceDisplayStreamStats): a
+ * #GArray of #SpiceDisplayStreamStats, one per stream
+ *
+ * Since: 0.42
+ **/
+GArray *spice_display_channel_get_stream_stats(SpiceDisplayChannel *channel)
+{
+    SpiceDisplayChannelPrivate *c;
+    GThread *thread;
+    GArray *stats;
+    int i;
+
+    g_return_val_if_fail(SPICE_IS_DISPLAY_CHANNEL(channel), NULL);
+
+    c = channel->priv;
+    stats = g_array_new(FALSE, TRUE, sizeof(SpiceDisplayStreamStats));
+    thread = SPICE_CHANNEL(channel)->priv->thread;
+    if (thread != NULL && thread != g_thread_self())
+        return stats;
+    for (i = 0; i < c->nstreams; i++) {
+        SpiceDisplayStreamStats stream_stats;
+
+        if (c->streams[i] == NULL)
+            continue;
+        display_stream_get_stats(c->streams[i], &stream_stats);
+        g_array_append_val(stats, stream_stats);
+    }
+    return stats;
+}
+
+/* coroutine context */
+static void display_emit_stream_stats(SpiceChannel *channel)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    gint64 now = g_get_monotonic_time();
+    GArray *stats;
+
+    if (c->stream_stats_interval == 0 ||
+        now - c->stream_stats_time < c->stream_stats_interval * (gint64)1000)
+        return;
+    c->stream_stats_time = now;
+
+    if (!g_signal_has_handler_pending(channel, signals[SPICE_DISPLAY_STREAM_STATS], 0, FALSE))
+        return;
+
+    stats = spice_display_channel_get_stream_stats(SPICE_DISPLAY_CHANNEL(channel));
+    g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_STREAM_STATS], 0, stats);
+    g_array_unref(stats);
 }
 
 /* ------------------------------------------------------------------ */
@@ -780,8 +1244,19 @@ static void image_put(SpiceImageCache *cache, uint64_t id, pixman_image_t *image
 {
     SpiceDisplayChannelPrivate *c =
         SPICE_CONTAINEROF(cache, SpiceDisplayChannelPrivate, image_cache);
+    guint8 *digest = g_hash_table_lookup(c->store_digests, &id);
+    SpiceImageStore *store;
 
+    spice_session_images_lock(c->session);
     cache_add(c->images, id, pixman_image_ref(image));
+    spice_session_images_notify(c->session, id);
+    /* see display_stored_image() */
+    store = spice_session_get_image_store(c->session);
+    if (store != NULL && digest != NULL)
+        image_store_put(store, id, digest, image);
+    spice_session_images_unlock(c->session);
+
+    g_hash_table_remove(c->store_digests, &id);
 }
 
 typedef struct _WaitImageData
@@ -798,25 +1273,58 @@ static gboolean wait_image(gpointer data)
     WaitImageData *wait = data;
     SpiceDisplayChannelPrivate *c =
         SPICE_CONTAINEROF(wait->cache, SpiceDisplayChannelPrivate, image_cache);
-    pixman_image_t *image = cache_find_lossy(c->images, wait->id, &lossy);
+    pixman_image_t *image;
 
-    if (!image || (lossy && !wait->lossy))
-        return FALSE;
+    spice_session_images_lock(c->session);
+    image = cache_find_lossy(c->images, wait->id, &lossy);
+    if (image != NULL && (!lossy || wait->lossy))
+        wait->image = pixman_image_ref(image);
+    spice_session_images_unlock(c->session);
 
-    wait->image = pixman_image_ref(image);
+    return wait->image != NULL;
+}
 
-    return TRUE;
+/*
+ * The server may refer to an image it sent in a previous connection
+ * (after a migration for example), look it up on disk if it isn't in
+ * memory anymore.
+ */
+static gboolean image_get_stored(SpiceDisplayChannelPrivate *c, uint64_t id,
+                                 pixman_image_t **image)
+{
+    SpiceImageStore *store;
+
+    *image = NULL;
+    spice_session_images_lock(c->session);
+    store = spice_session_get_image_store(c->session);
+    /* the server didn't send it in this connection, so it doesn't belong
+     * in the cache it manages */
+    if (store != NULL && cache_find(c->images, id) == NULL)
+        *image = image_store_lookup(store, id, NULL, -1, -1);
+    spice_session_images_unlock(c->session);
+
+    return *image != NULL;
 }
 
 static pixman_image_t *image_get(SpiceImageCache *cache, uint64_t id)
 {
+    SpiceDisplayChannelPrivate *c =
+        SPICE_CONTAINEROF(cache, SpiceDisplayChannelPrivate, image_cache);
     WaitImageData wait = {
         .lossy = TRUE,
         .cache = cache,
         .id = id,
         .image = NULL
     };
-    if (!g_coroutine_condition_wait(g_coroutine_self(), wait_image, &wait))
+
+    /* decoded in a thread, see display_decode_queue_flush() */
+    if (c->decoded_image != NULL && c->decoded_id == id)
+        return pixman_image_ref(c->decoded_image);
+
+    if (image_get_stored(c, id, &wait.image))
+        return wait.image;
+
+    if (!spice_session_images_wait(c->session, id, wait_image, &wait))
         SPICE_DEBUG("wait image got cancelled");
 
     return wait.image;
@@ -862,11 +1370,17 @@ static void image_put_lossy(SpiceImageCache *cache, uint64_t id,
     SpiceDisplayChannelPrivate *c =
         SPICE_CONTAINEROF(cache, SpiceDisplayChannelPrivate, image_cache);
 
+    spice_session_images_lock(c->session);
 #ifndef NDEBUG
     g_warn_if_fail(cache_find(c->images, id) == NULL);
 #endif
 
     cache_add_lossy(c->images, id, pixman_image_ref(surface), TRUE);
+    spice_session_images_notify(c->session, id);
+    spice_session_images_unlock(c->session);
+
+    /* lossy images are replaced later by the server, don't store them */
+    g_hash_table_remove(c->store_digests, &id);
 }
 
 static void image_replace_lossy(SpiceImageCache *cache, uint64_t id,
@@ -875,18 +1389,31 @@ static void image_replace_lossy(SpiceImageCache *cache, uint64_t id,
     SpiceDisplayChannelPrivate *c =
         SPICE_CONTAINEROF(cache, SpiceDisplayChannelPrivate, image_cache);
 
+    spice_session_images_lock(c->session);
     cache_replace_lossy(c->images, id, pixman_image_ref(surface), FALSE);
+    /* wakes up the ones waiting for the lossless image */
+    spice_session_images_notify(c->session, id);
+    spice_session_images_unlock(c->session);
 }
 
 static pixman_image_t* image_get_lossless(SpiceImageCache *cache, uint64_t id)
 {
+    SpiceDisplayChannelPrivate *c =
+        SPICE_CONTAINEROF(cache, SpiceDisplayChannelPrivate, image_cache);
     WaitImageData wait = {
         .lossy = FALSE,
         .cache = cache,
         .id = id,
         .image = NULL
     };
-    if (!g_coroutine_condition_wait(g_coroutine_self(), wait_image, &wait))
+
+    if (c->decoded_image != NULL && c->decoded_id == id)
+        return pixman_image_ref(c->decoded_image);
+
+    if (image_get_stored(c, id, &wait.image))
+        return wait.image;
+
+    if (!spice_session_images_wait(c->session, id, wait_image, &wait))
         SPICE_DEBUG("wait lossless got cancelled");
 
     return wait.image;
@@ -969,11 +1496,17 @@ static void spice_display_channel_init(SpiceDisplayChannel *channel)
     c = channel->priv = spice_display_channel_get_instance_private(channel);
 
     c->surfaces = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, destroy_surface);
+    c->store_digests = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, g_free);
     c->image_cache.ops = &image_cache_ops;
     c->palette_cache.ops = &palette_cache_ops;
     c->image_surfaces.ops = &image_surfaces_ops;
     c->monitors_max = 1;
     c->scanout.fd = -1;
+    c->main_scanout.fd = -1;
+    c->stream_stats_interval = 1000;
+    g_queue_init(&c->decode_queue);
+    pixman_region32_init(&c->damage);
+    g_mutex_init(&c->primary_lock);
 
     if (g_getenv("SPICE_DISABLE_ADAPTIVE_STREAMING")) {
         SPICE_DEBUG("adaptive video disabled");
@@ -985,12 +1518,28 @@ static void spice_display_channel_init(SpiceDisplayChannel *channel)
 
 /* ------------------------------------------------------------------ */
 
+static void display_set_primary(SpiceDisplayChannelPrivate *c, display_surface *surface)
+{
+    g_mutex_lock(&c->primary_lock);
+    c->primary = surface;
+    g_mutex_unlock(&c->primary_lock);
+}
+
+static void display_set_mark(SpiceDisplayChannelPrivate *c, gboolean mark)
+{
+    g_mutex_lock(&c->primary_lock);
+    c->mark = mark;
+    g_mutex_unlock(&c->primary_lock);
+}
+
 static int create_canvas(SpiceChannel *channel, display_surface *surface)
 {
     SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
 
     if (surface->primary) {
         if (c->primary) {
+            guint32 primary_id = c->primary->surface_id;
+
             if (c->primary->width == surface->width &&
                 c->primary->height == surface->height) {
                 g_free(surface);
@@ -998,10 +1547,11 @@ static int create_canvas(SpiceChannel *channel, display_surface *surface)
                 return 0;
             }
 
+            display_flush_damage(channel);
             g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_PRIMARY_DESTROY], 0);
 
-            g_hash_table_remove(c->surfaces, GINT_TO_POINTER(c->primary->surface_id));
-            c->primary = NULL;
+            display_set_primary(c, NULL);
+            g_hash_table_remove(c->surfaces, GINT_TO_POINTER(primary_id));
         }
 
         CHANNEL_DEBUG(channel, "Create primary canvas");
@@ -1036,7 +1586,7 @@ static int create_canvas(SpiceChannel *channel, display_surface *surface)
 
     if (surface->primary) {
         g_warn_if_fail(c->primary == NULL);
-        c->primary = surface;
+        display_set_primary(c, surface);
         g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_PRIMARY_CREATE], 0,
                                 surface->format, surface->width, surface->height,
                                 surface->stride, -1, surface->data);
@@ -1083,7 +1633,8 @@ static void clear_surfaces(SpiceChannel *channel, gboolean keep_primary)
     display_surface *surface;
 
     if (!keep_primary) {
-        c->primary = NULL;
+        display_set_primary(c, NULL);
+        pixman_region32_clear(&c->damage);
         g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_PRIMARY_DESTROY], 0);
     }
 
@@ -1099,13 +1650,58 @@ static void clear_surfaces(SpiceChannel *channel, gboolean keep_primary)
     }
 }
 
-/* coroutine context */
+/* signals the damage gathered so far, in coroutine or main context */
+static void display_flush_damage(SpiceChannel *channel)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    SpiceDisplayChannelClass *klass = SPICE_DISPLAY_CHANNEL_GET_CLASS(channel);
+    pixman_box32_t *boxes;
+    SpiceDisplayRect *rects;
+    int i, n;
+
+    if (!pixman_region32_not_empty(&c->damage))
+        return;
+
+    boxes = pixman_region32_rectangles(&c->damage, &n);
+    if (n > DAMAGE_MAX_RECTS) {
+        boxes = pixman_region32_extents(&c->damage);
+        n = 1;
+    }
+    rects = g_new(SpiceDisplayRect, n);
+    for (i = 0; i < n; i++) {
+        rects[i].x = boxes[i].x1;
+        rects[i].y = boxes[i].y1;
+        rects[i].width = boxes[i].x2 - boxes[i].x1;
+        rects[i].height = boxes[i].y2 - boxes[i].y1;
+    }
+    /* the handlers run in the main context, which may add damage */
+    pixman_region32_clear(&c->damage);
+
+    g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_INVALIDATE_REGION], 0,
+                            rects, (guint)n);
+    /* each emission from the coroutine costs a switch to the main one */
+    if (klass->display_invalidate != NULL ||
+        g_signal_has_handler_pending(channel, signals[SPICE_DISPLAY_INVALIDATE], 0, TRUE)) {
+        for (i = 0; i < n; i++) {
+            g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_INVALIDATE], 0,
+                                    rects[i].x, rects[i].y,
+                                    rects[i].width, rects[i].height);
+        }
+    }
+    g_free(rects);
+}
+
 static void emit_invalidate(SpiceChannel *channel, SpiceRect *bbox)
 {
-    g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_INVALIDATE], 0,
-                            bbox->left, bbox->top,
-                            bbox->right - bbox->left,
-                            bbox->bottom - bbox->top);
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+
+    if (!pixman_region32_not_empty(&c->damage))
+        c->damage_time = g_get_monotonic_time();
+
+    pixman_region32_union_rect(&c->damage, &c->damage,
+                               bbox->left, bbox->top,
+                               bbox->right - bbox->left,
+                               bbox->bottom - bbox->top);
 }
 
 /* ------------------------------------------------------------------ */
@@ -1186,7 +1782,8 @@ static void display_handle_mark(SpiceChannel *channel, SpiceMsgIn *in)
     g_warn_if_fail(c->mark == FALSE);
 #endif
 
-    c->mark = TRUE;
+    display_set_mark(c, TRUE);
+    display_flush_damage(channel);
     g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_MARK], 0, TRUE);
 }
 
@@ -1203,7 +1800,7 @@ static void display_handle_reset(SpiceChannel *channel, SpiceMsgIn *in)
 
     cache_clear(c->palettes);
 
-    c->mark = FALSE;
+    display_set_mark(c, FALSE);
     g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_MARK], 0, FALSE);
 }
 
@@ -1229,6 +1826,7 @@ static void display_handle_inv_list(SpiceChannel *channel, SpiceMsgIn *in)
     SpiceResourceList *list = spice_msg_in_parsed(in);
     int i;
 
+    spice_session_images_lock(c->session);
     for (i = 0; i < list->count; i++) {
         guint64 id = list->resources[i].id;
 
@@ -1238,10 +1836,11 @@ static void display_handle_inv_list(SpiceChannel *channel, SpiceMsgIn *in)
                 SPICE_DEBUG("fail to remove image %" G_GUINT64_FORMAT, id);
             break;
         default:
-            g_return_if_reached();
+            g_warn_if_reached();
             break;
         }
     }
+    spice_session_images_unlock(c->session);
 }
 
 /* coroutine context */
@@ -1250,7 +1849,9 @@ static void display_handle_inv_pixmap_all(SpiceChannel *channel, SpiceMsgIn *in)
     SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
 
     spice_channel_handle_wait_for_channels(channel, in);
+    spice_session_images_lock(c->session);
     cache_clear(c->images);
+    spice_session_images_unlock(c->session);
 }
 
 /* coroutine context */
@@ -1401,6 +2002,7 @@ static void display_handle_stream_create(SpiceChannel *channel, SpiceMsgIn *in)
         destroy_stream(channel, op->id);
         report_invalid_stream(channel, op->id);
     }
+    g_coroutine_object_notify(G_OBJECT(channel), "n-video-streams");
 }
 
 static const SpiceRect *stream_get_dest(display_stream *st, SpiceMsgIn *frame_msg)
@@ -1442,11 +2044,45 @@ guint32 stream_get_time(display_stream *st)
     return session ? spice_session_get_mm_time(session) : 0;
 }
 
-/* coroutine or main context */
+/* coroutine or main context, or GStreamer thread */
 G_GNUC_INTERNAL
-void stream_dropped_frame_on_playback(display_stream *st)
+void stream_dropped_frame_on_playback(display_stream *st, const SpiceFrame *frame)
 {
     st->num_drops_on_playback++;
+
+    /* the frames that arrived late are already counted as drops by the
+     * stream reports, but not the ones that are never displayed anyway */
+    if (frame != NULL && !frame->arrived_late) {
+        g_atomic_int_inc(&st->report_playback_drops);
+    }
+}
+
+/* moving average of the stream statistics */
+static gint64 stats_average(gint64 average, gint64 value)
+{
+    return average == 0 ? value : average + (value - average) / 8;
+}
+
+/* main context, or decoding thread */
+G_GNUC_INTERNAL
+void stream_record_decode_time(display_stream *st, gint64 decode_time)
+{
+    gint average = g_atomic_int_get(&st->decode_time);
+
+    decode_time = MIN(decode_time, G_MAXINT);
+    g_atomic_int_set(&st->decode_time, stats_average(average, decode_time));
+}
+
+G_GNUC_INTERNAL
+gboolean stream_is_paced(display_stream *st)
+{
+    return SPICE_DISPLAY_CHANNEL(st->channel)->priv->paced_presentation;
+}
+
+G_GNUC_INTERNAL
+void stream_get_decoder_tuning(display_stream *st, VideoDecoderTuning *tuning)
+{
+    *tuning = SPICE_DISPLAY_CHANNEL(st->channel)->priv->decoder_tuning;
 }
 
 /* main context */
@@ -1454,6 +2090,8 @@ G_GNUC_INTERNAL
 void stream_display_frame(display_stream *st, SpiceFrame *frame,
                           uint32_t width, uint32_t height, int stride, uint8_t *data)
 {
+    gint64 now;
+
     if (stride == SPICE_UNKNOWN_STRIDE) {
         stride = width * sizeof(uint32_t);
     }
@@ -1462,16 +2100,29 @@ void stream_display_frame(display_stream *st, SpiceFrame *frame,
         stride = -stride;
     }
 
+    now = g_get_monotonic_time();
+    st->present_latency = stats_average(st->present_latency, now - frame->creation_time);
+    if (st->last_present_time != 0) {
+        st->present_interval = stats_average(st->present_interval,
+                                             now - st->last_present_time);
+    }
+    st->last_present_time = now;
+
+    /* a frame that was already due on the previous display frame is late */
+    st->num_presented++;
+    if (st->present_mm_time != 0 &&
+        spice_mmtime_diff(frame->mm_time, st->present_mm_time) <= 0) {
+        st->num_late_on_playback++;
+    }
+
     st->surface->canvas->ops->put_image(st->surface->canvas,
                                         &frame->dest, data,
                                         width, height, stride,
                                         st->have_region ? &st->region : NULL);
 
     if (st->surface->primary) {
-        g_signal_emit(st->channel, signals[SPICE_DISPLAY_INVALIDATE], 0,
-                      frame->dest.left, frame->dest.top,
-                      frame->dest.right - frame->dest.left,
-                      frame->dest.bottom - frame->dest.top);
+        emit_invalidate(st->channel, &frame->dest);
+        display_flush_damage(st->channel);
     }
 }
 
@@ -1481,8 +2132,8 @@ gboolean hand_pipeline_to_widget(display_stream *st, GstPipeline *pipeline)
     gboolean res = false;
 
     if (st->surface->streaming_mode) {
-        g_signal_emit(st->channel, signals[SPICE_DISPLAY_OVERLAY], 0,
-                      pipeline, &res);
+        g_coroutine_signal_emit(st->channel, signals[SPICE_DISPLAY_OVERLAY], 0,
+                                pipeline, &res);
     }
     return res;
 }
@@ -1496,6 +2147,7 @@ static void display_update_stream_report(SpiceDisplayChannel *channel, uint32_t
 {
     display_stream *st = get_stream_by_id(SPICE_CHANNEL(channel), stream_id);
     guint64 now;
+    gint playback_drops;
 
     g_return_if_fail(st != NULL);
     if (!st->report_is_active) {
@@ -1515,6 +2167,10 @@ static void display_update_stream_report(SpiceDisplayChannel *channel, uint32_t
     } else {
         st->report_drops_seq_len = 0;
     }
+    playback_drops = g_atomic_int_get(&st->report_playback_drops);
+    g_atomic_int_add(&st->report_playback_drops, -playback_drops);
+    st->report_num_drops = MIN(st->report_num_drops + playback_drops,
+                               st->report_num_frames);
 
     if (st->report_num_frames >= st->report_max_window ||
         spice_mmtime_diff(now - st->report_start_time, st->report_timeout) >= 0 ||
@@ -1633,6 +2289,14 @@ static void display_stream_stats_debug(display_stream *st)
         avg_late_time,
         st->num_drops_on_playback);
 
+    if (st->num_presented) {
+        CHANNEL_DEBUG(st->channel,
+                      "%s: #presented=%u #late-on-playback=%u",
+                      __FUNCTION__,
+                      st->num_presented,
+                      st->num_late_on_playback);
+    }
+
     if (st->num_drops_seqs) {
         CHANNEL_DEBUG(st->channel,
                       "%s: #drops-sequences=%u ==>",
@@ -1662,17 +2326,30 @@ static void display_stream_stats_debug(display_stream *st)
 }
 
 
+/* the upper limits of the margin histogram bins in milliseconds, see
+ * SpiceDisplayStreamStats */
+static const gint32 margin_bin_limits[SPICE_DISPLAY_STREAM_MARGIN_BINS - 1] = {
+    0, 10, 20, 50, 100, 200, 400
+};
+
 static void display_stream_stats_save(display_stream *st,
                                       guint32 frame_mmtime,
                                       guint32 current_mmtime)
 {
     gint32 margin = frame_mmtime - current_mmtime;
+    guint bin;
 
     if (!st->num_input_frames) {
         st->first_frame_mm_time = frame_mmtime;
     }
     st->num_input_frames++;
 
+    for (bin = 0; bin < G_N_ELEMENTS(margin_bin_limits); bin++) {
+        if (margin < margin_bin_limits[bin])
+            break;
+    }
+    st->margin_histogram[bin]++;
+
     if (margin < 0) {
         CHANNEL_DEBUG(st->channel, "stream data too late by %u ms (ts: %u, mmtime: %u)",
                       current_mmtime - frame_mmtime, frame_mmtime, current_mmtime);
@@ -1770,12 +2447,20 @@ static void display_handle_stream_data(SpiceChannel *channel, SpiceMsgIn *in)
      * taking into account the impact on later frames.
      */
     frame = spice_frame_new(st, in, op->multi_media_time);
+    frame->arrived_late = margin_report < 0;
     if (!st->video_decoder->queue_frame(st->video_decoder, frame, margin)) {
         destroy_stream(channel, op->id);
         report_invalid_stream(channel, op->id);
         return;
     }
 
+    if (c->paced_presentation &&
+        g_get_monotonic_time() - c->present_time > PRESENT_MAX_DELAY_US) {
+        display_present(channel);
+    }
+
+    display_emit_stream_stats(channel);
+
     if (c->enable_adaptive_streaming) {
         display_update_stream_report(SPICE_DISPLAY_CHANNEL(channel), op->id,
                                      op->multi_media_time, margin_report);
@@ -1832,12 +2517,14 @@ static void display_handle_stream_destroy(SpiceChannel *channel, SpiceMsgIn *in)
     g_return_if_fail(op != NULL);
     CHANNEL_DEBUG(channel, "%s: id %u", __FUNCTION__, op->id);
     destroy_stream(channel, op->id);
+    g_coroutine_object_notify(G_OBJECT(channel), "n-video-streams");
 }
 
 /* coroutine context */
 static void display_handle_stream_destroy_all(SpiceChannel *channel, SpiceMsgIn *in)
 {
     clear_streams(channel);
+    g_coroutine_object_notify(G_OBJECT(channel), "n-video-streams");
 }
 
 /* coroutine context */
@@ -1856,6 +2543,7 @@ static void display_handle_stream_activate_report(SpiceChannel *channel, SpiceMs
     st->report_num_frames = 0;
     st->report_num_drops = 0;
     st->report_drops_seq_len = 0;
+    g_atomic_int_set(&st->report_playback_drops, 0);
 }
 
 /* ------------------------------------------------------------------ */
@@ -1984,8 +2672,8 @@ static gboolean display_mark_false(gpointer data)
     SpiceChannel *channel = data;
     SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
 
-    c->mark = FALSE;
-    g_signal_emit(channel, signals[SPICE_DISPLAY_MARK], 0, FALSE);
+    display_set_mark(c, FALSE);
+    g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_MARK], 0, FALSE);
 
     c->mark_false_event_id = 0;
     return FALSE;
@@ -2013,7 +2701,8 @@ static void display_handle_surface_destroy(SpiceChannel *channel, SpiceMsgIn *in
         if (id != 0 && c->mark_false_event_id == 0) {
             c->mark_false_event_id = g_spice_timeout_add_seconds(1, display_mark_false, channel);
         }
-        c->primary = NULL;
+        display_set_primary(c, NULL);
+        display_flush_damage(channel);
         g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_PRIMARY_DESTROY], 0);
     }
 
@@ -2076,6 +2765,7 @@ static void display_handle_gl_scanout_unix(SpiceChannel *channel, SpiceMsgIn *in
     SpiceDisplayChannel *display = SPICE_DISPLAY_CHANNEL(channel);
     SpiceDisplayChannelPrivate *c = display->priv;
     SpiceMsgDisplayGlScanoutUnix *scanout = spice_msg_in_parsed(in);
+    int old_fd = c->scanout.fd;
 
     scanout->drm_dma_buf_fd = -1;
     if (scanout->drm_fourcc_format != 0) {
@@ -2084,8 +2774,6 @@ static void display_handle_gl_scanout_unix(SpiceChannel *channel, SpiceMsgIn *in
     }
 
     c->scanout.y0top = scanout->flags & SPICE_GL_SCANOUT_FLAGS_Y0TOP;
-    if (c->scanout.fd >= 0)
-        close(c->scanout.fd);
     c->scanout.fd = scanout->drm_dma_buf_fd;
     c->scanout.width = scanout->width;
     c->scanout.height = scanout->height;
@@ -2093,6 +2781,10 @@ static void display_handle_gl_scanout_unix(SpiceChannel *channel, SpiceMsgIn *in
     c->scanout.format = scanout->drm_fourcc_format;
 
     g_coroutine_object_notify(G_OBJECT(channel), "gl-scanout");
+
+    /* the main context has the new scanout now, not the old one anymore */
+    if (old_fd >= 0)
+        close(old_fd);
 }
 #endif
 
@@ -2150,6 +2842,317 @@ void spice_display_channel_gl_draw_done(SpiceDisplayChannel *display)
     spice_msg_out_send_internal(out);
 }
 
+/* ------------------------------------------------------------------ */
+/* images decoded in threads, or saved on disk by a previous connection */
+
+/*
+ * The images are decoded in threads as canvas_get_image() caches them,
+ * only a plain copy to a 32-bit surface then gives the same result as
+ * decoding them in the surface canvas.
+ */
+static gboolean display_can_draw_decoded(SpiceDisplayChannelPrivate *c,
+                                         SpiceMsgDisplayDrawCopy *op)
+{
+    display_surface *surface = find_surface(c, op->base.surface_id);
+
+    return surface != NULL && surface->canvas != NULL &&
+           surface->format == SPICE_SURFACE_FMT_32_xRGB &&
+           op->data.src_bitmap != NULL &&
+           op->data.mask.bitmap == NULL &&
+           op->data.rop_descriptor == SPICE_ROPD_OP_PUT;
+}
+
+static gboolean decode_queue_job_done(gpointer data)
+{
+    return decode_job_is_done(data);
+}
+
+/* coroutine context */
+static void display_dispatch_decoded(SpiceChannel *channel, SpiceMsgIn *in,
+                                     pixman_image_t *decoded)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    SpiceChannelClass *parent_class = SPICE_CHANNEL_CLASS(spice_display_channel_parent_class);
+    SpiceMsgDisplayDrawCopy *op = spice_msg_in_parsed(in);
+    SpiceImage *src_bitmap = op->data.src_bitmap;
+    SpiceImage image = *src_bitmap;
+
+    /* let the canvas pick the decoded image up as if it was cached */
+    image.descriptor.type = SPICE_IMAGE_TYPE_FROM_CACHE;
+    image.descriptor.flags = 0;
+
+    if (src_bitmap->descriptor.flags & SPICE_IMAGE_FLAGS_CACHE_ME) {
+        if (src_bitmap->descriptor.type == SPICE_IMAGE_TYPE_JPEG)
+            image_put_lossy(&c->image_cache, image.descriptor.id, decoded);
+        else
+            image_put(&c->image_cache, image.descriptor.id, decoded);
+    }
+
+    c->decoded_id = image.descriptor.id;
+    c->decoded_image = decoded;
+    op->data.src_bitmap = &image;
+    parent_class->handle_msg(channel, in);
+    op->data.src_bitmap = src_bitmap;
+    c->decoded_image = NULL;
+}
+
+/* coroutine context */
+static void display_decode_queue_flush(SpiceChannel *channel)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    SpiceChannelClass *parent_class = SPICE_CHANNEL_CLASS(spice_display_channel_parent_class);
+    SpiceMsgDisplayDrawCopy *op;
+    decode_queue_entry *e;
+
+    while ((e = g_queue_pop_head(&c->decode_queue)) != NULL) {
+        pixman_image_t *decoded = e->decoded;
+
+        if (e->job != NULL) {
+            if (!g_coroutine_condition_wait(g_coroutine_self(), decode_queue_job_done, e->job))
+                CHANNEL_DEBUG(channel, "wait decoded image got cancelled");
+            decoded = decode_job_finish(e->job);
+            op = spice_msg_in_parsed(e->in);
+            /* the messages queued before it may have changed the surface.
+             * A GLZ image is in the window already and can't be decoded
+             * again, it is drawn as a cached image would be */
+            if (decoded != NULL && !display_can_draw_decoded(c, op) &&
+                op->data.src_bitmap->descriptor.type != SPICE_IMAGE_TYPE_GLZ_RGB)
+                g_clear_pointer(&decoded, pixman_image_unref);
+        }
+
+        if (decoded != NULL) {
+            display_dispatch_decoded(channel, e->in, decoded);
+            pixman_image_unref(decoded);
+        } else {
+            /* not offloaded, or failed: decode it here */
+            parent_class->handle_msg(channel, e->in);
+        }
+
+        spice_msg_in_unref(e->in);
+        g_free(e);
+    }
+}
+
+static void display_decode_queue_clear(SpiceChannel *channel)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    decode_queue_entry *e;
+
+    while ((e = g_queue_pop_head(&c->decode_queue)) != NULL) {
+        if (e->job != NULL)
+            e->decoded = decode_job_finish(e->job);
+        if (e->decoded != NULL)
+            pixman_image_unref(e->decoded);
+        spice_msg_in_unref(e->in);
+        g_free(e);
+    }
+}
+
+/*
+ * The digest of the encoded image, the stored images are checked against.
+ * There is none for the images using a palette from the cache, what they
+ * look like doesn't only depend on their encoding.
+ */
+static gboolean image_get_digest(const SpiceImage *image,
+                                 guint8 digest[IMAGE_STORE_DIGEST_SIZE])
+{
+    const SpicePalette *palette = NULL;
+    const SpiceChunks *chunks;
+    GChecksum *checksum;
+    gsize length = IMAGE_STORE_DIGEST_SIZE;
+    guint32 i;
+
+    switch (image->descriptor.type) {
+    case SPICE_IMAGE_TYPE_BITMAP:
+        if (image->u.bitmap.flags & SPICE_BITMAP_FLAGS_PAL_FROM_CACHE)
+            return FALSE;
+        palette = image->u.bitmap.palette;
+        chunks = image->u.bitmap.data;
+        break;
+    case SPICE_IMAGE_TYPE_LZ_PLT:
+        if (image->u.lz_plt.flags & SPICE_LZPLT_FLAGS_PAL_FROM_CACHE)
+            return FALSE;
+        palette = image->u.lz_plt.palette;
+        chunks = image->u.lz_plt.data;
+        break;
+    case SPICE_IMAGE_TYPE_QUIC:
+        chunks = image->u.quic.data;
+        break;
+    case SPICE_IMAGE_TYPE_LZ_RGB:
+        chunks = image->u.lz_rgb.data;
+        break;
+    case SPICE_IMAGE_TYPE_LZ4:
+        chunks = image->u.lz4.data;
+        break;
+    default:
+        return FALSE;
+    }
+    if (chunks == NULL)
+        return FALSE;
+
+    checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    g_checksum_update(checksum, &image->descriptor.type, sizeof(image->descriptor.type));
+    if (image->descriptor.type == SPICE_IMAGE_TYPE_BITMAP) {
+        g_checksum_update(checksum, &image->u.bitmap.format, sizeof(image->u.bitmap.format));
+        g_checksum_update(checksum, &image->u.bitmap.flags, sizeof(image->u.bitmap.flags));
+        g_checksum_update(checksum, (const guchar *)&image->u.bitmap.stride,
+                          sizeof(image->u.bitmap.stride));
+    }
+    if (palette != NULL)
+        g_checksum_update(checksum, (const guchar *)palette->ents,
+                          palette->num_ents * sizeof(palette->ents[0]));
+    for (i = 0; i < chunks->num_chunks; i++)
+        g_checksum_update(checksum, chunks->chunk[i].data, chunks->chunk[i].len);
+    g_checksum_get_digest(checksum, digest, &length);
+    g_checksum_free(checksum);
+
+    return TRUE;
+}
+
+/*
+ * Looks the image of a draw copy up on disk, the server doesn't know the
+ * images stored by a previous connection. Otherwise its digest is kept
+ * for image_put() to store it once decoded.
+ */
+/* coroutine context */
+static pixman_image_t *display_stored_image(SpiceChannel *channel, SpiceMsgIn *in)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    SpiceMsgDisplayDrawCopy *op;
+    SpiceImageStore *store;
+    SpiceImage *image;
+    pixman_image_t *stored = NULL;
+    guint8 digest[IMAGE_STORE_DIGEST_SIZE];
+    gboolean cached;
+
+    if (spice_msg_in_type(in) != SPICE_MSG_DISPLAY_DRAW_COPY ||
+        channel->priv->disable_channel_msg)
+        return NULL;
+
+    op = spice_msg_in_parsed(in);
+    image = op->data.src_bitmap;
+    if (image == NULL ||
+        (image->descriptor.flags & SPICE_IMAGE_FLAGS_CACHE_ME) == 0 ||
+        (image->descriptor.flags & SPICE_IMAGE_FLAGS_CACHE_REPLACE_ME) != 0)
+        return NULL;
+
+    switch (image->descriptor.type) {
+    case SPICE_IMAGE_TYPE_BITMAP:
+    case SPICE_IMAGE_TYPE_QUIC:
+    case SPICE_IMAGE_TYPE_LZ_PLT:
+    case SPICE_IMAGE_TYPE_LZ_RGB:
+    case SPICE_IMAGE_TYPE_LZ4:
+        break;
+    default:
+        /* GLZ images must be decoded to fill the window, lossy ones
+         * aren't stored */
+        return NULL;
+    }
+
+    spice_session_images_lock(c->session);
+    store = spice_session_get_image_store(c->session);
+    cached = cache_find(c->images, image->descriptor.id) != NULL;
+    spice_session_images_unlock(c->session);
+
+    /* hashed without holding the other display channels back */
+    if (store == NULL || cached || !image_get_digest(image, digest))
+        return NULL;
+
+    spice_session_images_lock(c->session);
+    store = spice_session_get_image_store(c->session);
+    if (store != NULL)
+        stored = image_store_lookup(store, image->descriptor.id, digest,
+                                    image->descriptor.width, image->descriptor.height);
+    spice_session_images_unlock(c->session);
+
+    if (stored == NULL) {
+        guint64 *id = g_new(guint64, 1);
+
+        *id = image->descriptor.id;
+        g_hash_table_replace(c->store_digests, id,
+                             g_memdup(digest, IMAGE_STORE_DIGEST_SIZE));
+    }
+
+    return stored;
+}
+
+/* coroutine context */
+static SpiceDecodeJob *display_decode_job_start(SpiceChannel *channel, SpiceMsgIn *in)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    SpiceDecodePool *pool;
+    SpiceDecodeJob *job = NULL;
+    SpiceMsgDisplayDrawCopy *op;
+
+    if (spice_msg_in_type(in) != SPICE_MSG_DISPLAY_DRAW_COPY ||
+        channel->priv->disable_channel_msg)
+        return NULL;
+
+    /* checked again once the messages queued before it are handled */
+    op = spice_msg_in_parsed(in);
+    if (!display_can_draw_decoded(c, op))
+        return NULL;
+
+    spice_session_images_lock(c->session);
+    pool = spice_session_get_decode_pool(c->session);
+    if (pool != NULL && decode_pool_can_offload(pool, op->data.src_bitmap))
+        job = decode_pool_push(pool, op->data.src_bitmap);
+    spice_session_images_unlock(c->session);
+
+    return job;
+}
+
+/* coroutine context */
+static void spice_display_handle_msg(SpiceChannel *channel, SpiceMsgIn *in)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    pixman_image_t *stored = display_stored_image(channel, in);
+    SpiceDecodeJob *job = NULL;
+    decode_queue_entry *e;
+
+    /* don't hold the damage back for too long on busy connections */
+    if (pixman_region32_not_empty(&c->damage) &&
+        g_get_monotonic_time() - c->damage_time >= DAMAGE_MAX_DELAY_US)
+        display_flush_damage(channel);
+
+    if (stored == NULL)
+        job = display_decode_job_start(channel, in);
+
+    if (g_queue_is_empty(&c->decode_queue)) {
+        if (stored != NULL) {
+            display_dispatch_decoded(channel, in, stored);
+            pixman_image_unref(stored);
+            return;
+        }
+        if (job == NULL) {
+            SPICE_CHANNEL_CLASS(spice_display_channel_parent_class)->handle_msg(channel, in);
+            return;
+        }
+    }
+
+    /* keep the messages in order behind the images being decoded, and
+     * keep reading ahead while the following ones can be decoded too */
+    spice_msg_in_ref(in);
+    e = g_new0(decode_queue_entry, 1);
+    e->in = in;
+    e->job = job;
+    e->decoded = stored;
+    g_queue_push_tail(&c->decode_queue, e);
+
+    if ((job == NULL && stored == NULL) || g_queue_get_length(&c->decode_queue) >= DECODE_QUEUE_MAX_LEN)
+        display_decode_queue_flush(channel);
+}
+
+/* coroutine context */
+static void display_iterate_read(SpiceChannel *channel)
+{
+    SPICE_CHANNEL_CLASS(spice_display_channel_parent_class)->iterate_read(channel);
+
+    /* nothing more to read ahead for now */
+    display_decode_queue_flush(channel);
+    display_flush_damage(channel);
+}
+
 static void channel_set_handlers(SpiceChannelClass *klass)
 {
     static const spice_msg_handler handlers[] = {
@@ -104,6 +104,76 @@ struct _SpiceDisplayPrimary {
     gboolean marked;
 };
 
+/**
+ * SpiceDisplayRect:
+ * @x: x position
+ * @y: y position
+ * @width: width
+ * @height: height
+ *
+ * A rectangle of the primary buffer.
+ *
+ * Since: 0.42
+ **/
+typedef struct _SpiceDisplayRect SpiceDisplayRect;
+struct _SpiceDisplayRect {
+    gint x;
+    gint y;
+    gint width;
+    gint height;
+};
+
+/**
+ * SPICE_DISPLAY_STREAM_MARGIN_BINS:
+ *
+ * The number of bins of #SpiceDisplayStreamStats.margin_histogram.
+ *
+ * Since: 0.42
+ **/
+#define SPICE_DISPLAY_STREAM_MARGIN_BINS 8
+
+/**
+ * SpiceDisplayStreamStats:
+ * @id: the stream id
+ * @codec_type: the #SpiceVideoCodecType of the stream
+ * @num_frames: the number of frames received
+ * @num_presented: the number of frames displayed
+ * @num_arrived_late: the number of frames received after their display time
+ * @num_dropped_on_playback: the number of frames the decoder dropped
+ * because they could not be displayed in time
+ * @num_late_on_playback: the number of frames displayed after their
+ * display time
+ * @margin_histogram: the number of frames received per time left before
+ * their display: late, then less than 10, 20, 50, 100, 200 and 400 ms,
+ * and 400 ms or more
+ * @decode_time: the average time it takes to decode a frame, in
+ * microseconds
+ * @queue_length: the number of frames waiting to be decoded or displayed
+ * @present_latency: the average time from the reception of a frame to
+ * its display, in microseconds
+ * @fps: the number of frames displayed per second
+ *
+ * Holds the playback statistics of a video stream, see
+ * spice_display_channel_get_stream_stats().
+ *
+ * Since: 0.42
+ **/
+typedef struct _SpiceDisplayStreamStats SpiceDisplayStreamStats;
+struct _SpiceDisplayStreamStats {
+    guint id;
+    gint codec_type;
+    guint num_frames;
+    guint num_presented;
+    guint num_arrived_late;
+    guint num_dropped_on_playback;
+    guint num_late_on_playback;
+    guint margin_histogram[SPICE_DISPLAY_STREAM_MARGIN_BINS];
+    gint64 decode_time;
+    guint queue_length;
+    gint64 present_latency;
+    gdouble fps;
+};
+
 /**
  * SpiceDisplayChannel:
  *
@@ -158,6 +228,9 @@ void            spice_gl_scanout_free         (SpiceGlScanout *scanout);
 const SpiceGlScanout* spice_display_channel_get_gl_scanout(SpiceDisplayChannel *channel);
 void spice_display_channel_gl_draw_done(SpiceDisplayChannel *channel);
 
+void spice_display_channel_present(SpiceDisplayChannel *channel);
+GArray *spice_display_channel_get_stream_stats(SpiceDisplayChannel *channel);
+
 #ifndef SPICE_DISABLE_DEPRECATED
 G_DEPRECATED_FOR(spice_display_channel_change_preferred_compression)
 void spice_display_change_preferred_compression(SpiceChannel *channel, gint compression);
@@ -307,7 +307,8 @@ static void playback_handle_data(SpiceChannel *channel, SpiceMsgIn *in)
     if (spice_mmtime_diff(c->last_time, packet->time) > 0)
         g_warn_if_reached();
 
-    c->last_time = packet->time;
+    /* also read by spice_playback_channel_set_delay() */
+    g_atomic_int_set(&c->last_time, packet->time);
 
     uint8_t *data = packet->data;
     int n = packet->data_size;
@@ -362,7 +363,7 @@ static void playback_handle_start(SpiceChannel *channel, SpiceMsgIn *in)
                   spice_audio_data_mode_to_string(c->mode));
 
     c->frame_count = 0;
-    c->last_time = start->time;
+    g_atomic_int_set(&c->last_time, start->time);
     c->is_active = TRUE;
     c->min_latency = SPICE_PLAYBACK_DEFAULT_LATENCY_MS;
     snd_codec_destroy(&c->codec);
@@ -457,11 +458,12 @@ void spice_playback_channel_set_delay(SpicePlaybackChannel *channel, guint32 del
     CHANNEL_DEBUG(channel, "playback set_delay %u ms", delay_ms);
 
     c = channel->priv;
-    c->latency = delay_ms;
+    /* the channel may run in a thread of its own */
+    g_atomic_int_set(&c->latency, delay_ms);
 
     session = spice_channel_get_session(SPICE_CHANNEL(channel));
     if (session) {
-        spice_session_set_mm_time(session, c->last_time - delay_ms);
+        spice_session_set_mm_time(session, (guint32)g_atomic_int_get(&c->last_time) - delay_ms);
     } else {
         CHANNEL_DEBUG(channel, "channel detached from session, mm time skipped");
     }
@@ -481,7 +483,7 @@ guint32 spice_playback_channel_get_latency(SpicePlaybackChannel *channel)
     if (!channel->priv->is_active) {
         return 0;
     }
-    return channel->priv->latency;
+    return g_atomic_int_get(&channel->priv->latency);
 }
 
 G_GNUC_INTERNAL
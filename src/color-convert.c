@@ -0,0 +1,253 @@
+/*
+   Copyright (C) 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include "color-convert.h"
+
+/*
+ * Conversion of 16 bits surfaces to the 32 bits xRGB the widget draws.
+ * The vector kernels expand the channels of 8 (or 16) pixels at a time
+ * in 16-bit lanes, replicating the top bits into the low ones exactly
+ * like the scalar macros, then interleave them into BGRX pixels.
+ * The best kernel for the CPU is picked once at runtime.
+ */
+
+static void convert_0555_to_0888(const guint16 *src, guint32 *dest, gint width)
+{
+    gint x;
+
+    for (x = 0; x < width; x++) {
+        dest[x] = CONVERT_0555_TO_0888(src[x]);
+    }
+}
+
+static void convert_0565_to_0888(const guint16 *src, guint32 *dest, gint width)
+{
+    gint x;
+
+    for (x = 0; x < width; x++) {
+        dest[x] = CONVERT_0565_TO_0888(src[x]);
+    }
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_CONVERTERS
+#include <immintrin.h>
+
+/*
+ * Expands the 16-bit pixels of s to their blue and green bytes in gb and
+ * their red byte in r, for green starting at bit 5 with g_bits bits and
+ * red starting at bit r_shift.
+ */
+#define EXPAND_SSE2(s, gb, r, g_bits, r_shift) do {                            \
+    __m128i b_ = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(s, 3), c_f8),      \
+                              _mm_and_si128(_mm_srli_epi16(s, 2), c_07));     \
+    __m128i g_ = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(s, (g_bits) - 3), \
+                                            _mm_set1_epi16(0xff << (8 - (g_bits)) & 0xff)), \
+                              _mm_and_si128(_mm_srli_epi16(s, 2 * (g_bits) - 3), \
+                                            _mm_set1_epi16(0xff >> (g_bits)))); \
+    gb = _mm_or_si128(b_, _mm_slli_epi16(g_, 8));                             \
+    r = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(s, (r_shift) - 3), c_f8),   \
+                     _mm_and_si128(_mm_srli_epi16(s, (r_shift) + 2), c_07));  \
+} while (0)
+
+__attribute__((target("sse2")))
+static void convert_0555_to_0888_sse2(const guint16 *src, guint32 *dest, gint width)
+{
+    const __m128i c_f8 = _mm_set1_epi16(0xf8);
+    const __m128i c_07 = _mm_set1_epi16(0x07);
+    gint x;
+
+    for (x = 0; x + 8 <= width; x += 8) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + x));
+        __m128i gb, r;
+
+        EXPAND_SSE2(s, gb, r, 5, 10);
+        _mm_storeu_si128((__m128i *)(dest + x), _mm_unpacklo_epi16(gb, r));
+        _mm_storeu_si128((__m128i *)(dest + x + 4), _mm_unpackhi_epi16(gb, r));
+    }
+    convert_0555_to_0888(src + x, dest + x, width - x);
+}
+
+__attribute__((target("sse2")))
+static void convert_0565_to_0888_sse2(const guint16 *src, guint32 *dest, gint width)
+{
+    const __m128i c_f8 = _mm_set1_epi16(0xf8);
+    const __m128i c_07 = _mm_set1_epi16(0x07);
+    gint x;
+
+    for (x = 0; x + 8 <= width; x += 8) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + x));
+        __m128i gb, r;
+
+        EXPAND_SSE2(s, gb, r, 6, 11);
+        _mm_storeu_si128((__m128i *)(dest + x), _mm_unpacklo_epi16(gb, r));
+        _mm_storeu_si128((__m128i *)(dest + x + 4), _mm_unpackhi_epi16(gb, r));
+    }
+    convert_0565_to_0888(src + x, dest + x, width - x);
+}
+
+#define EXPAND_AVX2(s, gb, r, g_bits, r_shift) do {                                  \
+    __m256i b_ = _mm256_or_si256(_mm256_and_si256(_mm256_slli_epi16(s, 3), c_f8),   \
+                                 _mm256_and_si256(_mm256_srli_epi16(s, 2), c_07));  \
+    __m256i g_ = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(s, (g_bits) - 3), \
+                                                  _mm256_set1_epi16(0xff << (8 - (g_bits)) & 0xff)), \
+                                 _mm256_and_si256(_mm256_srli_epi16(s, 2 * (g_bits) - 3), \
+                                                  _mm256_set1_epi16(0xff >> (g_bits)))); \
+    gb = _mm256_or_si256(b_, _mm256_slli_epi16(g_, 8));                             \
+    r = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(s, (r_shift) - 3), c_f8), \
+                        _mm256_and_si256(_mm256_srli_epi16(s, (r_shift) + 2), c_07)); \
+} while (0)
+
+/* the unpacks work within 128-bit lanes, giving pixels 0-3 8-11 and 4-7 12-15 */
+#define STORE_AVX2(dest, gb, r) do {                                               \
+    __m256i lo_ = _mm256_unpacklo_epi16(gb, r);                                     \
+    __m256i hi_ = _mm256_unpackhi_epi16(gb, r);                                     \
+    _mm256_storeu_si256((__m256i *)(dest), _mm256_permute2x128_si256(lo_, hi_, 0x20)); \
+    _mm256_storeu_si256((__m256i *)((dest) + 8), _mm256_permute2x128_si256(lo_, hi_, 0x31)); \
+} while (0)
+
+__attribute__((target("avx2")))
+static void convert_0555_to_0888_avx2(const guint16 *src, guint32 *dest, gint width)
+{
+    const __m256i c_f8 = _mm256_set1_epi16(0xf8);
+    const __m256i c_07 = _mm256_set1_epi16(0x07);
+    gint x;
+
+    for (x = 0; x + 16 <= width; x += 16) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + x));
+        __m256i gb, r;
+
+        EXPAND_AVX2(s, gb, r, 5, 10);
+        STORE_AVX2(dest + x, gb, r);
+    }
+    convert_0555_to_0888_sse2(src + x, dest + x, width - x);
+}
+
+__attribute__((target("avx2")))
+static void convert_0565_to_0888_avx2(const guint16 *src, guint32 *dest, gint width)
+{
+    const __m256i c_f8 = _mm256_set1_epi16(0xf8);
+    const __m256i c_07 = _mm256_set1_epi16(0x07);
+    gint x;
+
+    for (x = 0; x + 16 <= width; x += 16) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + x));
+        __m256i gb, r;
+
+        EXPAND_AVX2(s, gb, r, 6, 11);
+        STORE_AVX2(dest + x, gb, r);
+    }
+    convert_0565_to_0888_sse2(src + x, dest + x, width - x);
+}
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HAVE_NEON_CONVERTERS
+#include <arm_neon.h>
+
+/* narrowing keeps the low byte of each shifted pixel */
+#define EXPAND_NEON(s, g_bits, r_shift) { {                                     \
+    vorr_u8(vmovn_u16(vshlq_n_u16(s, 3)),                                       \
+            vand_u8(vmovn_u16(vshrq_n_u16(s, 2)), vdup_n_u8(0x07))),            \
+    vorr_u8(vand_u8(vmovn_u16(vshrq_n_u16(s, (g_bits) - 3)),                   \
+                    vdup_n_u8(0xff << (8 - (g_bits)) & 0xff)),                  \
+            vand_u8(vmovn_u16(vshrq_n_u16(s, 2 * (g_bits) - 3)),                \
+                    vdup_n_u8(0xff >> (g_bits)))),                              \
+    vorr_u8(vand_u8(vmovn_u16(vshrq_n_u16(s, (r_shift) - 3)), vdup_n_u8(0xf8)), \
+            vand_u8(vmovn_u16(vshrq_n_u16(s, (r_shift) + 2)), vdup_n_u8(0x07))), \
+    vdup_n_u8(0),                                                               \
+} }
+
+static void convert_0555_to_0888_neon(const guint16 *src, guint32 *dest, gint width)
+{
+    gint x;
+
+    for (x = 0; x + 8 <= width; x += 8) {
+        uint16x8_t s = vld1q_u16(src + x);
+        uint8x8x4_t bgrx = EXPAND_NEON(s, 5, 10);
+        vst4_u8((uint8_t *)(dest + x), bgrx);
+    }
+    convert_0555_to_0888(src + x, dest + x, width - x);
+}
+
+static void convert_0565_to_0888_neon(const guint16 *src, guint32 *dest, gint width)
+{
+    gint x;
+
+    for (x = 0; x + 8 <= width; x += 8) {
+        uint16x8_t s = vld1q_u16(src + x);
+        uint8x8x4_t bgrx = EXPAND_NEON(s, 6, 11);
+        vst4_u8((uint8_t *)(dest + x), bgrx);
+    }
+    convert_0565_to_0888(src + x, dest + x, width - x);
+}
+#endif
+
+static ColorConvertImpl impls[4];
+static guint n_impls;
+
+static void init_converters(void)
+{
+    static gsize initialized = 0;
+
+    if (!g_once_init_enter(&initialized))
+        return;
+
+    impls[n_impls++] = (ColorConvertImpl) {
+        "scalar", convert_0555_to_0888, convert_0565_to_0888
+    };
+#ifdef HAVE_X86_CONVERTERS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        impls[n_impls++] = (ColorConvertImpl) {
+            "sse2", convert_0555_to_0888_sse2, convert_0565_to_0888_sse2
+        };
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        impls[n_impls++] = (ColorConvertImpl) {
+            "avx2", convert_0555_to_0888_avx2, convert_0565_to_0888_avx2
+        };
+    }
+#endif
+#ifdef HAVE_NEON_CONVERTERS
+    impls[n_impls++] = (ColorConvertImpl) {
+        "neon", convert_0555_to_0888_neon, convert_0565_to_0888_neon
+    };
+#endif
+
+    g_once_init_leave(&initialized, 1);
+}
+
+const ColorConvertImpl *color_convert_get_impls(guint *n)
+{
+    init_converters();
+    *n = n_impls;
+    return impls;
+}
+
+void color_convert_0555_to_0888(const guint16 *src, guint32 *dest, gint width)
+{
+    init_converters();
+    impls[n_impls - 1].convert_0555_to_0888(src, dest, width);
+}
+
+void color_convert_0565_to_0888(const guint16 *src, guint32 *dest, gint width)
+{
+    init_converters();
+    impls[n_impls - 1].convert_0565_to_0888(src, dest, width);
+}
@@ -0,0 +1,51 @@
+/*
+   Copyright (C) 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define CONVERT_0565_TO_0888(s)                                         \
+    (((((s) << 3) & 0xf8) | (((s) >> 2) & 0x7)) |                       \
+     ((((s) << 5) & 0xfc00) | (((s) >> 1) & 0x300)) |                   \
+     ((((s) << 8) & 0xf80000) | (((s) << 3) & 0x70000)))
+
+#define CONVERT_0565_TO_8888(s) (CONVERT_0565_TO_0888(s) | 0xff000000)
+
+#define CONVERT_0555_TO_0888(s)                                         \
+    (((((s) & 0x001f) << 3) | (((s) & 0x001c) >> 2)) |                  \
+     ((((s) & 0x03e0) << 6) | (((s) & 0x0380) << 1)) |                  \
+     ((((s) & 0x7c00) << 9) | ((((s) & 0x7000)) << 4)))
+
+#define CONVERT_0555_TO_8888(s) (CONVERT_0555_TO_0888(s) | 0xff000000)
+
+typedef void (*color_convert_row_func)(const guint16 *src, guint32 *dest, gint width);
+
+typedef struct ColorConvertImpl {
+    const gchar *name;
+    color_convert_row_func convert_0555_to_0888;
+    color_convert_row_func convert_0565_to_0888;
+} ColorConvertImpl;
+
+void color_convert_0555_to_0888(const guint16 *src, guint32 *dest, gint width);
+void color_convert_0565_to_0888(const guint16 *src, guint32 *dest, gint width);
+
+/* the kernels usable on this CPU, scalar first, the selected one last */
+const ColorConvertImpl *color_convert_get_impls(guint *n_impls);
+
+G_END_DECLS
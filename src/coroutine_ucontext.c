@@ -88,25 +88,40 @@ void coroutine_init(struct coroutine *co)
 	cc_init(&co->cc);
 }
 
-static struct coroutine leader;
-static struct coroutine *current = &leader;
+/* Each thread has its own leader, so that channels can run their
+ * coroutines in threads of their own */
+static GPrivate leader_key = G_PRIVATE_INIT(g_free);
+static GPrivate current_key;
+
+static struct coroutine *coroutine_leader(void)
+{
+	struct coroutine *leader = g_private_get(&leader_key);
+
+	if (leader == NULL) {
+		leader = g_new0(struct coroutine, 1);
+		g_private_set(&leader_key, leader);
+	}
+	return leader;
+}
 
 struct coroutine *coroutine_self(void)
 {
-	return current;
+	struct coroutine *current = g_private_get(&current_key);
+
+	return current ? current : coroutine_leader();
 }
 
 static void *coroutine_swap(struct coroutine *from, struct coroutine *to, void *arg)
 {
 	int ret;
 	to->data = arg;
-	current = to;
+	g_private_set(&current_key, to);
 	ret = cc_swap(&from->cc, &to->cc);
 	if (ret == 0)
 		return from->data;
 	else if (ret == 1) {
 		coroutine_release(to);
-		current = from;
+		g_private_set(&current_key, from);
 		to->exited = 1;
 		return to->data;
 	}
@@ -136,7 +151,7 @@ void *coroutine_yield(void *arg)
 
 gboolean coroutine_is_main(struct coroutine *co)
 {
-	return (co == &leader);
+	return (co == coroutine_leader());
 }
 /*
  * Local variables:
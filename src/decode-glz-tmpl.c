@@ -181,6 +181,7 @@ static size_t FNAME(decode)(SpiceGlzDecoderWindow *window,
     OUT_PIXEL    *out_pix_buf = SPICE_ALIGNED_CAST(OUT_PIXEL *, out_buf);
     OUT_PIXEL    *op = out_pix_buf;
     OUT_PIXEL    *op_limit = out_pix_buf + size;
+    glz_ref_cache refs = { { 0, }, { NULL, } };
 
     uint32_t ctrl = *(ip++);
     int loop = true;
@@ -256,8 +257,8 @@ static size_t FNAME(decode)(SpiceGlzDecoderWindow *window,
                 g_return_val_if_fail(ref + len <= op_limit, 0);
                 g_return_val_if_fail(ref >= out_pix_buf, 0);
             } else {
-                ref = glz_decoder_window_bits(window, image_id,
-                                              image_dist, pixel_ofs);
+                ref = glz_ref_cache_bits(&refs, window, image_id,
+                                         image_dist, pixel_ofs);
             }
 
             g_return_val_if_fail(ref != NULL, 0);
@@ -75,58 +75,115 @@ static void glz_image_destroy(struct glz_image *img)
 
 /* ------------------------------------------------------------------ */
 
-#define INIT_IMAGES_CAPACITY 100
-#define WIN_OVERFLOW_FACTOR 1.5
-#define WIN_REALLOC_FACTOR 1.5
+/*
+ * The window is a ring of images indexed by their id. It is sized from
+ * the configured window size, so that all the images the server may
+ * still refer to fit without collision, even if they are received out
+ * of order (with multiple displays, each display uses its own socket so
+ * there is no guarantee that images are received in id order).
+ *
+ * The ring size assumes images of GLZ_MIN_IMAGE_PIXELS on average. If
+ * more images are held, the ring grows, but this is not expected to
+ * happen in practice.
+ */
+#define GLZ_MIN_IMAGE_PIXELS 1024
+#define GLZ_MIN_CAPACITY 64
+
+/*
+ * The images of a window are shared by the display channels, and may be
+ * decoded in threads (see glz_decoder_window_can_decode()). A coroutine
+ * needing an image that isn't decoded yet waits for it to be added, and
+ * is woken up only when it is.
+ */
+struct glz_window_waiter {
+    uint64_t                id;
+    GCoroutineNotify        notify;
+};
 
 struct SpiceGlzDecoderWindow {
+    GMutex                  lock;
+    GSList                  *waiters;
     struct glz_image        **images;
+    uint32_t                capacity; /* power of 2 */
     uint32_t                nimages;
     uint64_t                oldest;
     uint64_t                tail_gap;
+    uint64_t                bytes;
+    uint64_t                max_bytes;
 };
 
-static void glz_decoder_window_resize(SpiceGlzDecoderWindow *w)
+static inline uint32_t glz_decoder_window_slot(SpiceGlzDecoderWindow *w, uint64_t id)
 {
-    struct glz_image  **new_images;
-    int i, new_slot;
-
-    SPICE_DEBUG("%s: array resize %u -> %u", __FUNCTION__,
-                w->nimages, w->nimages * 2);
-    new_images = g_new0(struct glz_image*, w->nimages * 2);
-    for (i = 0; i < w->nimages; i++) {
-        if (w->images[i] == NULL) {
-            /*
-             * We can have empty slots when images come in out of order, this
-             * can happen when a vm has multiple displays, since each display
-             * uses its own socket there is no guarantee that images
-             * originating from different displays are received in id order.
-             */
-            continue;
-        }
-        new_slot = w->images[i]->hdr.id % (w->nimages * 2);
-        new_images[new_slot] = w->images[i];
+    return id & (w->capacity - 1);
+}
+
+static struct glz_image *glz_decoder_window_lookup(SpiceGlzDecoderWindow *w, uint64_t id)
+{
+    struct glz_image *image = w->images[glz_decoder_window_slot(w, id)];
+
+    return image != NULL && image->hdr.id == id ? image : NULL;
+}
+
+static uint32_t glz_decoder_window_capacity(uint64_t max_bytes)
+{
+    uint64_t n = max_bytes / (GLZ_MIN_IMAGE_PIXELS * 4);
+    uint32_t capacity = GLZ_MIN_CAPACITY;
+
+    while (capacity < n && capacity < G_MAXUINT32 / 2)
+        capacity *= 2;
+
+    return capacity;
+}
+
+static void glz_decoder_window_realloc(SpiceGlzDecoderWindow *w, uint32_t capacity)
+{
+    struct glz_image **images = w->images;
+    uint32_t i, old_capacity = w->capacity;
+
+    SPICE_DEBUG("%s: %u -> %u, %u images, %" G_GUINT64_FORMAT " bytes",
+                __FUNCTION__, old_capacity, capacity, w->nimages, w->bytes);
+
+    w->images = g_new0(struct glz_image*, capacity);
+    w->capacity = capacity;
+    for (i = 0; i < old_capacity; i++) {
+        if (images[i] != NULL)
+            w->images[glz_decoder_window_slot(w, images[i]->hdr.id)] = images[i];
     }
-    g_free(w->images);
-    w->images = new_images;
-    w->nimages *= 2;
+    g_free(images);
 }
 
 static void glz_decoder_window_add(SpiceGlzDecoderWindow *w,
                                    struct glz_image *img)
 {
-    int slot = img->hdr.id % w->nimages;
-
-    if (w->images[slot]) {
-        /* need more space */
-        glz_decoder_window_resize(w);
-        slot = img->hdr.id % w->nimages;
+    uint32_t slot = glz_decoder_window_slot(w, img->hdr.id);
+
+    while (w->images[slot] != NULL) {
+        if (w->images[slot]->hdr.id == img->hdr.id) {
+            g_critical("%s: image %" G_GUINT64_FORMAT " is already in the window",
+                       __FUNCTION__, img->hdr.id);
+            glz_image_destroy(img);
+            return;
+        }
+        /* more images than expected are held, the window size is too small */
+        glz_decoder_window_realloc(w, w->capacity * 2);
+        slot = glz_decoder_window_slot(w, img->hdr.id);
     }
 
     w->images[slot] = img;
+    w->nimages++;
+    for (GSList *l = w->waiters; l != NULL; l = l->next) {
+        struct glz_window_waiter *waiter = l->data;
+
+        if (waiter->id == img->hdr.id)
+            g_coroutine_notify(&waiter->notify);
+    }
+    w->bytes += (uint64_t)img->hdr.gross_pixels * 4;
+    if (w->bytes > w->max_bytes && w->max_bytes != 0)
+        SPICE_DEBUG("%s: %" G_GUINT64_FORMAT " bytes held, window is %" G_GUINT64_FORMAT,
+                    __FUNCTION__, w->bytes, w->max_bytes);
 
     /* close the gap */
-    while (w->tail_gap <= img->hdr.id && w->images[w->tail_gap % w->nimages] != NULL)
+    while (w->tail_gap <= img->hdr.id && glz_decoder_window_lookup(w, w->tail_gap) != NULL)
         w->tail_gap++;
 }
 
@@ -138,42 +195,112 @@ struct wait_for_image_data {
 static gboolean wait_for_image(gpointer data)
 {
     struct wait_for_image_data *wait = data;
-    int slot = wait->id % wait->window->nimages;
-    struct glz_image *image = wait->window->images[slot];
-    gboolean ready = image && image->hdr.id == wait->id;
+    gboolean ready;
+
+    g_mutex_lock(&wait->window->lock);
+    ready = glz_decoder_window_lookup(wait->window, wait->id) != NULL;
+    g_mutex_unlock(&wait->window->lock);
 
     return ready;
 }
 
-static void *glz_decoder_window_bits(SpiceGlzDecoderWindow *w, uint64_t id,
-                                     uint32_t dist, uint32_t offset)
+/*
+ * Images decoded in threads have all their references in the window
+ * already, only the coroutines may have to wait here.
+ */
+static struct glz_image *glz_decoder_window_get(SpiceGlzDecoderWindow *w, uint64_t id)
 {
     struct wait_for_image_data data = {
         .window = w,
-        .id = id - dist,
+        .id = id,
     };
+    struct glz_image *image;
 
-    if (!g_coroutine_condition_wait(g_coroutine_self(), wait_for_image, &data))
-        SPICE_DEBUG("wait for image cancelled");
+    g_mutex_lock(&w->lock);
+    image = glz_decoder_window_lookup(w, id);
+    if (image == NULL) {
+        struct glz_window_waiter waiter = { .id = id };
 
-    int slot = (id - dist) % w->nimages;
+        g_coroutine_notify_init(&waiter.notify);
+        w->waiters = g_slist_prepend(w->waiters, &waiter);
+        g_mutex_unlock(&w->lock);
 
-    g_return_val_if_fail(w->images[slot] != NULL, NULL);
-    g_return_val_if_fail(w->images[slot]->hdr.id == id - dist, NULL);
-    g_return_val_if_fail(w->images[slot]->hdr.gross_pixels >= offset, NULL);
+        if (!g_coroutine_condition_wait_notified(g_coroutine_self(), wait_for_image,
+                                                 &data, &waiter.notify))
+            SPICE_DEBUG("wait for image cancelled");
 
-    return w->images[slot]->data + offset * 4;
+        g_mutex_lock(&w->lock);
+        w->waiters = g_slist_remove(w->waiters, &waiter);
+        g_coroutine_notify_clear(&waiter.notify);
+        image = glz_decoder_window_lookup(w, id);
+    }
+    g_mutex_unlock(&w->lock);
+
+    return image;
+}
+
+/*
+ * The images referenced by the image being decoded, so that each is
+ * looked up in the window once rather than for every reference. They
+ * aren't released before an image referring past them is added, which
+ * the server doesn't send before it is done with them.
+ */
+#define GLZ_REF_CACHE_SIZE 8
+
+typedef struct glz_ref_cache {
+    uint32_t                dist[GLZ_REF_CACHE_SIZE];
+    struct glz_image        *images[GLZ_REF_CACHE_SIZE];
+} glz_ref_cache;
+
+static inline void *glz_ref_cache_bits(glz_ref_cache *cache, SpiceGlzDecoderWindow *w,
+                                       uint64_t id, uint32_t dist, uint32_t offset)
+{
+    uint32_t slot = dist & (GLZ_REF_CACHE_SIZE - 1);
+    struct glz_image *image = cache->images[slot];
+
+    if (image == NULL || cache->dist[slot] != dist) {
+        image = glz_decoder_window_get(w, id - dist);
+        g_return_val_if_fail(image != NULL, NULL);
+        cache->images[slot] = image;
+        cache->dist[slot] = dist;
+    }
+    g_return_val_if_fail(image->hdr.gross_pixels >= offset, NULL);
+
+    return image->data + offset * 4;
+}
+
+static void glz_decoder_window_remove(SpiceGlzDecoderWindow *w, uint32_t slot)
+{
+    struct glz_image *image = w->images[slot];
+
+    w->images[slot] = NULL;
+    w->nimages--;
+    w->bytes -= (uint64_t)image->hdr.gross_pixels * 4;
+    glz_image_destroy(image);
 }
 
 static void glz_decoder_window_release(SpiceGlzDecoderWindow *w,
                                        uint64_t oldest)
 {
-    int slot;
+    uint32_t slot;
+
+    if (oldest <= w->oldest)
+        return;
+
+    if (oldest - w->oldest >= w->capacity) {
+        /* release everything older in a single pass over the ring */
+        for (slot = 0; slot < w->capacity; slot++) {
+            if (w->images[slot] != NULL && w->images[slot]->hdr.id < oldest)
+                glz_decoder_window_remove(w, slot);
+        }
+        w->oldest = oldest;
+        return;
+    }
 
-    while (w->oldest < oldest) {
-        slot = w->oldest % w->nimages;
-        g_clear_pointer(&w->images[slot], glz_image_destroy);
-        w->oldest++;
+    for (; w->oldest < oldest; w->oldest++) {
+        slot = glz_decoder_window_slot(w, w->oldest);
+        if (w->images[slot] != NULL && w->images[slot]->hdr.id == w->oldest)
+            glz_decoder_window_remove(w, slot);
     }
 }
 
@@ -371,17 +498,20 @@ static void decode(SpiceGlzDecoder *decoder,
                              d->image.gross_pixels, d->image.id, palette);
     }
 
+    g_mutex_lock(&d->window->lock);
     glz_decoder_window_add(d->window, decoded_image);
 
     { /* release old images from last tail_gap, only if the gap is closed  */
         uint64_t oldest;
-        struct glz_image *image = d->window->images[(d->window->tail_gap - 1) % d->window->nimages];
+        struct glz_image *image = glz_decoder_window_lookup(d->window, d->window->tail_gap - 1);
 
-        g_return_if_fail(image != NULL);
-
-        oldest = image->hdr.id - image->hdr.win_head_dist;
-        glz_decoder_window_release(d->window, oldest);
+        /* NULL until the first image of the window is decoded */
+        if (image != NULL) {
+            oldest = image->hdr.id - image->hdr.win_head_dist;
+            glz_decoder_window_release(d->window, oldest);
+        }
     }
+    g_mutex_unlock(&d->window->lock);
 }
 
 /* ------------------------------------------------------------------ */
@@ -392,25 +522,82 @@ static SpiceGlzDecoderOps glz_decoder_ops = {
 
 void glz_decoder_window_clear(SpiceGlzDecoderWindow *w)
 {
-    int i;
+    uint32_t slot;
 
-    g_return_if_fail(w->nimages == 0 || w->images != NULL);
+    g_return_if_fail(w->capacity == 0 || w->images != NULL);
 
-    for (i = 0; i < w->nimages; i++) {
-        if (w->images[i]) {
-            glz_image_destroy(w->images[i]);
+    g_mutex_lock(&w->lock);
+    for (slot = 0; slot < w->capacity; slot++) {
+        if (w->images[slot]) {
+            glz_decoder_window_remove(w, slot);
         }
     }
+    g_warn_if_fail(w->nimages == 0 && w->bytes == 0);
 
-    w->nimages = 16;
-    g_free(w->images);
-    w->images = g_new0(struct glz_image*, w->nimages);
+    if (w->capacity != glz_decoder_window_capacity(w->max_bytes)) {
+        g_free(w->images);
+        w->capacity = glz_decoder_window_capacity(w->max_bytes);
+        w->images = g_new0(struct glz_image*, w->capacity);
+    }
+    w->oldest = 0;
     w->tail_gap = 0;
+    g_mutex_unlock(&w->lock);
+}
+
+/*
+ * Sets the size of the window in bytes, as configured with the server,
+ * to size the ring for the images it can hold.
+ */
+void glz_decoder_window_set_size(SpiceGlzDecoderWindow *w, uint64_t max_bytes)
+{
+    uint32_t capacity = glz_decoder_window_capacity(max_bytes);
+
+    g_mutex_lock(&w->lock);
+    w->max_bytes = max_bytes;
+    if (capacity > w->capacity)
+        glz_decoder_window_realloc(w, capacity);
+    g_mutex_unlock(&w->lock);
+}
+
+/*
+ * Whether the GLZ image @data can be decoded right away, its references
+ * being all in the window already. It can then be decoded in a thread.
+ */
+gboolean glz_decoder_window_can_decode(SpiceGlzDecoderWindow *w,
+                                       const uint8_t *data, size_t size)
+{
+    /* id and win_head_dist, after magic, version, type, width, height
+     * and stride, see decode_header() */
+    const size_t offset = 4 + 4 + 1 + 4 + 4 + 4;
+    uint64_t id;
+    uint32_t dist;
+    gboolean ready;
+    int i;
+
+    if (size < offset + 8 + 4)
+        return FALSE;
+
+    id = 0;
+    for (i = 0; i < 8; i++)
+        id = (id << 8) | data[offset + i];
+    dist = 0;
+    for (i = 0; i < 4; i++)
+        dist = (dist << 8) | data[offset + 8 + i];
+
+    g_mutex_lock(&w->lock);
+    /* all the images from oldest to tail_gap are in the window */
+    ready = dist == 0 ||
+        (dist <= id && id - dist >= w->oldest && w->tail_gap >= id);
+    ready = ready && glz_decoder_window_lookup(w, id) == NULL;
+    g_mutex_unlock(&w->lock);
+
+    return ready;
 }
 
 SpiceGlzDecoderWindow *glz_decoder_window_new(void)
 {
     SpiceGlzDecoderWindow *w = g_new0(SpiceGlzDecoderWindow, 1);
+    g_mutex_init(&w->lock);
     glz_decoder_window_clear(w);
     return w;
 }
@@ -421,6 +608,8 @@ void glz_decoder_window_destroy(SpiceGlzDecoderWindow *w)
         return;
 
     glz_decoder_window_clear(w);
+    g_warn_if_fail(w->waiters == NULL);
+    g_mutex_clear(&w->lock);
     g_free(w->images);
     g_free(w);
 }
@@ -43,6 +43,12 @@ typedef struct GlibJpegDecoder
     int      _data_size;
     int      _width;
     int      _height;
+
+#ifndef JCS_EXTENSIONS
+    /* RGB scanlines, kept from one image to the next */
+    uint8_t* _scan_lines;
+    gsize    _scan_lines_size;
+#endif
 } GlibJpegDecoder;
 
 static void begin_decode(SpiceJpegDecoder *decoder,
@@ -73,7 +79,11 @@ static void begin_decode(SpiceJpegDecoder *decoder,
     *out_height = d->_height;
 }
 
-/* TODO: move it elsewhere and reuse it in get_pixbuf(), optimize? */
+#ifndef JCS_EXTENSIONS
+/*
+ * Without libjpeg-turbo, the RGB scanlines are converted to BGR(X) by
+ * the best kernel for the CPU, picked once at runtime.
+ */
 typedef void (*converter_rgb_t)(uint8_t* src, uint8_t* dest, int width);
 
 static void convert_rgb_to_bgr(uint8_t* src, uint8_t* dest, int width)
@@ -101,37 +111,195 @@ static void convert_rgb_to_bgrx(uint8_t* src, uint8_t* dest, int width)
     }
 }
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_CONVERTERS
+#include <immintrin.h>
+
+/* the 16 bytes loads read 4 bytes beyond the 4 pixels converted */
+__attribute__((target("ssse3")))
+static void convert_rgb_to_bgr_ssse3(uint8_t* src, uint8_t* dest, int width)
+{
+    const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9,
+                                          -1, -1, -1, -1);
+    int x;
+
+    /* the stores write 4 bytes beyond too, overwritten by the next ones */
+    for (x = 0; x + 6 <= width; x += 4) {
+        __m128i rgb = _mm_loadu_si128((const __m128i *)(src + x * 3));
+        _mm_storeu_si128((__m128i *)(dest + x * 3), _mm_shuffle_epi8(rgb, shuffle));
+    }
+    convert_rgb_to_bgr(src + x * 3, dest + x * 3, width - x);
+}
+
+__attribute__((target("ssse3")))
+static void convert_rgb_to_bgrx_ssse3(uint8_t* src, uint8_t* dest, int width)
+{
+    const __m128i shuffle = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1,
+                                          8, 7, 6, -1, 11, 10, 9, -1);
+    int x;
+
+    for (x = 0; x + 6 <= width; x += 4) {
+        __m128i rgb = _mm_loadu_si128((const __m128i *)(src + x * 3));
+        _mm_storeu_si128((__m128i *)(dest + x * 4), _mm_shuffle_epi8(rgb, shuffle));
+    }
+    convert_rgb_to_bgrx(src + x * 3, dest + x * 4, width - x);
+}
+
+__attribute__((target("avx2")))
+static void convert_rgb_to_bgrx_avx2(uint8_t* src, uint8_t* dest, int width)
+{
+    const __m256i shuffle = _mm256_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1,
+                                             8, 7, 6, -1, 11, 10, 9, -1,
+                                             2, 1, 0, -1, 5, 4, 3, -1,
+                                             8, 7, 6, -1, 11, 10, 9, -1);
+    int x;
+
+    /* 4 pixels in each 128-bit lane */
+    for (x = 0; x + 10 <= width; x += 8) {
+        __m128i lo = _mm_loadu_si128((const __m128i *)(src + x * 3));
+        __m128i hi = _mm_loadu_si128((const __m128i *)(src + x * 3 + 12));
+        __m256i rgb = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+        _mm256_storeu_si256((__m256i *)(dest + x * 4), _mm256_shuffle_epi8(rgb, shuffle));
+    }
+    convert_rgb_to_bgrx_ssse3(src + x * 3, dest + x * 4, width - x);
+}
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HAVE_NEON_CONVERTERS
+#include <arm_neon.h>
+
+static void convert_rgb_to_bgr_neon(uint8_t* src, uint8_t* dest, int width)
+{
+    int x;
+
+    for (x = 0; x + 16 <= width; x += 16) {
+        uint8x16x3_t rgb = vld3q_u8(src + x * 3);
+        uint8x16x3_t bgr = { { rgb.val[2], rgb.val[1], rgb.val[0] } };
+        vst3q_u8(dest + x * 3, bgr);
+    }
+    convert_rgb_to_bgr(src + x * 3, dest + x * 3, width - x);
+}
+
+static void convert_rgb_to_bgrx_neon(uint8_t* src, uint8_t* dest, int width)
+{
+    int x;
+
+    for (x = 0; x + 16 <= width; x += 16) {
+        uint8x16x3_t rgb = vld3q_u8(src + x * 3);
+        uint8x16x4_t bgrx = { { rgb.val[2], rgb.val[1], rgb.val[0], vdupq_n_u8(0) } };
+        vst4q_u8(dest + x * 4, bgrx);
+    }
+    convert_rgb_to_bgrx(src + x * 3, dest + x * 4, width - x);
+}
+#endif
+
+static converter_rgb_t converter_rgb_to_bgr = convert_rgb_to_bgr;
+static converter_rgb_t converter_rgb_to_bgrx = convert_rgb_to_bgrx;
+
+static void init_converters(void)
+{
+    static gsize initialized = 0;
+
+    if (!g_once_init_enter(&initialized))
+        return;
+
+#ifdef HAVE_X86_CONVERTERS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) {
+        converter_rgb_to_bgr = convert_rgb_to_bgr_ssse3;
+        converter_rgb_to_bgrx = convert_rgb_to_bgrx_ssse3;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        converter_rgb_to_bgrx = convert_rgb_to_bgrx_avx2;
+    }
+#endif
+#ifdef HAVE_NEON_CONVERTERS
+    converter_rgb_to_bgr = convert_rgb_to_bgr_neon;
+    converter_rgb_to_bgrx = convert_rgb_to_bgrx_neon;
+#endif
+
+    g_once_init_leave(&initialized, 1);
+}
+#endif
+
 static void decode(SpiceJpegDecoder *decoder,
                    uint8_t* dest, int stride, int format)
 {
     GlibJpegDecoder *d = SPICE_CONTAINEROF(decoder, GlibJpegDecoder, base);
-    uint8_t* scan_line = g_alloca(d->_width * 3);
+    JSAMPROW *lines;
+#ifndef JCS_EXTENSIONS
     converter_rgb_t converter = NULL;
-    int row;
+#endif
+    unsigned int i, n_lines;
+    int bpp;
 
     switch (format) {
     case SPICE_BITMAP_FMT_24BIT:
-        converter = convert_rgb_to_bgr;
+        bpp = 3;
+#ifdef JCS_EXTENSIONS
+        d->_cinfo.out_color_space = JCS_EXT_BGR;
+#else
+        converter = converter_rgb_to_bgr;
+#endif
         break;
     case SPICE_BITMAP_FMT_32BIT:
-        converter = convert_rgb_to_bgrx;
+        bpp = 4;
+#ifdef JCS_EXTENSIONS
+        /* the padding byte is 0xff instead of 0, it is ignored */
+        d->_cinfo.out_color_space = JCS_EXT_BGRX;
+#else
+        converter = converter_rgb_to_bgrx;
+#endif
         break;
     default:
         g_warning("bad bitmap format, %d", format);
         return;
     }
 
-    g_return_if_fail(converter != NULL);
+    /* the rows are written in place, they must not overlap */
+    g_return_if_fail(ABS(stride) >= d->_width * bpp);
 
     jpeg_start_decompress(&d->_cinfo);
 
-    for (row = 0; row < d->_height; row++) {
-        jpeg_read_scanlines(&d->_cinfo, &scan_line, 1);
-        converter(scan_line, dest, d->_width);
-        dest += stride;
+    /* rec_outbuf_height is the recommended number of scanlines to read
+     * at once for optimum performance (with upsampled chroma) */
+    n_lines = MAX(d->_cinfo.rec_outbuf_height, 1);
+    lines = g_alloca(n_lines * sizeof(JSAMPROW));
+#ifndef JCS_EXTENSIONS
+    if (d->_scan_lines_size < (gsize)n_lines * d->_width * 3) {
+        d->_scan_lines_size = (gsize)n_lines * d->_width * 3;
+        g_free(d->_scan_lines);
+        d->_scan_lines = g_malloc(d->_scan_lines_size);
     }
+    for (i = 0; i < n_lines; i++)
+        lines[i] = d->_scan_lines + (gsize)i * d->_width * 3;
+#endif
+
+    while (d->_cinfo.output_scanline < d->_cinfo.output_height) {
+        unsigned int n = MIN(n_lines, d->_cinfo.output_height - d->_cinfo.output_scanline);
 
-    jpeg_finish_decompress(&d->_cinfo);
+#ifdef JCS_EXTENSIONS
+        /* decoded in place */
+        for (i = 0; i < n; i++)
+            lines[i] = dest + (gssize)i * stride;
+#endif
+        n = jpeg_read_scanlines(&d->_cinfo, lines, n);
+        if (n == 0) {
+            /* truncated data */
+            break;
+        }
+#ifndef JCS_EXTENSIONS
+        for (i = 0; i < n; i++)
+            converter(lines[i], dest + (gssize)i * stride, d->_width);
+#endif
+        dest += (gssize)n * stride;
+    }
+
+    if (d->_cinfo.output_scanline < d->_cinfo.output_height)
+        jpeg_abort_decompress(&d->_cinfo);
+    else
+        jpeg_finish_decompress(&d->_cinfo);
 }
 
 static SpiceJpegDecoderOps jpeg_decoder_ops = {
@@ -177,6 +345,9 @@ SpiceJpegDecoder *jpeg_decoder_new(void)
     d->_cinfo.src->term_source = jpeg_decoder_term_source;
 
     d->base.ops = &jpeg_decoder_ops;
+#ifndef JCS_EXTENSIONS
+    init_converters();
+#endif
 
     return &d->base;
 }
@@ -186,5 +357,8 @@ void jpeg_decoder_destroy(SpiceJpegDecoder *decoder)
     GlibJpegDecoder *d = SPICE_CONTAINEROF(decoder, GlibJpegDecoder, base);
 
     jpeg_destroy_decompress(&d->_cinfo);
+#ifndef JCS_EXTENSIONS
+    g_free(d->_scan_lines);
+#endif
     g_free(d);
 }
@@ -0,0 +1,295 @@
+/*
+   Copyright (C) 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <string.h>
+
+#include "decode.h"
+#include "spice-util-priv.h"
+
+#include "common/lz_common.h"
+#include "common/quic.h"
+
+/*
+ * Worker threads decoding standalone images (not depending on the
+ * caches) ahead of the display channel coroutine. GLZ images are
+ * decoded in a thread only if the images they refer to are already in
+ * the window, so that the threads never wait.
+ *
+ * Each job decodes its image by drawing it on a private software canvas
+ * of the image size, so that the canvas decoders are reused as is. The
+ * canvas global tables are initialized when the first surface canvas is
+ * created by the display channel, before any job can be queued.
+ */
+
+/* smaller images are not worth a thread round-trip */
+#define DECODE_OFFLOAD_MIN_PIXELS (128 * 128)
+
+struct SpiceDecodePool {
+    GThreadPool             *threads;
+    SpiceGlzDecoderWindow   *glz_window;
+};
+
+struct SpiceDecodeJob {
+    SpiceImage      *image;
+    pixman_image_t  *result;
+    GMainContext    *context; /* where the owner of the job polls it */
+    gint            done;
+    GMutex          lock;
+    GCond           cond;
+};
+
+static void dummy_image_put(SpiceImageCache *cache, uint64_t id, pixman_image_t *surface)
+{
+}
+
+static pixman_image_t *dummy_image_get(SpiceImageCache *cache, uint64_t id)
+{
+    return NULL;
+}
+
+static SpiceImageCacheOps dummy_image_cache_ops = {
+    .put = dummy_image_put,
+    .get = dummy_image_get,
+
+    .put_lossy = dummy_image_put,
+    .replace_lossy = dummy_image_put,
+    .get_lossless = dummy_image_get,
+};
+
+static void dummy_palette_put(SpicePaletteCache *cache, SpicePalette *palette)
+{
+}
+
+static SpicePalette *dummy_palette_get(SpicePaletteCache *cache, uint64_t id)
+{
+    return NULL;
+}
+
+static SpicePaletteCacheOps dummy_palette_cache_ops = {
+    .put     = dummy_palette_put,
+    .get     = dummy_palette_get,
+    .release = dummy_palette_put,
+};
+
+static SpiceCanvas *dummy_surfaces_get(SpiceImageSurfaces *surfaces, uint32_t surface_id)
+{
+    return NULL;
+}
+
+static SpiceImageSurfacesOps dummy_surfaces_ops = {
+    .get = dummy_surfaces_get,
+};
+
+/*
+ * Whether @image has an alpha channel. canvas_get_image() keeps it in
+ * the images it caches, and only then, the decoded images must match.
+ */
+static gboolean decode_image_has_alpha(const SpiceImage *image)
+{
+    const SpiceChunks *chunks;
+    guint32 type;
+
+    switch (image->descriptor.type) {
+    case SPICE_IMAGE_TYPE_QUIC:
+        /* the type follows the magic and the version, little endian */
+        chunks = image->u.quic.data;
+        if (chunks == NULL || chunks->num_chunks == 0 || chunks->chunk[0].len < 12)
+            return FALSE;
+        memcpy(&type, chunks->chunk[0].data + 8, sizeof(type));
+        return GUINT32_FROM_LE(type) == QUIC_IMAGE_TYPE_RGBA;
+    case SPICE_IMAGE_TYPE_LZ_RGB:
+    case SPICE_IMAGE_TYPE_GLZ_RGB:
+        /* the type follows the magic and the version, see decode_header() */
+        chunks = image->u.lz_rgb.data;
+        if (chunks == NULL || chunks->num_chunks == 0 || chunks->chunk[0].len < 9)
+            return FALSE;
+        return (chunks->chunk[0].data[8] & LZ_IMAGE_TYPE_MASK) == LZ_IMAGE_TYPE_RGBA;
+    default:
+        return FALSE;
+    }
+}
+
+/* worker thread */
+static pixman_image_t *decode_image(SpiceDecodePool *pool, SpiceImage *image)
+{
+    SpiceImageCache image_cache = { .ops = &dummy_image_cache_ops };
+    SpicePaletteCache palette_cache = { .ops = &dummy_palette_cache_ops };
+    SpiceImageSurfaces surfaces = { .ops = &dummy_surfaces_ops };
+    int width = image->descriptor.width;
+    int height = image->descriptor.height;
+    SpiceRect bbox = { .left = 0, .top = 0, .right = width, .bottom = height };
+    SpiceClip clip = { .type = SPICE_CLIP_TYPE_NONE };
+    SpiceCopy copy = {
+        .src_bitmap = image,
+        .src_area = bbox,
+        .rop_descriptor = SPICE_ROPD_OP_PUT,
+        .scale_mode = SPICE_IMAGE_SCALE_MODE_NEAREST,
+    };
+    gboolean alpha = decode_image_has_alpha(image);
+    SpiceJpegDecoder *jpeg_decoder;
+    SpiceGlzDecoder *glz_decoder;
+    SpiceCanvas *canvas;
+    pixman_image_t *result;
+
+    result = pixman_image_create_bits(alpha ? PIXMAN_LE_a8r8g8b8 : PIXMAN_LE_x8r8g8b8,
+                                      width, height, NULL, 0);
+    if (result == NULL)
+        return NULL;
+
+    jpeg_decoder = jpeg_decoder_new();
+    glz_decoder = glz_decoder_new(pool->glz_window);
+    canvas = canvas_create_for_data(width, height,
+                                    alpha ? SPICE_SURFACE_FMT_32_ARGB : SPICE_SURFACE_FMT_32_xRGB,
+                                    (uint8_t *)pixman_image_get_data(result),
+                                    pixman_image_get_stride(result),
+                                    &image_cache, &palette_cache, &surfaces,
+                                    glz_decoder, jpeg_decoder, NULL);
+    if (canvas == NULL) {
+        g_warning("failed to create decoding canvas");
+        g_clear_pointer(&result, pixman_image_unref);
+    } else {
+        canvas->ops->draw_copy(canvas, &bbox, &clip, &copy);
+        canvas->ops->destroy(canvas);
+    }
+    glz_decoder_destroy(glz_decoder);
+    jpeg_decoder_destroy(jpeg_decoder);
+
+    return result;
+}
+
+/* worker thread */
+static void decode_job_run(gpointer data, gpointer user_data)
+{
+    SpiceDecodeJob *job = data;
+    SpiceDecodePool *pool = user_data;
+    pixman_image_t *result = decode_image(pool, job->image);
+    /* the job may be freed as soon as it is done */
+    GMainContext *context = g_main_context_ref(job->context);
+
+    g_mutex_lock(&job->lock);
+    job->result = result;
+    g_atomic_int_set(&job->done, TRUE);
+    g_cond_signal(&job->cond);
+    g_mutex_unlock(&job->lock);
+
+    /* the coroutine polls the job from its loop, make it iterate */
+    g_main_context_wakeup(context);
+    g_main_context_unref(context);
+}
+
+SpiceDecodePool *decode_pool_new(guint n_threads, SpiceGlzDecoderWindow *glz_window)
+{
+    SpiceDecodePool *pool = g_new0(SpiceDecodePool, 1);
+    GError *error = NULL;
+
+    pool->glz_window = glz_window;
+    pool->threads = g_thread_pool_new(decode_job_run, pool, n_threads, TRUE, &error);
+    if (error != NULL) {
+        g_warning("failed to create decoding threads: %s", error->message);
+        g_clear_error(&error);
+        decode_pool_free(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+void decode_pool_free(SpiceDecodePool *pool)
+{
+    if (pool == NULL)
+        return;
+
+    /* finishes the queued jobs, their owners are waiting for them */
+    if (pool->threads)
+        g_thread_pool_free(pool->threads, FALSE, TRUE);
+    g_free(pool);
+}
+
+gboolean decode_pool_can_offload(SpiceDecodePool *pool, const SpiceImage *image)
+{
+    const SpiceImageDescriptor *descriptor = &image->descriptor;
+    const SpiceChunks *chunks;
+
+    switch (descriptor->type) {
+    case SPICE_IMAGE_TYPE_QUIC:
+    case SPICE_IMAGE_TYPE_LZ_RGB:
+    case SPICE_IMAGE_TYPE_JPEG:
+        break;
+    case SPICE_IMAGE_TYPE_GLZ_RGB:
+        chunks = image->u.lz_rgb.data;
+        if (chunks == NULL || chunks->num_chunks != 1 ||
+            !glz_decoder_window_can_decode(pool->glz_window,
+                                           chunks->chunk[0].data, chunks->chunk[0].len))
+            return FALSE;
+        break;
+    default:
+        /* the others need the caches or the surfaces */
+        return FALSE;
+    }
+
+    if (descriptor->flags & SPICE_IMAGE_FLAGS_CACHE_REPLACE_ME)
+        return FALSE;
+
+    return (guint64)descriptor->width * descriptor->height >= DECODE_OFFLOAD_MIN_PIXELS;
+}
+
+/*
+ * @image must stay valid and unmodified until decode_job_finish() is
+ * called.
+ */
+SpiceDecodeJob *decode_pool_push(SpiceDecodePool *pool, SpiceImage *image)
+{
+    SpiceDecodeJob *job = g_new0(SpiceDecodeJob, 1);
+    GMainContext *context = spice_thread_context();
+
+    job->image = image;
+    job->context = g_main_context_ref(context ? context : g_main_context_default());
+    g_mutex_init(&job->lock);
+    g_cond_init(&job->cond);
+    g_thread_pool_push(pool->threads, job, NULL);
+
+    return job;
+}
+
+gboolean decode_job_is_done(SpiceDecodeJob *job)
+{
+    return g_atomic_int_get(&job->done);
+}
+
+/*
+ * Waits for @job completion if needed, and frees it.
+ *
+ * Returns: the decoded image, or %NULL if decoding failed
+ */
+pixman_image_t *decode_job_finish(SpiceDecodeJob *job)
+{
+    pixman_image_t *result;
+
+    g_mutex_lock(&job->lock);
+    while (!job->done)
+        g_cond_wait(&job->cond, &job->lock);
+    result = job->result;
+    g_mutex_unlock(&job->lock);
+
+    g_mutex_clear(&job->lock);
+    g_cond_clear(&job->cond);
+    g_main_context_unref(job->context);
+    g_free(job);
+
+    return result;
+}
@@ -26,6 +26,9 @@ typedef struct SpiceGlzDecoderWindow SpiceGlzDecoderWindow;
 
 SpiceGlzDecoderWindow *glz_decoder_window_new(void);
 void glz_decoder_window_clear(SpiceGlzDecoderWindow *w);
+void glz_decoder_window_set_size(SpiceGlzDecoderWindow *w, uint64_t max_bytes);
+gboolean glz_decoder_window_can_decode(SpiceGlzDecoderWindow *w,
+                                       const uint8_t *data, size_t size);
 void glz_decoder_window_destroy(SpiceGlzDecoderWindow *w);
 
 SpiceGlzDecoder *glz_decoder_new(SpiceGlzDecoderWindow *w);
@@ -37,4 +40,14 @@ void zlib_decoder_destroy(SpiceZlibDecoder *d);
 SpiceJpegDecoder *jpeg_decoder_new(void);
 void jpeg_decoder_destroy(SpiceJpegDecoder *d);
 
+typedef struct SpiceDecodePool SpiceDecodePool;
+typedef struct SpiceDecodeJob SpiceDecodeJob;
+
+SpiceDecodePool *decode_pool_new(guint n_threads, SpiceGlzDecoderWindow *glz_window);
+void decode_pool_free(SpiceDecodePool *pool);
+gboolean decode_pool_can_offload(SpiceDecodePool *pool, const SpiceImage *image);
+SpiceDecodeJob *decode_pool_push(SpiceDecodePool *pool, SpiceImage *image);
+gboolean decode_job_is_done(SpiceDecodeJob *job);
+pixman_image_t *decode_job_finish(SpiceDecodeJob *job);
+
 G_END_DECLS
@@ -57,7 +57,7 @@ GIOCondition g_coroutine_socket_wait(GCoroutine *self,
 
     src = g_socket_create_source(sock, cond | G_IO_HUP | G_IO_ERR | G_IO_NVAL, NULL);
     g_source_set_callback(src, (GSourceFunc)g_io_wait_helper, self, NULL);
-    self->wait_id = g_source_attach(src, spice_main_context());
+    self->wait_id = g_source_attach(src, spice_thread_context());
     ret = coroutine_yield(NULL);
     g_source_unref(src);
 
@@ -167,7 +167,7 @@ gboolean g_coroutine_condition_wait(GCoroutine *self, GConditionWaitFunc func, g
     vsrc->func = func;
     vsrc->data = data;
 
-    self->condition_id = g_source_attach(src, spice_main_context());
+    self->condition_id = g_source_attach(src, spice_thread_context());
     g_source_set_callback(src, g_condition_wait_helper, self, NULL);
     coroutine_yield(NULL);
     g_source_unref(src);
@@ -180,6 +180,89 @@ gboolean g_coroutine_condition_wait(GCoroutine *self, GConditionWaitFunc func, g
     return TRUE;
 }
 
+void g_coroutine_notify_init(GCoroutineNotify *notify)
+{
+    g_mutex_init(&notify->lock);
+    notify->source = NULL;
+    notify->pending = FALSE;
+}
+
+void g_coroutine_notify_clear(GCoroutineNotify *notify)
+{
+    g_warn_if_fail(notify->source == NULL);
+    g_mutex_clear(&notify->lock);
+}
+
+/* any thread */
+void g_coroutine_notify(GCoroutineNotify *notify)
+{
+    g_mutex_lock(&notify->lock);
+    notify->pending = TRUE;
+    if (notify->source != NULL)
+        g_source_set_ready_time(notify->source, 0);
+    g_mutex_unlock(&notify->lock);
+}
+
+/* only dispatched once its ready time is set, by g_coroutine_notify() */
+static GSourceFuncs notifyFuncs = {
+    .dispatch = g_condition_wait_dispatch,
+};
+
+/*
+ * g_coroutine_condition_wait_notified:
+ * @coroutine: the coroutine to wait on
+ * @func: the condition callback
+ * @data: the user data passed to @func callback
+ * @notify: the notifier used to wake up the coroutine
+ *
+ * Like g_coroutine_condition_wait(), except that @func is only called
+ * again after g_coroutine_notify() was called on @notify.
+ *
+ * Returns: %TRUE if condition reached, %FALSE if not and cancelled
+ */
+gboolean g_coroutine_condition_wait_notified(GCoroutine *self,
+                                             GConditionWaitFunc func, gpointer data,
+                                             GCoroutineNotify *notify)
+{
+    GSource *src;
+
+    g_return_val_if_fail(self != NULL, FALSE);
+    g_return_val_if_fail(self->condition_id == 0, FALSE);
+    g_return_val_if_fail(func != NULL, FALSE);
+    g_return_val_if_fail(notify != NULL, FALSE);
+
+    while (!func(data)) {
+        g_mutex_lock(&notify->lock);
+        if (notify->pending) {
+            /* notified since the last check */
+            notify->pending = FALSE;
+            g_mutex_unlock(&notify->lock);
+            continue;
+        }
+
+        src = g_source_new(&notifyFuncs, sizeof(GSource));
+        g_source_set_callback(src, g_condition_wait_helper, self, NULL);
+        self->condition_id = g_source_attach(src, spice_thread_context());
+        notify->source = src;
+        g_mutex_unlock(&notify->lock);
+
+        coroutine_yield(NULL);
+
+        g_mutex_lock(&notify->lock);
+        notify->source = NULL;
+        notify->pending = FALSE;
+        g_mutex_unlock(&notify->lock);
+        g_source_unref(src);
+
+        /* it got woked up / cancelled? */
+        if (self->condition_id == 0)
+            return func(data);
+        self->condition_id = 0;
+    }
+
+    return TRUE;
+}
+
 struct signal_data
 {
     gpointer instance;
@@ -189,17 +272,63 @@ struct signal_data
     const gchar *propname;
     gboolean notified;
     va_list var_args;
+
+    /* for the emissions from the thread of a channel */
+    GMutex lock;
+    GCond cond;
 };
 
+/* main context: resumes the emitter once done */
+static void signal_data_done(struct signal_data *signal)
+{
+    if (signal->caller == NULL) {
+        g_mutex_lock(&signal->lock);
+        signal->notified = TRUE;
+        g_cond_signal(&signal->cond);
+        g_mutex_unlock(&signal->lock);
+    } else {
+        signal->notified = TRUE;
+        coroutine_yieldto(signal->caller, NULL);
+    }
+}
+
+/*
+ * Runs @func in the main context and returns once it is done. This
+ * switches to the system coroutine, which lets the idle function run,
+ * or blocks the thread of a channel until the main context ran it.
+ * Either way this is synchronous from the POV of the caller.
+ */
+static void signal_data_run_main_context(struct signal_data *data, GSourceFunc func)
+{
+    if (spice_util_in_channel_thread()) {
+        data->caller = NULL;
+        g_mutex_init(&data->lock);
+        g_cond_init(&data->cond);
+
+        g_spice_context_idle_add(spice_main_context(), func, data);
+
+        g_mutex_lock(&data->lock);
+        while (!data->notified)
+            g_cond_wait(&data->cond, &data->lock);
+        g_mutex_unlock(&data->lock);
+
+        g_mutex_clear(&data->lock);
+        g_cond_clear(&data->cond);
+    } else {
+        data->caller = coroutine_self();
+        g_spice_idle_add(func, data);
+        coroutine_yield(NULL);
+    }
+    g_warn_if_fail(data->notified);
+}
+
 static gboolean emit_main_context(gpointer opaque)
 {
     struct signal_data *signal = opaque;
 
     g_signal_emit_valist(signal->instance, signal->signal_id,
                          signal->detail, signal->var_args);
-    signal->notified = TRUE;
-
-    coroutine_yieldto(signal->caller, NULL);
+    signal_data_done(signal);
 
     return FALSE;
 }
@@ -212,18 +341,15 @@ g_coroutine_signal_emit(gpointer instance, guint signal_id,
         .instance = instance,
         .signal_id = signal_id,
         .detail = detail,
-        .caller = coroutine_self(),
     };
 
     va_start (data.var_args, detail);
 
-    if (coroutine_self_is_main()) {
+    if (coroutine_self_is_main() && !spice_util_in_channel_thread()) {
         g_signal_emit_valist(instance, signal_id, detail, data.var_args);
     } else {
         g_object_ref(instance);
-        g_spice_idle_add(emit_main_context, &data);
-        coroutine_yield(NULL);
-        g_warn_if_fail(data.notified);
+        signal_data_run_main_context(&data, emit_main_context);
         g_object_unref(instance);
     }
 
@@ -236,38 +362,25 @@ static gboolean notify_main_context(gpointer opaque)
     struct signal_data *signal = opaque;
 
     g_object_notify(signal->instance, signal->propname);
-    signal->notified = TRUE;
-
-    coroutine_yieldto(signal->caller, NULL);
+    signal_data_done(signal);
 
     return FALSE;
 }
 
-/* coroutine -> main context */
+/* coroutine or channel thread -> main context */
 void g_coroutine_object_notify(GObject *object,
                                const gchar *property_name)
 {
-    struct signal_data data;
+    struct signal_data data = { 0, };
 
-    if (coroutine_self_is_main()) {
+    if (coroutine_self_is_main() && !spice_util_in_channel_thread()) {
         g_object_notify(object, property_name);
     } else {
-
         data.instance = g_object_ref(object);
-        data.caller = coroutine_self();
         data.propname = (gpointer)property_name;
         data.notified = FALSE;
 
-        g_spice_idle_add(notify_main_context, &data);
-
-        /* This switches to the system coroutine context, lets
-         * the idle function run to dispatch the signal, and
-         * finally returns once complete. ie this is synchronous
-         * from the POV of the coroutine despite there being
-         * an idle function involved
-         */
-        coroutine_yield(NULL);
-        g_warn_if_fail(data.notified);
+        signal_data_run_main_context(&data, notify_main_context);
         g_object_unref(object);
     }
 }
@@ -46,6 +46,18 @@ typedef gboolean (*GConditionWaitFunc)(gpointer);
 
 typedef void (*GSignalEmitMainFunc)(GObject *object, int signum, gpointer params);
 
+/*
+ * Wakes up a coroutine waiting with g_coroutine_condition_wait_notified(),
+ * from any thread. The condition is only checked again when notified,
+ * rather than on each main loop iteration.
+ */
+typedef struct _GCoroutineNotify
+{
+    GMutex lock;
+    GSource *source;
+    gboolean pending;
+} GCoroutineNotify;
+
 GCoroutine*  g_coroutine_self           (void);
 void         g_coroutine_wakeup         (GCoroutine *coroutine);
 GIOCondition g_coroutine_socket_wait    (GCoroutine *coroutine,
@@ -54,6 +66,13 @@ gboolean     g_coroutine_condition_wait (GCoroutine *coroutine,
                                          GConditionWaitFunc func, gpointer data);
 void         g_coroutine_condition_cancel(GCoroutine *coroutine);
 
+void         g_coroutine_notify_init    (GCoroutineNotify *notify);
+void         g_coroutine_notify_clear   (GCoroutineNotify *notify);
+void         g_coroutine_notify         (GCoroutineNotify *notify);
+gboolean     g_coroutine_condition_wait_notified(GCoroutine *coroutine,
+                                                 GConditionWaitFunc func, gpointer data,
+                                                 GCoroutineNotify *notify);
+
 void         g_coroutine_signal_emit (gpointer instance, guint signal_id,
                                       GQuark detail, ...);
 
@@ -0,0 +1,417 @@
+/*
+   Copyright (C) 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <glib/gstdio.h>
+
+#include "image-store.h"
+#include "spice-util-priv.h"
+
+/*
+ * On-disk store of decoded images, persisting the images cache across
+ * connections.
+ *
+ * The ids of the cacheable images are computed by the guest driver from
+ * the image content, so they remain valid when reconnecting or migrating
+ * to another host. They are only unique within a guest, so the session
+ * gives each guest a directory of its own. Each image is saved in its own file named after its
+ * id, holding a small header followed by the pixels, so that it can be
+ * mapped back in memory as is. The header has the digest of the encoded
+ * image the pixels were decoded from, an image is only used again for the
+ * same encoded image. The least recently used files are removed when the
+ * store exceeds its budget.
+ *
+ * The files are written by a thread as the images are put in the store,
+ * at most IMAGE_STORE_MAX_PENDING bytes of them at a time, the others
+ * aren't stored.
+ */
+
+#define IMAGE_STORE_MAGIC   0x49434453 /* "SDCI" */
+#define IMAGE_STORE_VERSION 2
+
+#define IMAGE_STORE_MAX_PENDING (32 * 1024 * 1024)
+
+typedef struct ImageStoreHeader {
+    guint32 magic;
+    guint32 version;
+    guint32 format;
+    guint32 width;
+    guint32 height;
+    guint32 stride;
+    guint8  digest[IMAGE_STORE_DIGEST_SIZE];
+} ImageStoreHeader;
+
+typedef struct ImageStoreEntry {
+    guint64 id;
+    guint64 size;
+    gint64  mtime;
+    guint64 serial;
+    gboolean written;
+    GList   link;
+} ImageStoreEntry;
+
+typedef struct ImageStoreWrite {
+    guint64 id;
+    guint64 serial;
+    gchar   *contents;
+    guint64 size;
+} ImageStoreWrite;
+
+struct SpiceImageStore {
+    gchar      *dir;
+    guint64    max_bytes;
+    GThreadPool *writer;
+
+    /* shared with the writer */
+    GMutex     lock;
+    GCond      written;
+    guint64    bytes;
+    guint64    pending_bytes;
+    guint64    serial;
+    GHashTable *entries;
+    GQueue     lru; /* least recently used at head */
+};
+
+static gchar *image_store_path(SpiceImageStore *store, guint64 id)
+{
+    gchar name[17];
+
+    g_snprintf(name, sizeof(name), "%016" G_GINT64_MODIFIER "x", id);
+    return g_build_filename(store->dir, name, NULL);
+}
+
+static void image_store_remove_entry(SpiceImageStore *store, ImageStoreEntry *e)
+{
+    gchar *path = image_store_path(store, e->id);
+
+    if (g_unlink(path) != 0 && errno != ENOENT)
+        SPICE_DEBUG("failed to remove %s: %s", path, g_strerror(errno));
+    g_free(path);
+
+    store->bytes -= e->size;
+    g_queue_unlink(&store->lru, &e->link);
+    g_hash_table_remove(store->entries, &e->id);
+}
+
+static void image_store_trim(SpiceImageStore *store)
+{
+    while (store->bytes > store->max_bytes && store->lru.head != NULL)
+        image_store_remove_entry(store, store->lru.head->data);
+}
+
+static ImageStoreEntry *image_store_add_entry(SpiceImageStore *store,
+                                              guint64 id, guint64 size)
+{
+    ImageStoreEntry *e = g_new0(ImageStoreEntry, 1);
+
+    e->id = id;
+    e->size = size;
+    e->serial = ++store->serial;
+    e->written = TRUE;
+    e->link.data = e;
+    g_hash_table_insert(store->entries, &e->id, e);
+    g_queue_push_tail_link(&store->lru, &e->link);
+    store->bytes += size;
+
+    return e;
+}
+
+static gint entry_mtime_cmp(gconstpointer a, gconstpointer b)
+{
+    const ImageStoreEntry *ea = a;
+    const ImageStoreEntry *eb = b;
+
+    return (ea->mtime > eb->mtime) - (ea->mtime < eb->mtime);
+}
+
+static void image_store_scan(SpiceImageStore *store)
+{
+    GDir *dir = g_dir_open(store->dir, 0, NULL);
+    GList *found = NULL, *l;
+    const gchar *name;
+
+    if (dir == NULL)
+        return;
+
+    while ((name = g_dir_read_name(dir)) != NULL) {
+        GStatBuf st;
+        gchar *end = NULL, *path;
+        guint64 id;
+
+        if (strlen(name) != 16)
+            continue;
+        id = g_ascii_strtoull(name, &end, 16);
+        if (end == NULL || *end != '\0')
+            continue;
+
+        path = g_build_filename(store->dir, name, NULL);
+        if (g_stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+            ImageStoreEntry *e = g_new0(ImageStoreEntry, 1);
+
+            e->id = id;
+            e->size = st.st_size;
+            e->mtime = st.st_mtime;
+            found = g_list_prepend(found, e);
+        }
+        g_free(path);
+    }
+    g_dir_close(dir);
+
+    found = g_list_sort(found, entry_mtime_cmp);
+    for (l = found; l != NULL; l = l->next) {
+        ImageStoreEntry *e = l->data;
+
+        image_store_add_entry(store, e->id, e->size);
+        g_free(e);
+    }
+    g_list_free(found);
+}
+
+/* writer thread */
+static void image_store_write(gpointer data, gpointer user_data)
+{
+    ImageStoreWrite *w = data;
+    SpiceImageStore *store = user_data;
+    ImageStoreEntry *e;
+    GError *error = NULL;
+    gchar *path = image_store_path(store, w->id);
+    gboolean ok;
+
+    ok = g_file_set_contents(path, w->contents, w->size, &error);
+    if (!ok) {
+        SPICE_DEBUG("failed to store image: %s", error->message);
+        g_clear_error(&error);
+    }
+
+    g_mutex_lock(&store->lock);
+    e = g_hash_table_lookup(store->entries, &w->id);
+    if (e != NULL && e->serial == w->serial) {
+        if (ok)
+            e->written = TRUE;
+        else
+            image_store_remove_entry(store, e);
+    } else if (e == NULL && ok) {
+        /* removed from the store while it was written */
+        g_unlink(path);
+    }
+    store->pending_bytes -= w->size;
+    g_cond_broadcast(&store->written);
+    g_mutex_unlock(&store->lock);
+
+    g_free(path);
+    g_free(w->contents);
+    g_free(w);
+}
+
+SpiceImageStore *image_store_new(const gchar *dir, guint64 max_bytes)
+{
+    SpiceImageStore *store;
+    GError *error = NULL;
+
+    g_return_val_if_fail(dir != NULL, NULL);
+
+    if (g_mkdir_with_parents(dir, 0700) != 0) {
+        g_warning("failed to create image cache directory %s: %s",
+                  dir, g_strerror(errno));
+        return NULL;
+    }
+
+    store = g_new0(SpiceImageStore, 1);
+    store->dir = g_strdup(dir);
+    store->max_bytes = max_bytes;
+    store->entries = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, g_free);
+    g_queue_init(&store->lru);
+    g_mutex_init(&store->lock);
+    g_cond_init(&store->written);
+    /* a single thread, the files of an id are written in order */
+    store->writer = g_thread_pool_new(image_store_write, store, 1, FALSE, &error);
+    if (error != NULL) {
+        g_warning("failed to create the image cache writer: %s", error->message);
+        g_clear_error(&error);
+        image_store_free(store);
+        return NULL;
+    }
+
+    image_store_scan(store);
+    image_store_trim(store);
+    SPICE_DEBUG("image store %s: %u images, %" G_GUINT64_FORMAT " bytes",
+                dir, g_hash_table_size(store->entries), store->bytes);
+
+    return store;
+}
+
+void image_store_free(SpiceImageStore *store)
+{
+    if (store == NULL)
+        return;
+
+    /* finishes the pending writes, they are bounded */
+    if (store->writer)
+        g_thread_pool_free(store->writer, FALSE, TRUE);
+    g_mutex_clear(&store->lock);
+    g_cond_clear(&store->written);
+    g_hash_table_unref(store->entries);
+    g_free(store->dir);
+    g_free(store);
+}
+
+gboolean image_store_contains(SpiceImageStore *store, guint64 id)
+{
+    gboolean found;
+
+    g_mutex_lock(&store->lock);
+    found = g_hash_table_contains(store->entries, &id);
+    g_mutex_unlock(&store->lock);
+
+    return found;
+}
+
+static void mapped_image_destroy(pixman_image_t *image, void *data)
+{
+    g_mapped_file_unref(data);
+}
+
+/*
+ * Returns: (transfer full): the image @id mapped from disk, or %NULL if
+ * it isn't stored, or wasn't decoded from the encoded image of @digest
+ * with the expected size. Neither is checked if @digest is %NULL, for the
+ * images only known by their id.
+ */
+pixman_image_t *image_store_lookup(SpiceImageStore *store, guint64 id,
+                                   const guint8 *digest, int width, int height)
+{
+    ImageStoreEntry *e;
+    const ImageStoreHeader *header;
+    pixman_image_t *image = NULL;
+    GMappedFile *file;
+    GError *error = NULL;
+    gchar *path;
+    gsize length;
+
+    g_mutex_lock(&store->lock);
+    /* it was put recently, rather wait than miss it */
+    while ((e = g_hash_table_lookup(store->entries, &id)) != NULL && !e->written)
+        g_cond_wait(&store->written, &store->lock);
+    if (e == NULL) {
+        g_mutex_unlock(&store->lock);
+        return NULL;
+    }
+
+    path = image_store_path(store, id);
+    /* mapped privately, writes are copied on demand */
+    file = g_mapped_file_new(path, TRUE, &error);
+    if (file == NULL) {
+        SPICE_DEBUG("failed to map %s: %s", path, error->message);
+        g_clear_error(&error);
+        image_store_remove_entry(store, e);
+        goto end;
+    }
+
+    length = g_mapped_file_get_length(file);
+    header = (const ImageStoreHeader *)g_mapped_file_get_contents(file);
+    if (length < sizeof(*header) ||
+        header->magic != IMAGE_STORE_MAGIC ||
+        header->version != IMAGE_STORE_VERSION ||
+        (header->format != PIXMAN_x8r8g8b8 && header->format != PIXMAN_a8r8g8b8) ||
+        header->width > G_MAXINT / 4 || header->height > G_MAXINT ||
+        header->stride > G_MAXINT || header->stride % 4 != 0 ||
+        header->stride < (guint64)header->width * 4 ||
+        length - sizeof(*header) < (guint64)header->stride * header->height) {
+        SPICE_DEBUG("invalid image file %s", path);
+        g_mapped_file_unref(file);
+        image_store_remove_entry(store, e);
+        goto end;
+    }
+
+    if (digest != NULL &&
+        (memcmp(header->digest, digest, IMAGE_STORE_DIGEST_SIZE) != 0 ||
+         header->width != (guint32)width || header->height != (guint32)height)) {
+        /* not the same image, the id is stale, make room for the new one */
+        g_mapped_file_unref(file);
+        image_store_remove_entry(store, e);
+        goto end;
+    }
+
+    image = pixman_image_create_bits(header->format, header->width, header->height,
+                                     (uint32_t *)(header + 1), header->stride);
+    if (image == NULL) {
+        g_mapped_file_unref(file);
+        goto end;
+    }
+    pixman_image_set_destroy_function(image, mapped_image_destroy, file);
+
+    /* keep the recently used images across runs too */
+    g_utime(path, NULL);
+    g_queue_unlink(&store->lru, &e->link);
+    g_queue_push_tail_link(&store->lru, &e->link);
+
+end:
+    g_mutex_unlock(&store->lock);
+    g_free(path);
+    return image;
+}
+
+/*
+ * Queues @image for writing, stored as decoded from the encoded image of
+ * @digest. It isn't stored if too much is already waiting to be written.
+ */
+void image_store_put(SpiceImageStore *store, guint64 id, const guint8 *digest,
+                     pixman_image_t *image)
+{
+    ImageStoreHeader header = {
+        .magic = IMAGE_STORE_MAGIC,
+        .version = IMAGE_STORE_VERSION,
+        .format = pixman_image_get_format(image),
+        .width = pixman_image_get_width(image),
+        .height = pixman_image_get_height(image),
+        .stride = pixman_image_get_stride(image),
+    };
+    guint64 size = sizeof(header) + (guint64)header.stride * header.height;
+    ImageStoreEntry *e;
+    ImageStoreWrite *w;
+
+    /* only 32-bit images, rows going upward aren't worth handling */
+    if ((header.format != PIXMAN_x8r8g8b8 && header.format != PIXMAN_a8r8g8b8) ||
+        pixman_image_get_stride(image) <= 0 || size > store->max_bytes)
+        return;
+
+    g_mutex_lock(&store->lock);
+    if (g_hash_table_contains(store->entries, &id) ||
+        store->pending_bytes + size > IMAGE_STORE_MAX_PENDING) {
+        g_mutex_unlock(&store->lock);
+        return;
+    }
+
+    w = g_new0(ImageStoreWrite, 1);
+    w->id = id;
+    w->size = size;
+    e = image_store_add_entry(store, id, size);
+    e->written = FALSE;
+    w->serial = e->serial;
+    store->pending_bytes += size;
+    image_store_trim(store);
+    g_mutex_unlock(&store->lock);
+
+    memcpy(header.digest, digest, IMAGE_STORE_DIGEST_SIZE);
+    w->contents = g_malloc(size);
+    memcpy(w->contents, &header, sizeof(header));
+    memcpy(w->contents + sizeof(header), pixman_image_get_data(image),
+           size - sizeof(header));
+    g_thread_pool_push(store->writer, w, NULL);
+}
@@ -0,0 +1,37 @@
+/*
+   Copyright (C) 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <glib.h>
+#include <pixman.h>
+
+G_BEGIN_DECLS
+
+/* the size of a SHA-256 digest, the images are checked with */
+#define IMAGE_STORE_DIGEST_SIZE 32
+
+typedef struct SpiceImageStore SpiceImageStore;
+
+SpiceImageStore *image_store_new(const gchar *dir, guint64 max_bytes);
+void image_store_free(SpiceImageStore *store);
+gboolean image_store_contains(SpiceImageStore *store, guint64 id);
+pixman_image_t *image_store_lookup(SpiceImageStore *store, guint64 id,
+                                   const guint8 *digest, int width, int height);
+void image_store_put(SpiceImageStore *store, guint64 id, const guint8 *digest,
+                     pixman_image_t *image);
+
+G_END_DECLS
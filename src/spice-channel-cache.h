@@ -16,41 +16,220 @@
 */
 #pragma once
 
+#include <string.h>
+
 #include "common/mem.h"
 
 G_BEGIN_DECLS
 
+/*
+ * The display caches are open-addressing hash tables keyed by the 64-bit
+ * cache id, with the entries stored inline in the slots. Collisions are
+ * resolved with robin-hood linear probing: entries of a cluster are kept
+ * sorted by home slot, so that lookups can stop as soon as they meet an
+ * entry closer to its home than the probed id would be. Entries are only
+ * ever moved into free slots (shifted on insertion, shifted back on
+ * removal), which keeps the LRU list, made of slot indices, easy to fix.
+ */
+#define CACHE_NIL           G_MAXUINT32
+#define CACHE_MIN_SLOTS     64
+
 typedef struct display_cache_item {
     guint64                     id;
-    gboolean                    lossy;
+    gpointer                    value;
+    gsize                       size;
     guint32                     ref_count;
+    guint32                     dist;       /* probe distance + 1, 0 for free slots */
+    gboolean                    lossy;
+
+    /* LRU list, most recently used first */
+    guint32                     lru_prev;
+    guint32                     lru_next;
 } display_cache_item;
 
+/* Returns the number of bytes accounted for @value */
+typedef gsize (*display_cache_size_func)(gpointer value);
+
+typedef struct display_cache_stats {
+    guint64     bytes;
+    guint64     entries;
+    guint64     hits;
+    guint64     misses;
+} display_cache_stats;
+
 typedef struct display_cache {
-    GHashTable  *table;
+    display_cache_item *slots;
+    guint32     n_slots; /* power of 2 */
+    guint32     n_items;
     gboolean    ref_counted;
+    GDestroyNotify value_destroy;
+
+    /* byte accounting, the server decides what is cached */
+    display_cache_size_func size_func;
+
+    guint32     lru_head;
+    guint32     lru_tail;
+    display_cache_stats stats;
 }display_cache;
 
-static inline display_cache_item* cache_item_new(guint64 id, gboolean lossy)
+static inline guint32 cache_home_slot(display_cache *cache, guint64 id)
 {
-    display_cache_item *self = g_new(display_cache_item, 1);
-    self->id = id;
-    self->lossy = lossy;
-    self->ref_count = 1;
-    return self;
+    /* 64-bit finalizer of MurmurHash3, ids are often sequential */
+    id ^= id >> 33;
+    id *= G_GUINT64_CONSTANT(0xff51afd7ed558ccd);
+    id ^= id >> 33;
+    id *= G_GUINT64_CONSTANT(0xc4ceb9fe1a85ec53);
+    id ^= id >> 33;
+
+    return id & (cache->n_slots - 1);
+}
+
+static inline void cache_lru_unlink(display_cache *cache, guint32 i)
+{
+    display_cache_item *item = &cache->slots[i];
+
+    if (item->lru_prev != CACHE_NIL)
+        cache->slots[item->lru_prev].lru_next = item->lru_next;
+    else
+        cache->lru_head = item->lru_next;
+    if (item->lru_next != CACHE_NIL)
+        cache->slots[item->lru_next].lru_prev = item->lru_prev;
+    else
+        cache->lru_tail = item->lru_prev;
+    item->lru_prev = item->lru_next = CACHE_NIL;
+}
+
+static inline void cache_lru_push_head(display_cache *cache, guint32 i)
+{
+    display_cache_item *item = &cache->slots[i];
+
+    item->lru_prev = CACHE_NIL;
+    item->lru_next = cache->lru_head;
+    if (cache->lru_head != CACHE_NIL)
+        cache->slots[cache->lru_head].lru_prev = i;
+    else
+        cache->lru_tail = i;
+    cache->lru_head = i;
 }
 
-static inline void cache_item_free(display_cache_item *self)
+static inline void cache_lru_touch(display_cache *cache, guint32 i)
 {
-    g_free(self);
+    if (cache->lru_head == i)
+        return;
+    cache_lru_unlink(cache, i);
+    cache_lru_push_head(cache, i);
+}
+
+/* Moves the entry in slot @from to the free slot @to */
+static inline void cache_move_slot(display_cache *cache, guint32 from, guint32 to)
+{
+    display_cache_item *item = &cache->slots[to];
+
+    *item = cache->slots[from];
+    cache->slots[from].dist = 0;
+
+    if (item->lru_prev != CACHE_NIL)
+        cache->slots[item->lru_prev].lru_next = to;
+    else
+        cache->lru_head = to;
+    if (item->lru_next != CACHE_NIL)
+        cache->slots[item->lru_next].lru_prev = to;
+    else
+        cache->lru_tail = to;
+}
+
+/* Returns the slot of @id, or CACHE_NIL */
+static inline guint32 cache_lookup_slot(display_cache *cache, guint64 id)
+{
+    guint32 mask = cache->n_slots - 1;
+    guint32 i = cache_home_slot(cache, id);
+    guint32 dist;
+
+    for (dist = 1; ; dist++, i = (i + 1) & mask) {
+        display_cache_item *item = &cache->slots[i];
+
+        if (item->dist < dist)
+            return CACHE_NIL;
+        if (item->id == id)
+            return i;
+    }
+}
+
+/* Inserts @id, which must not be in the table, and returns its unlinked slot */
+static inline guint32 cache_insert_slot(display_cache *cache, guint64 id)
+{
+    guint32 mask = cache->n_slots - 1;
+    guint32 i = cache_home_slot(cache, id);
+    guint32 dist = 1;
+    display_cache_item *item;
+
+    while (cache->slots[i].dist >= dist) {
+        i = (i + 1) & mask;
+        dist++;
+    }
+
+    /* make room by shifting the rest of the cluster by one slot */
+    if (cache->slots[i].dist != 0) {
+        guint32 free_slot = i;
+
+        while (cache->slots[free_slot].dist != 0)
+            free_slot = (free_slot + 1) & mask;
+        while (free_slot != i) {
+            guint32 prev = (free_slot - 1) & mask;
+
+            cache_move_slot(cache, prev, free_slot);
+            cache->slots[free_slot].dist++;
+            free_slot = prev;
+        }
+    }
+
+    item = &cache->slots[i];
+    memset(item, 0, sizeof(*item));
+    item->id = id;
+    item->dist = dist;
+    item->ref_count = 1;
+    item->lru_prev = item->lru_next = CACHE_NIL;
+    cache->n_items++;
+
+    return i;
+}
+
+static inline void cache_alloc_slots(display_cache *cache, guint32 n_slots)
+{
+    cache->slots = g_new0(display_cache_item, n_slots);
+    cache->n_slots = n_slots;
+    cache->n_items = 0;
+    cache->lru_head = cache->lru_tail = CACHE_NIL;
+}
+
+/* Keeps the load factor under 7/8, preserving the LRU order */
+static inline void cache_reserve(display_cache *cache)
+{
+    display_cache_item *old_slots = cache->slots;
+    guint32 i, old_tail = cache->lru_tail;
+
+    if ((cache->n_items + 1) * 8 <= cache->n_slots * 7)
+        return;
+
+    cache_alloc_slots(cache, cache->n_slots * 2);
+    for (i = old_tail; i != CACHE_NIL; i = old_slots[i].lru_prev) {
+        guint32 j = cache_insert_slot(cache, old_slots[i].id);
+        display_cache_item *item = &cache->slots[j];
+
+        item->value = old_slots[i].value;
+        item->size = old_slots[i].size;
+        item->ref_count = old_slots[i].ref_count;
+        item->lossy = old_slots[i].lossy;
+        cache_lru_push_head(cache, j);
+    }
+    g_free(old_slots);
 }
 
 static inline display_cache* cache_new(GDestroyNotify value_destroy)
 {
-    display_cache * self = g_new(display_cache, 1);
-    self->table = g_hash_table_new_full(g_int64_hash, g_int64_equal,
-                                       (GDestroyNotify) cache_item_free,
-                                       value_destroy);
+    display_cache * self = g_new0(display_cache, 1);
+    cache_alloc_slots(self, CACHE_MIN_SLOTS);
+    self->value_destroy = value_destroy;
     self->ref_counted = FALSE;
     return self;
 }
@@ -62,56 +241,133 @@ static inline display_cache * cache_image_new(GDestroyNotify value_destroy)
     return self;
 };
 
+/*
+ * Enables byte accounting of the cached values. Nothing is ever evicted:
+ * the server keeps track of the cache content and expects to find its
+ * entries until it removes them.
+ */
+static inline void cache_set_size_func(display_cache *cache,
+                                       display_cache_size_func size_func)
+{
+    cache->size_func = size_func;
+}
+
+static inline void cache_get_stats(display_cache *cache, display_cache_stats *stats)
+{
+    *stats = cache->stats;
+    stats->entries = cache->n_items;
+}
+
+static inline void cache_remove_slot(display_cache *cache, guint32 i)
+{
+    guint32 mask = cache->n_slots - 1;
+    display_cache_item *item = &cache->slots[i];
+    guint32 next;
+
+    cache_lru_unlink(cache, i);
+    cache->stats.bytes -= item->size;
+    if (item->value != NULL && cache->value_destroy)
+        cache->value_destroy(item->value);
+    item->dist = 0;
+    cache->n_items--;
+
+    /* shift back the entries that are not in their home slot */
+    for (next = (i + 1) & mask; cache->slots[next].dist > 1; next = (next + 1) & mask) {
+        cache_move_slot(cache, next, i);
+        cache->slots[i].dist--;
+        i = next;
+    }
+}
+
+/* The returned item is only valid until the next cache modification */
+static inline display_cache_item* cache_lookup(display_cache *cache, uint64_t id)
+{
+    guint32 i = cache_lookup_slot(cache, id);
+
+    if (i == CACHE_NIL) {
+        cache->stats.misses++;
+        return NULL;
+    }
+
+    cache->stats.hits++;
+    cache_lru_touch(cache, i);
+    return &cache->slots[i];
+}
+
 static inline gpointer cache_find(display_cache *cache, uint64_t id)
 {
-    return g_hash_table_lookup(cache->table, &id);
+    display_cache_item *item = cache_lookup(cache, id);
+
+    return item ? item->value : NULL;
 }
 
 static inline gpointer cache_find_lossy(display_cache *cache, uint64_t id, gboolean *lossy)
 {
-    gpointer value;
-    display_cache_item *item;
+    display_cache_item *item = cache_lookup(cache, id);
 
-    if (!g_hash_table_lookup_extended(cache->table, &id, (gpointer*)&item, &value))
+    if (item == NULL)
         return NULL;
 
     *lossy = item->lossy;
 
-    return value;
+    return item->value;
+}
+
+static inline void cache_set_item_value(display_cache *cache, guint32 i,
+                                        gpointer value, gboolean lossy)
+{
+    display_cache_item *item = &cache->slots[i];
+
+    if (item->value != NULL && cache->value_destroy)
+        cache->value_destroy(item->value);
+    cache->stats.bytes -= item->size;
+
+    item->value = value;
+    item->lossy = lossy;
+    item->size = cache->size_func ? cache->size_func(value) : 0;
+    cache->stats.bytes += item->size;
+
+    cache_lru_touch(cache, i);
+}
+
+static inline guint32 cache_insert(display_cache *cache, uint64_t id)
+{
+    guint32 i;
+
+    cache_reserve(cache);
+    i = cache_insert_slot(cache, id);
+    cache_lru_push_head(cache, i);
+    return i;
 }
 
 static inline void cache_add_lossy(display_cache *cache, uint64_t id,
                                    gpointer value, gboolean lossy)
 {
-    display_cache_item *item = cache_item_new(id, lossy);
-    display_cache_item *current_item;
-    gpointer            current_image;
+    guint32 i = cache_lookup_slot(cache, id);
 
-    //If image is currently in the table add its reference count before replacing it
-    if(cache->ref_counted) {
-        if(g_hash_table_lookup_extended(cache->table, &id, (gpointer*) &current_item,
-                                        (gpointer*) &current_image)) {
-            item->ref_count = current_item->ref_count + 1;
-        }
+    if (i == CACHE_NIL) {
+        i = cache_insert(cache, id);
+    } else if (cache->ref_counted) {
+        //If image is currently in the table add its reference count before replacing it
+        cache->slots[i].ref_count++;
+    } else {
+        cache->slots[i].ref_count = 1;
     }
-    g_hash_table_replace(cache->table, item, value);
+    cache_set_item_value(cache, i, value, lossy);
 }
 
 static inline void cache_replace_lossy(display_cache *cache, uint64_t id,
                                        gpointer value, gboolean lossy)
 {
-    display_cache_item *item = cache_item_new(id, lossy);
+    guint32 i = cache_lookup_slot(cache, id);
 
     // If image is currently in the table consider its reference count before replacing it
-    if (cache->ref_counted) {
-        display_cache_item *current_item;
-        gpointer current_image;
-        if (g_hash_table_lookup_extended(cache->table, &id, (gpointer*) &current_item,
-                                         &current_image)) {
-            item->ref_count = current_item->ref_count;
-        }
+    if (i == CACHE_NIL) {
+        i = cache_insert(cache, id);
+    } else if (!cache->ref_counted) {
+        cache->slots[i].ref_count = 1;
     }
-    g_hash_table_replace(cache->table, item, value);
+    cache_set_item_value(cache, i, value, lossy);
 }
 
 static inline void cache_add(display_cache *cache, uint64_t id, gpointer value)
@@ -121,29 +377,54 @@ static inline void cache_add(display_cache *cache, uint64_t id, gpointer value)
 
 static inline gboolean cache_remove(display_cache *cache, uint64_t id)
 {
-    display_cache_item * item;
-    gpointer value;
+    guint32 i = cache_lookup_slot(cache, id);
 
-    if( g_hash_table_lookup_extended(cache->table, &id, (gpointer*) &item, &value)) {
-        --item->ref_count;
-        if(!cache->ref_counted || item->ref_count == 0 ) {
-            return g_hash_table_remove(cache->table, &id);
-        }
-    }
-    else {
+    if (i == CACHE_NIL)
         return FALSE;
+
+    --cache->slots[i].ref_count;
+    if (!cache->ref_counted || cache->slots[i].ref_count == 0) {
+        cache_remove_slot(cache, i);
     }
     return TRUE;
 }
 
+typedef void (*display_cache_foreach_func)(uint64_t id, gpointer value,
+                                           gboolean lossy, gpointer user_data);
+
+/* least recently used first */
+static inline void cache_foreach(display_cache *cache,
+                                 display_cache_foreach_func func, gpointer user_data)
+{
+    guint32 i;
+
+    for (i = cache->lru_tail; i != CACHE_NIL; i = cache->slots[i].lru_prev) {
+        display_cache_item *item = &cache->slots[i];
+
+        func(item->id, item->value, item->lossy, user_data);
+    }
+}
+
 static inline void cache_clear(display_cache *cache)
 {
-    g_hash_table_remove_all(cache->table);
+    guint32 i;
+
+    for (i = 0; i < cache->n_slots; i++) {
+        display_cache_item *item = &cache->slots[i];
+
+        if (item->dist != 0 && item->value != NULL && cache->value_destroy)
+            cache->value_destroy(item->value);
+    }
+    memset(cache->slots, 0, cache->n_slots * sizeof(display_cache_item));
+    cache->n_items = 0;
+    cache->lru_head = cache->lru_tail = CACHE_NIL;
+    cache->stats.bytes = 0;
 }
 
 static inline void cache_free(display_cache *cache)
 {
-    g_hash_table_unref(cache->table);
+    cache_clear(cache);
+    g_free(cache->slots);
     g_free(cache);
 }
 
@@ -52,12 +52,16 @@ struct _SpiceMsgOut {
     gboolean              ro_check;
 };
 
+typedef struct SpiceMsgInPool SpiceMsgInPool;
+
 struct _SpiceMsgIn {
     int                   refcount;
     SpiceChannel          *channel;
+    SpiceMsgInPool        *pool;
     uint8_t               header[MAX_SPICE_DATA_HEADER_SIZE];
     uint8_t               *data;
     int                   dpos;
+    int                   dclass; /* pool size class of data, -1 if not pooled */
     uint8_t               *parsed;
     size_t                psize;
     message_destructor_t  pfree;
@@ -84,6 +88,10 @@ struct _SpiceChannelPrivate {
     SSL_CTX                     *ctx;
     SSL                         *ssl;
     SpiceOpenSSLVerify          *sslverify;
+    gboolean                    ktls_send;
+    gboolean                    ktls_recv;
+    gboolean                    tls_resumed;
+    gint64                      tls_handshake_time;
     GSocket                     *sock;
     GSocketConnection           *conn;
     GInputStream                *in;
@@ -96,6 +104,11 @@ struct _SpiceChannelPrivate {
     unsigned int                sasl_decoded_offset;
 #endif
 
+    /* data read ahead of the messages, see spice_channel_read() */
+    guint8                      *read_buffer;
+    gsize                       read_buffer_offset;
+    gsize                       read_buffer_length;
+
     gboolean                    use_mini_header;
     uint64_t                    out_serial;
     uint64_t                    in_serial;
@@ -106,6 +119,8 @@ struct _SpiceChannelPrivate {
     int                         fd;
     gboolean                    has_error;
     guint                       connect_delayed_id;
+    GThread                     *thread;
+    GMainContext                *thread_context; /* protected by xmit_queue_lock */
 
     GQueue                      xmit_queue;
     gboolean                    xmit_queue_blocked;
@@ -138,6 +153,7 @@ struct _SpiceChannelPrivate {
 
     gsize                       total_read_bytes;
     uint64_t                    last_message_serial;
+    SpiceMsgInPool              *msg_pool;
     GSList                      *flushing;
 
     gboolean                    disable_channel_msg;
@@ -168,6 +184,7 @@ uint32_t spice_header_get_msg_size(uint8_t *header, gboolean is_mini_header);
 
 void spice_channel_up(SpiceChannel *channel);
 void spice_channel_wakeup(SpiceChannel *channel, gboolean cancel);
+void spice_channel_invoke(SpiceChannel *channel, GSourceFunc func);
 
 SpiceSession* spice_channel_get_session(SpiceChannel *channel);
 enum spice_channel_state spice_channel_get_state(SpiceChannel *channel);
@@ -55,6 +55,9 @@ static void channel_reset(SpiceChannel *channel, gboolean migrating);
 static void spice_channel_send_migration_handshake(SpiceChannel *channel);
 static gboolean channel_connect(SpiceChannel *channel, gboolean tls);
 
+/* the SSL ex_data index of the channel owning the connection */
+static int ssl_channel_index = -1;
+
 #if OPENSSL_VERSION_NUMBER < 0x10100000 || \
     (defined(LIBRESSL_VERSION_NUMBER) && LIBRESSL_VERSION_NUMBER < 0x20700000)
 static RSA *EVP_PKEY_get0_RSA(EVP_PKEY *pkey)
@@ -91,6 +94,10 @@ enum {
     PROP_CHANNEL_ID,
     PROP_TOTAL_READ_BYTES,
     PROP_SOCKET,
+    PROP_KTLS_SEND,
+    PROP_KTLS_RECV,
+    PROP_TLS_RESUMED,
+    PROP_TLS_HANDSHAKE_TIME,
 };
 
 /* Signals */
@@ -129,6 +136,7 @@ static void spice_channel_init(SpiceChannel *channel)
 #endif
     g_queue_init(&c->xmit_queue);
     g_mutex_init(&c->xmit_queue_lock);
+    c->msg_pool = spice_msg_in_pool_new();
 }
 
 static void spice_channel_constructed(GObject *gobject)
@@ -181,6 +189,15 @@ static void spice_channel_finalize(GObject *gobject)
 
     g_mutex_clear(&c->xmit_queue_lock);
 
+    if (c->msg_pool) {
+        guint64 hits, misses;
+
+        spice_msg_in_pool_get_stats(c->msg_pool, &hits, &misses);
+        CHANNEL_DEBUG(channel, "msg pool: %" G_GUINT64_FORMAT " hits, %"
+                      G_GUINT64_FORMAT " misses", hits, misses);
+        g_clear_pointer(&c->msg_pool, spice_msg_in_pool_unref);
+    }
+
     if (c->caps)
         g_array_free(c->caps, TRUE);
 
@@ -194,6 +211,7 @@ static void spice_channel_finalize(GObject *gobject)
         g_array_free(c->remote_common_caps, TRUE);
 
     g_clear_pointer(&c->peer_msg, g_free);
+    g_free(c->read_buffer);
 
     /* Chain up to the parent class */
     if (G_OBJECT_CLASS(spice_channel_parent_class)->finalize)
@@ -224,6 +242,18 @@ static void spice_channel_get_property(GObject    *gobject,
     case PROP_SOCKET:
         g_value_set_object(value, c->sock);
         break;
+    case PROP_KTLS_SEND:
+        g_value_set_boolean(value, c->ktls_send);
+        break;
+    case PROP_KTLS_RECV:
+        g_value_set_boolean(value, c->ktls_recv);
+        break;
+    case PROP_TLS_RESUMED:
+        g_value_set_boolean(value, c->tls_resumed);
+        break;
+    case PROP_TLS_HANDSHAKE_TIME:
+        g_value_set_int64(value, c->tls_handshake_time);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(gobject, prop_id, pspec);
         break;
@@ -345,6 +375,75 @@ static void spice_channel_class_init(SpiceChannelClass *klass)
                              G_PARAM_READABLE |
                              G_PARAM_STATIC_STRINGS));
 
+    /**
+     * SpiceChannel:ktls-send:
+     *
+     * Whether the kernel encrypts the data sent on the secure
+     * connection of the channel (kTLS), see #SpiceSession:enable-ktls.
+     *
+     * Since: 0.42
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_KTLS_SEND,
+         g_param_spec_boolean("ktls-send",
+                              "kTLS send",
+                              "Whether the kernel encrypts the sent data",
+                              FALSE,
+                              G_PARAM_READABLE |
+                              G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceChannel:ktls-recv:
+     *
+     * Whether the kernel decrypts the data received on the secure
+     * connection of the channel (kTLS), see #SpiceSession:enable-ktls.
+     *
+     * Since: 0.42
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_KTLS_RECV,
+         g_param_spec_boolean("ktls-recv",
+                              "kTLS receive",
+                              "Whether the kernel decrypts the received data",
+                              FALSE,
+                              G_PARAM_READABLE |
+                              G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceChannel:tls-resumed:
+     *
+     * Whether the secure connection of the channel resumed the TLS
+     * session of a previous channel of its #SpiceSession, instead of
+     * doing a full handshake.
+     *
+     * Since: 0.42
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_TLS_RESUMED,
+         g_param_spec_boolean("tls-resumed",
+                              "TLS resumed",
+                              "Whether the TLS session was resumed",
+                              FALSE,
+                              G_PARAM_READABLE |
+                              G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceChannel:tls-handshake-time:
+     *
+     * How long the TLS handshake of the channel took, in microseconds,
+     * or 0 if it hasn't done one.
+     *
+     * Since: 0.42
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_TLS_HANDSHAKE_TIME,
+         g_param_spec_int64("tls-handshake-time",
+                            "TLS handshake time",
+                            "Duration of the TLS handshake in microseconds",
+                            0, G_MAXINT64, 0,
+                            G_PARAM_READABLE |
+                            G_PARAM_STATIC_STRINGS));
+
     /**
      * SpiceChannel::channel-event:
      * @channel: the channel that emitted the signal
@@ -388,6 +487,7 @@ static void spice_channel_class_init(SpiceChannelClass *klass)
 
     SSL_library_init();
     SSL_load_error_strings();
+    ssl_channel_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
 }
 
 /* ---------------------------------------------------------------- */
@@ -485,19 +585,216 @@ static inline uint32_t spice_header_get_msg_sub_list(uint8_t *header, gboolean i
     }
 }
 
+/* ---------------------------------------------------------------- */
+/* private msg pool api                                             */
+
+/*
+ * Incoming messages are recycled through a per-channel pool instead of
+ * going through g_new0()/g_malloc0() for every message. Payloads are
+ * binned in power-of-two size classes, each keeping a few free buffers
+ * around. Buffers are not zeroed: the payload is always fully
+ * overwritten by spice_channel_read() before being parsed.
+ *
+ * Messages may outlive their channel (video frames keep a reference on
+ * their SpiceMsgIn) and may be released from other threads (GStreamer
+ * streaming threads), so the pool is refcounted and locked.
+ */
+#define MSG_IN_POOL_MIN_SHIFT   8  /* 256 bytes */
+#define MSG_IN_POOL_MAX_SHIFT   19 /* 512 KiB */
+#define MSG_IN_POOL_N_CLASSES   (MSG_IN_POOL_MAX_SHIFT - MSG_IN_POOL_MIN_SHIFT + 1)
+#define MSG_IN_POOL_MAX_BUFFERS 4
+#define MSG_IN_POOL_MAX_MSGS    32
+
+typedef struct MsgInPoolChunk MsgInPoolChunk;
+struct MsgInPoolChunk {
+    MsgInPoolChunk *next;
+};
+
+struct SpiceMsgInPool {
+    gint            refcount;
+    GMutex          lock;
+    MsgInPoolChunk  *msgs;
+    guint           n_msgs;
+    MsgInPoolChunk  *buffers[MSG_IN_POOL_N_CLASSES];
+    guint           n_buffers[MSG_IN_POOL_N_CLASSES];
+
+    /* stats */
+    guint64         hits;
+    guint64         misses;
+};
+
+static SpiceMsgInPool *spice_msg_in_pool_new(void)
+{
+    SpiceMsgInPool *pool = g_new0(SpiceMsgInPool, 1);
+
+    pool->refcount = 1;
+    g_mutex_init(&pool->lock);
+
+    return pool;
+}
+
+static SpiceMsgInPool *spice_msg_in_pool_ref(SpiceMsgInPool *pool)
+{
+    g_atomic_int_inc(&pool->refcount);
+    return pool;
+}
+
+static void msg_in_pool_chunks_free(MsgInPoolChunk **head)
+{
+    while (*head) {
+        MsgInPoolChunk *chunk = *head;
+        *head = chunk->next;
+        g_free(chunk);
+    }
+}
+
+/* any context */
+static void spice_msg_in_pool_trim(SpiceMsgInPool *pool)
+{
+    int i;
+
+    g_mutex_lock(&pool->lock);
+    msg_in_pool_chunks_free(&pool->msgs);
+    pool->n_msgs = 0;
+    for (i = 0; i < MSG_IN_POOL_N_CLASSES; i++) {
+        msg_in_pool_chunks_free(&pool->buffers[i]);
+        pool->n_buffers[i] = 0;
+    }
+    g_mutex_unlock(&pool->lock);
+}
+
+static void spice_msg_in_pool_unref(SpiceMsgInPool *pool)
+{
+    if (!g_atomic_int_dec_and_test(&pool->refcount))
+        return;
+
+    spice_msg_in_pool_trim(pool);
+    g_mutex_clear(&pool->lock);
+    g_free(pool);
+}
+
+static inline int msg_in_pool_size_class(size_t size)
+{
+    int shift;
+
+    if (size <= (1 << MSG_IN_POOL_MIN_SHIFT))
+        return 0;
+
+    shift = g_bit_storage(size - 1);
+    if (shift > MSG_IN_POOL_MAX_SHIFT)
+        return -1;
+
+    return shift - MSG_IN_POOL_MIN_SHIFT;
+}
+
+static SpiceMsgIn *spice_msg_in_pool_alloc_msg(SpiceMsgInPool *pool)
+{
+    MsgInPoolChunk *chunk;
+
+    g_mutex_lock(&pool->lock);
+    chunk = pool->msgs;
+    if (chunk) {
+        pool->msgs = chunk->next;
+        pool->n_msgs--;
+    }
+    g_mutex_unlock(&pool->lock);
+
+    if (chunk == NULL)
+        return g_new(SpiceMsgIn, 1);
+
+    return (SpiceMsgIn *)chunk;
+}
+
+static void spice_msg_in_pool_free_msg(SpiceMsgInPool *pool, SpiceMsgIn *in)
+{
+    MsgInPoolChunk *chunk = (MsgInPoolChunk *)in;
+
+    g_mutex_lock(&pool->lock);
+    if (pool->n_msgs < MSG_IN_POOL_MAX_MSGS) {
+        chunk->next = pool->msgs;
+        pool->msgs = chunk;
+        pool->n_msgs++;
+        chunk = NULL;
+    }
+    g_mutex_unlock(&pool->lock);
+
+    g_free(chunk);
+}
+
+/* Allocates a non-zeroed payload of at least @size bytes for @in */
+static void spice_msg_in_pool_alloc_data(SpiceMsgInPool *pool, SpiceMsgIn *in, size_t size)
+{
+    MsgInPoolChunk *chunk = NULL;
+    int cls = msg_in_pool_size_class(size);
+
+    g_mutex_lock(&pool->lock);
+    if (cls >= 0 && pool->buffers[cls] != NULL) {
+        chunk = pool->buffers[cls];
+        pool->buffers[cls] = chunk->next;
+        pool->n_buffers[cls]--;
+        pool->hits++;
+    } else {
+        pool->misses++;
+    }
+    g_mutex_unlock(&pool->lock);
+
+    in->dclass = cls;
+    if (chunk != NULL) {
+        in->data = (uint8_t *)chunk;
+    } else if (cls >= 0) {
+        in->data = g_malloc(1 << (cls + MSG_IN_POOL_MIN_SHIFT));
+    } else {
+        in->data = g_malloc(size);
+    }
+}
+
+static void spice_msg_in_pool_free_data(SpiceMsgInPool *pool, uint8_t *data, int cls)
+{
+    MsgInPoolChunk *chunk = (MsgInPoolChunk *)data;
+
+    if (data == NULL)
+        return;
+
+    if (cls >= 0) {
+        g_mutex_lock(&pool->lock);
+        if (pool->n_buffers[cls] < MSG_IN_POOL_MAX_BUFFERS) {
+            chunk->next = pool->buffers[cls];
+            pool->buffers[cls] = chunk;
+            pool->n_buffers[cls]++;
+            chunk = NULL;
+        }
+        g_mutex_unlock(&pool->lock);
+    }
+
+    g_free(chunk);
+}
+
+static void spice_msg_in_pool_get_stats(SpiceMsgInPool *pool, guint64 *hits, guint64 *misses)
+{
+    g_mutex_lock(&pool->lock);
+    *hits = pool->hits;
+    *misses = pool->misses;
+    g_mutex_unlock(&pool->lock);
+}
+
 /* ---------------------------------------------------------------- */
 /* private msg api                                                  */
 
 G_GNUC_INTERNAL
 SpiceMsgIn *spice_msg_in_new(SpiceChannel *channel)
 {
+    SpiceMsgInPool *pool;
     SpiceMsgIn *in;
 
     g_return_val_if_fail(channel != NULL, NULL);
 
-    in = g_new0(SpiceMsgIn, 1);
+    pool = channel->priv->msg_pool;
+    in = spice_msg_in_pool_alloc_msg(pool);
+    memset(in, 0, sizeof(*in));
     in->refcount = 1;
     in->channel  = channel;
+    in->pool     = spice_msg_in_pool_ref(pool);
+    in->dclass   = -1;
 
     return in;
 }
@@ -510,6 +807,7 @@ SpiceMsgIn *spice_msg_in_sub_new(SpiceChannel *channel, SpiceMsgIn *parent,
 
     g_return_val_if_fail(channel != NULL, NULL);
 
+    /* borrows the payload from the parent buffer, no copy */
     in = spice_msg_in_new(channel);
     spice_header_set_msg_type(in->header, channel->priv->use_mini_header, sub->type);
     spice_header_set_msg_size(in->header, channel->priv->use_mini_header, sub->size);
@@ -531,6 +829,8 @@ void spice_msg_in_ref(SpiceMsgIn *in)
 G_GNUC_INTERNAL
 void spice_msg_in_unref(SpiceMsgIn *in)
 {
+    SpiceMsgInPool *pool;
+
     g_return_if_fail(in != NULL);
 
     in->refcount--;
@@ -538,12 +838,14 @@ void spice_msg_in_unref(SpiceMsgIn *in)
         return;
     if (in->parsed)
         in->pfree(in->parsed);
+    pool = in->pool;
     if (in->parent) {
         spice_msg_in_unref(in->parent);
     } else {
-        g_free(in->data);
+        spice_msg_in_pool_free_data(pool, in->data, in->dclass);
     }
-    g_free(in);
+    spice_msg_in_pool_free_msg(pool, in);
+    spice_msg_in_pool_unref(pool);
 }
 
 G_GNUC_INTERNAL
@@ -742,11 +1044,12 @@ void spice_msg_out_send(SpiceMsgOut *out)
     /* One wakeup is enough to empty the entire queue -> only do a wakeup
        if the queue was empty, and there isn't one pending already. */
     if (was_empty && !c->xmit_queue_wakeup_id) {
+        GMainContext *context = c->thread_context ? c->thread_context : spice_thread_context();
         c->xmit_queue_wakeup_id =
             /* Use g_timeout_add_full so that can specify the priority */
-            g_spice_timeout_add_full(G_PRIORITY_HIGH, 0,
-                                     spice_channel_idle_wakeup,
-                                     out->channel, NULL);
+            g_spice_context_timeout_add_full(context, G_PRIORITY_HIGH, 0,
+                                             spice_channel_idle_wakeup,
+                                             out->channel, NULL);
     }
 
 end:
@@ -895,28 +1198,44 @@ static void spice_channel_write(SpiceChannel *channel, const void *data, size_t
     spice_channel_flush_wire(channel, data, len);
 }
 
+/*
+ * Checks whether @out may be sent and fixes up its header.
+ *
+ * Returns FALSE if the message must be dropped.
+ */
 /* coroutine context */
-static void spice_channel_write_msg(SpiceChannel *channel, SpiceMsgOut *out)
+static gboolean spice_channel_prepare_msg(SpiceChannel *channel, SpiceMsgOut *out)
 {
-    uint8_t *data;
-    int free_data;
-    size_t len;
     uint32_t msg_size;
 
-    g_return_if_fail(channel != NULL);
-    g_return_if_fail(out != NULL);
-    g_return_if_fail(channel == out->channel);
-
     if (out->ro_check &&
         spice_channel_get_read_only(channel)) {
         g_warning("Try to send message while read-only. Please report a bug.");
-        return;
+        return FALSE;
     }
 
     spice_marshaller_flush(out->marshaller);
     msg_size = spice_marshaller_get_total_size(out->marshaller) -
                spice_header_get_header_size(channel->priv->use_mini_header);
     spice_header_set_msg_size(out->header, channel->priv->use_mini_header, msg_size);
+
+    return TRUE;
+}
+
+/* coroutine context */
+static void spice_channel_write_msg(SpiceChannel *channel, SpiceMsgOut *out)
+{
+    uint8_t *data;
+    int free_data;
+    size_t len;
+
+    g_return_if_fail(channel != NULL);
+    g_return_if_fail(out != NULL);
+    g_return_if_fail(channel == out->channel);
+
+    if (!spice_channel_prepare_msg(channel, out))
+        return;
+
     data = spice_marshaller_linearize(out->marshaller, 0, &len, &free_data);
     /* spice_msg_out_hexdump(out, data, len); */
     spice_channel_write(channel, data, len);
@@ -927,6 +1246,130 @@ static void spice_channel_write_msg(SpiceChannel *channel, SpiceMsgOut *out)
     spice_msg_out_unref(out);
 }
 
+#ifdef G_OS_UNIX
+#define XMIT_BATCH_MAX_IOV 64
+
+/*
+ * Batched writes bypass the GIO stream and go straight to the socket
+ * with sendmsg(), so they are only possible on plain connections, or
+ * on secure connections once the kernel does the encryption.
+ */
+static gboolean spice_channel_can_write_batched(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c = channel->priv;
+
+    if (c->sock == NULL || (c->tls && !c->ktls_send))
+        return FALSE;
+#ifdef HAVE_SASL
+    if (c->sasl_conn)
+        return FALSE;
+#endif
+
+    return TRUE;
+}
+
+/*
+ * Write all the @n_iov buffers of @iov out to the wire in as few
+ * syscalls as possible. @iov is modified on partial writes.
+ */
+/* coroutine context */
+static void spice_channel_flush_wire_iov(SpiceChannel *channel,
+                                         struct iovec *iov, int n_iov)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    int fd = g_socket_get_fd(c->sock);
+    int flags = 0;
+
+#ifdef MSG_NOSIGNAL
+    flags |= MSG_NOSIGNAL;
+#endif
+
+    while (n_iov > 0) {
+        struct msghdr msg = { NULL, };
+        gssize ret;
+
+        if (c->has_error) return;
+
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n_iov;
+        ret = sendmsg(fd, &msg, flags);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                g_coroutine_socket_wait(&c->coroutine, c->sock, G_IO_OUT);
+                continue;
+            }
+            CHANNEL_DEBUG(channel, "Closing the channel: sendmsg %s", g_strerror(errno));
+            c->has_error = TRUE;
+            return;
+        }
+        if (ret == 0) {
+            CHANNEL_DEBUG(channel, "Closing the connection: sendmsg");
+            c->has_error = TRUE;
+            return;
+        }
+
+        /* skip what was written */
+        while (n_iov > 0 && ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            n_iov--;
+        }
+        if (n_iov > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+}
+
+/*
+ * Write all the messages of @batch with scatter-gather I/O, many
+ * messages per syscall, without linearizing their marshallers.
+ */
+/* coroutine context */
+static void spice_channel_write_msg_batch(SpiceChannel *channel, GQueue *batch)
+{
+    struct iovec iov[XMIT_BATCH_MAX_IOV];
+    int n_iov = 0;
+    GList *l;
+
+    for (l = batch->head; l != NULL; l = l->next) {
+        SpiceMsgOut *out = l->data;
+        size_t total, offset = 0;
+
+        if (!spice_channel_prepare_msg(channel, out))
+            continue;
+
+        total = spice_marshaller_get_total_size(out->marshaller);
+        while (offset < total) {
+            int i, n;
+
+            n = spice_marshaller_fill_iovec(out->marshaller, iov + n_iov,
+                                            XMIT_BATCH_MAX_IOV - n_iov, offset);
+            g_warn_if_fail(n > 0);
+            if (n <= 0)
+                break;
+            for (i = n_iov; i < n_iov + n; i++)
+                offset += iov[i].iov_len;
+            n_iov += n;
+
+            /* the message buffers must stay alive until they are written */
+            if (n_iov == XMIT_BATCH_MAX_IOV) {
+                spice_channel_flush_wire_iov(channel, iov, n_iov);
+                n_iov = 0;
+            }
+        }
+    }
+
+    if (n_iov > 0)
+        spice_channel_flush_wire_iov(channel, iov, n_iov);
+
+    g_queue_foreach(batch, (GFunc)spice_msg_out_unref, NULL);
+    g_queue_clear(batch);
+}
+#endif
+
 #ifdef G_OS_UNIX
 static ssize_t read_fd(int fd, int *msgfd)
 {
@@ -1128,6 +1571,67 @@ static int spice_channel_read_sasl(SpiceChannel *channel, void *data, size_t len
 }
 #endif
 
+/* The messages are read ahead in chunks of this size, so that the small
+ * ones don't cost a read each. The payloads of at least READ_AHEAD_MAX_COPY
+ * bytes are read directly into the message buffer instead. */
+#define READ_AHEAD_SIZE (64 * 1024)
+#define READ_AHEAD_MAX_COPY (16 * 1024)
+
+/*
+ * Only read ahead once linked, as nothing follows the link and
+ * authentication replies until the client answers them. Nor on Unix
+ * sockets: the fds are passed there with a byte of their own, the kernel
+ * drops them if that byte is read into the buffer rather than with
+ * spice_channel_unix_read_fd().
+ */
+static gboolean spice_channel_can_read_ahead(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c = channel->priv;
+
+    return c->state == SPICE_CHANNEL_STATE_READY &&
+           g_socket_get_family(c->sock) != G_SOCKET_FAMILY_UNIX;
+}
+
+static gboolean spice_channel_has_read_ahead(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c = channel->priv;
+
+    return c->read_buffer_offset < c->read_buffer_length;
+}
+
+/*
+ * Read at least 1 more byte of data out of the read-ahead buffer, filling
+ * it with as much data as is available off the wire when it is empty.
+ */
+/* coroutine context */
+static int spice_channel_read_ahead(SpiceChannel *channel, void *data, size_t len)
+{
+    SpiceChannelPrivate *c = channel->priv;
+
+    if (!spice_channel_has_read_ahead(channel)) {
+        int ret;
+
+        if (c->read_buffer == NULL)
+            c->read_buffer = g_malloc(READ_AHEAD_SIZE);
+
+        ret = spice_channel_read_wire(channel, c->read_buffer, READ_AHEAD_SIZE);
+        if (ret <= 0)
+            return ret;
+        c->read_buffer_offset = 0;
+        c->read_buffer_length = ret;
+    }
+
+    len = MIN(c->read_buffer_length - c->read_buffer_offset, len);
+    memcpy(data, c->read_buffer + c->read_buffer_offset, len);
+    c->read_buffer_offset += len;
+
+    if (c->read_buffer_offset == c->read_buffer_length) {
+        c->read_buffer_offset = c->read_buffer_length = 0;
+    }
+
+    return len;
+}
+
 /*
  * Fill the 'data' buffer up with exactly 'len' bytes worth of data
  * Returns 0 if connection was closed or on unknown errors, <0 for error and
@@ -1143,11 +1647,15 @@ static int spice_channel_read(SpiceChannel *channel, void *data, size_t length)
     while (len > 0) {
         if (c->has_error) return 0; /* has_error is set by disconnect(), return no error */
 
+        if (spice_channel_has_read_ahead(channel))
+            ret = spice_channel_read_ahead(channel, data, len);
 #ifdef HAVE_SASL
-        if (c->sasl_conn)
+        else if (c->sasl_conn)
             ret = spice_channel_read_sasl(channel, data, len);
-        else
 #endif
+        else if (len < READ_AHEAD_MAX_COPY && spice_channel_can_read_ahead(channel))
+            ret = spice_channel_read_ahead(channel, data, len);
+        else
             ret = spice_channel_read_wire(channel, data, len);
         if (ret < 0)
             return ret;
@@ -2013,19 +2521,71 @@ error:
     return FALSE;
 }
 
+/* channel thread context */
+static gboolean spice_channel_wakeup_cb(gpointer data)
+{
+    SpiceChannel *channel = SPICE_CHANNEL(data);
+
+    g_coroutine_wakeup(&channel->priv->coroutine);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* channel thread context */
+static gboolean spice_channel_wakeup_cancel_cb(gpointer data)
+{
+    SpiceChannel *channel = SPICE_CHANNEL(data);
+    GCoroutine *c = &channel->priv->coroutine;
+
+    g_coroutine_condition_cancel(c);
+    g_coroutine_wakeup(c);
+
+    return G_SOURCE_REMOVE;
+}
+
 /* system context */
 G_GNUC_INTERNAL
 void spice_channel_wakeup(SpiceChannel *channel, gboolean cancel)
 {
-    GCoroutine *c;
-
     g_return_if_fail(SPICE_IS_CHANNEL(channel));
-    c = &channel->priv->coroutine;
 
-    if (cancel)
-        g_coroutine_condition_cancel(c);
+    spice_channel_invoke(channel, cancel ? spice_channel_wakeup_cancel_cb
+                                         : spice_channel_wakeup_cb);
+}
 
-    g_coroutine_wakeup(c);
+/*
+ * spice_channel_invoke:
+ * @channel: a #SpiceChannel
+ * @func: the function to call with @channel, returning %G_SOURCE_REMOVE
+ *
+ * Calls @func in the context owning the channel coroutine: right away
+ * when the channel runs in the main context or when called from its
+ * thread, or else later from the channel thread. This can be called
+ * from any context.
+ */
+G_GNUC_INTERNAL
+void spice_channel_invoke(SpiceChannel *channel, GSourceFunc func)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    GMainContext *context = NULL;
+
+    g_mutex_lock(&c->xmit_queue_lock);
+    if (c->thread_context)
+        context = g_main_context_ref(c->thread_context);
+    g_mutex_unlock(&c->xmit_queue_lock);
+
+    if (context == NULL || g_main_context_is_owner(context)) {
+        func(channel);
+    } else {
+        GSource *source = g_idle_source_new();
+
+        g_source_set_priority(source, G_PRIORITY_HIGH);
+        g_source_set_callback(source, func, g_object_ref(channel), g_object_unref);
+        g_source_attach(source, context);
+        g_source_unref(source);
+    }
+
+    g_clear_pointer(&context, g_main_context_unref);
 }
 
 G_GNUC_INTERNAL
@@ -2054,10 +2614,7 @@ void spice_channel_recv_msg(SpiceChannel *channel,
         goto end;
 
     msg_size = spice_header_get_msg_size(in->header, c->use_mini_header);
-    /* FIXME: do not allow others to take ref on in, and use realloc here?
-     * this would avoid malloc/free on each message?
-     */
-    in->data = g_malloc0(msg_size);
+    spice_msg_in_pool_alloc_data(c->msg_pool, in, msg_size);
     spice_channel_read(channel, in->data, msg_size);
     if (c->has_error)
         goto end;
@@ -2328,6 +2885,28 @@ static void spice_channel_iterate_write(SpiceChannel *channel)
     SpiceChannelPrivate *c = channel->priv;
     SpiceMsgOut *out;
 
+#ifdef G_OS_UNIX
+    if (spice_channel_can_write_batched(channel)) {
+        GQueue batch;
+
+        /* drain the whole queue at once and send it with writev-style I/O */
+        do {
+            g_mutex_lock(&c->xmit_queue_lock);
+            batch = c->xmit_queue;
+            g_queue_init(&c->xmit_queue);
+            c->xmit_queue_size = 0;
+            g_mutex_unlock(&c->xmit_queue_lock);
+
+            if (g_queue_is_empty(&batch))
+                break;
+            spice_channel_write_msg_batch(channel, &batch);
+        } while (!c->has_error);
+
+        spice_channel_flushed(channel, TRUE);
+        return;
+    }
+#endif
+
     do {
         g_mutex_lock(&c->xmit_queue_lock);
         out = g_queue_pop_head(&c->xmit_queue);
@@ -2347,12 +2926,15 @@ static void spice_channel_iterate_read(SpiceChannel *channel)
 {
     SpiceChannelPrivate *c = channel->priv;
 
-    g_coroutine_socket_wait(&c->coroutine, c->sock, G_IO_IN);
+    /* the messages already read ahead don't need to wait for the socket */
+    if (!spice_channel_has_read_ahead(channel))
+        g_coroutine_socket_wait(&c->coroutine, c->sock, G_IO_IN);
 
     /* treat all incoming data (block on message completion) */
     while (!c->has_error &&
            c->state != SPICE_CHANNEL_STATE_MIGRATING &&
            (g_pollable_input_stream_is_readable(G_POLLABLE_INPUT_STREAM(c->in))
+            || spice_channel_has_read_ahead(channel)
 #ifdef HAVE_SASL
             /* flush the sasl buffer too */
            || c->sasl_decoded != NULL
@@ -2528,6 +3110,25 @@ const GError* spice_channel_get_error(SpiceChannel *self)
     return c->error;
 }
 
+/*
+ * Keeps the TLS sessions of the channel in its #SpiceSession, for the
+ * next channels to resume. With TLS 1.3 the tickets are only sent after
+ * the handshake, so this is called while reading.
+ */
+/* coroutine context */
+static int spice_channel_new_tls_session(SSL *ssl, SSL_SESSION *tls_session)
+{
+    SpiceChannel *channel = SSL_get_ex_data(ssl, ssl_channel_index);
+
+    g_return_val_if_fail(channel != NULL, 0);
+
+    CHANNEL_DEBUG(channel, "new TLS session");
+    spice_session_set_tls_session(channel->priv->session, tls_session);
+
+    /* the session took its own reference */
+    return 0;
+}
+
 /* coroutine context */
 static void *spice_channel_coroutine(void *data)
 {
@@ -2535,6 +3136,7 @@ static void *spice_channel_coroutine(void *data)
     SpiceChannelPrivate *c = channel->priv;
     guint verify;
     int rc, delay_val = 1;
+    gint64 handshake_start;
     /* When some other SSL/TLS version becomes obsolete, add it to this
      * variable. */
     long ssl_options = SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 | SSL_OP_NO_TLSv1;
@@ -2585,6 +3187,9 @@ reconnect:
         }
 
         SSL_CTX_set_options(c->ctx, ssl_options);
+        SSL_CTX_set_session_cache_mode(c->ctx, SSL_SESS_CACHE_CLIENT |
+                                               SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(c->ctx, spice_channel_new_tls_session);
 
         verify = spice_session_get_verify(c->session);
         if (verify &
@@ -2619,8 +3224,18 @@ reconnect:
         }
 
 
-        BIO *bio = bio_new_giostream(G_IO_STREAM(c->conn));
-        SSL_set_bio(c->ssl, bio, bio);
+#ifdef SSL_OP_ENABLE_KTLS
+        if (spice_session_get_ktls_enabled(c->session)) {
+            /* OpenSSL can only hand the keys to the kernel with a socket
+             * BIO, it falls back to userspace if the kernel can't */
+            SSL_set_options(c->ssl, SSL_OP_ENABLE_KTLS);
+            SSL_set_fd(c->ssl, g_socket_get_fd(c->sock));
+        } else
+#endif
+        {
+            BIO *bio = bio_new_giostream(G_IO_STREAM(c->conn));
+            SSL_set_bio(c->ssl, bio, bio);
+        }
 
         {
             guint8 *pubkey;
@@ -2633,6 +3248,16 @@ reconnect:
                 spice_session_get_cert_subject(c->session));
         }
 
+        SSL_set_ex_data(c->ssl, ssl_channel_index, channel);
+        {
+            SSL_SESSION *tls_session = spice_session_get_tls_session(c->session);
+
+            if (tls_session != NULL) {
+                SSL_set_session(c->ssl, tls_session);
+                SSL_SESSION_free(tls_session);
+            }
+        }
+
 #if OPENSSL_VERSION_NUMBER >= 0x0090806fL && !defined(OPENSSL_NO_TLSEXT)
         {
             const char *hostname = spice_session_get_host(c->session);
@@ -2646,6 +3271,7 @@ reconnect:
         }
 #endif
 
+        handshake_start = g_get_monotonic_time();
 ssl_reconnect:
         rc = SSL_connect(c->ssl);
         if (rc <= 0) {
@@ -2660,6 +3286,23 @@ ssl_reconnect:
                 goto cleanup;
             }
         }
+
+        c->tls_handshake_time = g_get_monotonic_time() - handshake_start;
+        c->tls_resumed = SSL_session_reused(c->ssl);
+        CHANNEL_DEBUG(channel, "TLS handshake %s in %" G_GINT64_FORMAT " us",
+                      c->tls_resumed ? "resumed" : "done", c->tls_handshake_time);
+        g_coroutine_object_notify(G_OBJECT(channel), "tls-handshake-time");
+        g_coroutine_object_notify(G_OBJECT(channel), "tls-resumed");
+
+#ifdef SSL_OP_ENABLE_KTLS
+        c->ktls_send = BIO_get_ktls_send(SSL_get_wbio(c->ssl)) > 0;
+        c->ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(c->ssl)) > 0;
+        CHANNEL_DEBUG(channel, "kTLS send: %d, receive: %d", c->ktls_send, c->ktls_recv);
+        if (c->ktls_send)
+            g_coroutine_object_notify(G_OBJECT(channel), "ktls-send");
+        if (c->ktls_recv)
+            g_coroutine_object_notify(G_OBJECT(channel), "ktls-recv");
+#endif
     }
 
 connected:
@@ -2703,20 +3346,20 @@ cleanup:
         c->event = SPICE_CHANNEL_ERROR_CONNECT;
     }
 
-    g_spice_idle_add(spice_channel_delayed_unref, channel);
+    /* a channel thread does it from the main context once it is done */
+    if (!spice_util_in_channel_thread())
+        g_spice_idle_add(spice_channel_delayed_unref, channel);
     /* Co-routine exits now - the SpiceChannel object may no longer exist,
        so don't do anything else now unless you like SEGVs */
     return NULL;
 }
 
-static gboolean connect_delayed(gpointer data)
+static void spice_channel_start_coroutine(SpiceChannel *channel)
 {
-    SpiceChannel *channel = data;
     SpiceChannelPrivate *c = channel->priv;
     struct coroutine *co;
 
     CHANNEL_DEBUG(channel, "Open coroutine starting %p", channel);
-    c->connect_delayed_id = 0;
 
     co = &c->coroutine.coroutine;
 
@@ -2725,6 +3368,110 @@ static gboolean connect_delayed(gpointer data)
 
     coroutine_init(co);
     coroutine_yieldto(co, channel);
+}
+
+/* system context */
+static gboolean spice_channel_thread_done(gpointer data)
+{
+    SpiceChannel *channel = SPICE_CHANNEL(data);
+    SpiceChannelPrivate *c = channel->priv;
+
+    g_thread_join(c->thread);
+    c->thread = NULL;
+
+    return spice_channel_delayed_unref(channel);
+}
+
+/*
+ * The coroutine of a threaded channel runs in this thread, with a context
+ * of its own for the sources of the channel and its decoders. The thread
+ * ends with the coroutine, unless it is reconnecting, and the reference
+ * taken by channel_connect() is released from the main context.
+ */
+static gpointer spice_channel_thread(gpointer data)
+{
+    SpiceChannel *channel = SPICE_CHANNEL(data);
+    SpiceChannelPrivate *c = channel->priv;
+    GMainContext *context;
+
+    g_mutex_lock(&c->xmit_queue_lock);
+    context = c->thread_context;
+    g_mutex_unlock(&c->xmit_queue_lock);
+
+    g_main_context_acquire(context);
+    g_main_context_push_thread_default(context);
+    spice_util_set_thread_context(context);
+
+    spice_channel_start_coroutine(channel);
+    while (!c->coroutine.coroutine.exited || c->connect_delayed_id)
+        g_main_context_iteration(context, TRUE);
+
+    g_mutex_lock(&c->xmit_queue_lock);
+    c->thread_context = NULL;
+    g_mutex_unlock(&c->xmit_queue_lock);
+
+    /* run what was invoked before the context was cleared */
+    while (g_main_context_iteration(context, FALSE))
+        ;
+
+    spice_util_set_thread_context(NULL);
+    g_main_context_pop_thread_default(context);
+    g_main_context_release(context);
+    g_main_context_unref(context);
+
+    g_spice_context_idle_add(spice_main_context(), spice_channel_thread_done, channel);
+
+    return NULL;
+}
+
+static gboolean spice_channel_use_thread(SpiceChannel *channel)
+{
+#if WITH_UCONTEXT
+    SpiceChannelPrivate *c = channel->priv;
+
+    /* the cursor and record channels have synchronous APIs that use the
+     * state of the coroutine from the main context */
+    switch (c->channel_type) {
+    case SPICE_CHANNEL_DISPLAY:
+    case SPICE_CHANNEL_PLAYBACK:
+        return spice_session_get_channel_threaded(c->session, channel);
+    default:
+        return FALSE;
+    }
+#else
+    return FALSE;
+#endif
+}
+
+static gboolean connect_delayed(gpointer data)
+{
+    SpiceChannel *channel = data;
+    SpiceChannelPrivate *c = channel->priv;
+
+    if (spice_util_in_channel_thread()) {
+        /* reconnecting from the channel thread */
+        c->connect_delayed_id = 0;
+        spice_channel_start_coroutine(channel);
+        return FALSE;
+    }
+
+    /* let the previous channel thread exit first */
+    if (c->thread != NULL)
+        return G_SOURCE_CONTINUE;
+
+    c->connect_delayed_id = 0;
+
+    if (spice_channel_use_thread(channel)) {
+        CHANNEL_DEBUG(channel, "Starting channel thread");
+        /* set before the thread starts, for spice_channel_invoke() */
+        g_mutex_lock(&c->xmit_queue_lock);
+        c->thread_context = g_main_context_new();
+        g_mutex_unlock(&c->xmit_queue_lock);
+        c->thread = g_thread_new(c->name, spice_channel_thread, channel);
+        return FALSE;
+    }
+
+    spice_channel_start_coroutine(channel);
 
     return FALSE;
 }
@@ -2843,6 +3590,9 @@ static void channel_reset(SpiceChannel *channel, gboolean migrating)
     g_clear_pointer(&c->sslverify, spice_openssl_verify_free);
     g_clear_pointer(&c->ssl, SSL_free);
     g_clear_pointer(&c->ctx, SSL_CTX_free);
+    c->ktls_send = c->ktls_recv = FALSE;
+    c->tls_resumed = FALSE;
+    c->tls_handshake_time = 0;
 
     g_clear_object(&c->conn);
     g_clear_object(&c->sock);
@@ -2854,13 +3604,19 @@ static void channel_reset(SpiceChannel *channel, gboolean migrating)
 
     g_clear_pointer(&c->peer_msg, g_free);
 
+    /* release the cached receive buffers while disconnected */
+    spice_msg_in_pool_trim(c->msg_pool);
+    g_clear_pointer(&c->read_buffer, g_free);
+    c->read_buffer_offset = c->read_buffer_length = 0;
+
     g_mutex_lock(&c->xmit_queue_lock);
     c->xmit_queue_blocked = TRUE; /* Disallow queuing new messages */
     gboolean was_empty = g_queue_is_empty(&c->xmit_queue);
     g_queue_foreach(&c->xmit_queue, (GFunc)spice_msg_out_unref, NULL);
     g_queue_clear(&c->xmit_queue);
     if (c->xmit_queue_wakeup_id) {
-        g_spice_source_remove(c->xmit_queue_wakeup_id);
+        g_spice_context_source_remove(c->thread_context ? c->thread_context : spice_thread_context(),
+                                      c->xmit_queue_wakeup_id);
         c->xmit_queue_wakeup_id = 0;
     }
     g_mutex_unlock(&c->xmit_queue_lock);
@@ -2874,11 +3630,29 @@ static void channel_reset(SpiceChannel *channel, gboolean migrating)
                                           SPICE_SESSION_MIGRATION_NONE);
 }
 
+/* channel thread context */
+static gboolean spice_channel_reset_migrating_cb(gpointer data)
+{
+    SpiceChannel *channel = SPICE_CHANNEL(data);
+
+    SPICE_CHANNEL_GET_CLASS(channel)->channel_reset(channel, TRUE);
+
+    return G_SOURCE_REMOVE;
+}
+
 /* system or coroutine context */
 G_GNUC_INTERNAL
 void spice_channel_reset(SpiceChannel *channel, gboolean migrating)
 {
     CHANNEL_DEBUG(channel, "reset %s", migrating ? "migrating" : "");
+
+    /* the session resets the channels from the main context when
+     * migrating, the state of a threaded channel belongs to its thread */
+    if (migrating && channel->priv->thread != NULL) {
+        spice_channel_invoke(channel, spice_channel_reset_migrating_cb);
+        return;
+    }
+
     SPICE_CHANNEL_GET_CLASS(channel)->channel_reset(channel, migrating);
 }
 
@@ -3074,7 +3848,14 @@ void spice_channel_swap(SpiceChannel *channel, SpiceChannel *swap, gboolean swap
     SWAP(ctx);
     SWAP(ssl);
     SWAP(sslverify);
+    SWAP(ktls_send);
+    SWAP(ktls_recv);
+    SWAP(tls_resumed);
+    SWAP(tls_handshake_time);
     SWAP(tls);
+    SWAP(read_buffer);
+    SWAP(read_buffer_offset);
+    SWAP(read_buffer_length);
     SWAP(use_mini_header);
     if (swap_msgs) {
         SWAP(xmit_queue);
@@ -3086,6 +3867,11 @@ void spice_channel_swap(SpiceChannel *channel, SpiceChannel *swap, gboolean swap
     SWAP(common_caps);
     SWAP(remote_caps);
     SWAP(remote_common_caps);
+    /* the new TLS sessions callback looks up the owner of the connection */
+    if (c->ssl)
+        SSL_set_ex_data(c->ssl, ssl_channel_index, channel);
+    if (s->ssl)
+        SSL_set_ex_data(s->ssl, ssl_channel_index, swap);
 #ifdef HAVE_SASL
     SWAP(sasl_conn);
     SWAP(sasl_decoded);
@@ -33,10 +33,14 @@ static char *usbredir_auto_redirect_filter = NULL;
 static char *usbredir_redirect_on_connect = NULL;
 static gboolean smartcard = FALSE;
 static gboolean disable_audio = FALSE;
+static gboolean ktls = FALSE;
 static gboolean disable_usbredir = FALSE;
 static gint cache_size = 0;
+static gint decode_threads = 0;
+static gchar *cache_dir = NULL;
 static gint glz_window_size = 0;
 static gchar *secure_channels = NULL;
+static gchar *threaded_channels = NULL;
 static gchar *shared_dir = NULL;
 static gchar **cd_share_files = NULL;
 static SpiceImageCompression preferred_compression = SPICE_IMAGE_COMPRESSION_INVALID;
@@ -86,8 +90,7 @@ static gboolean parse_disable_effects(const gchar *option_name, const gchar *val
     return TRUE;
 }
 
-static gboolean parse_secure_channels(const gchar *option_name, const gchar *value,
-                                      gpointer data, GError **error)
+static gboolean check_channel_names(const gchar *value, GError **error)
 {
     gint i;
     gchar **channels = g_strsplit(value, ",", -1);
@@ -104,17 +107,38 @@ static gboolean parse_secure_channels(const gchar *option_name, const gchar *val
                         _("invalid channel name (%s), valid names: all, %s"),
                         channels[i], supported);
             g_free(supported);
+            g_strfreev(channels);
             return FALSE;
         }
     }
 
     g_strfreev(channels);
 
+    return TRUE;
+}
+
+static gboolean parse_secure_channels(const gchar *option_name, const gchar *value,
+                                      gpointer data, GError **error)
+{
+    if (!check_channel_names(value, error))
+        return FALSE;
+
     secure_channels = g_strdup(value);
 
     return TRUE;
 }
 
+static gboolean parse_threaded_channels(const gchar *option_name, const gchar *value,
+                                        gpointer data, GError **error)
+{
+    if (!check_channel_names(value, error))
+        return FALSE;
+
+    threaded_channels = g_strdup(value);
+
+    return TRUE;
+}
+
 static gboolean parse_preferred_compression(const gchar *option_name, const gchar *value,
                                             gpointer data, GError **error)
 {
@@ -160,6 +184,8 @@ GOptionGroup* spice_get_option_group(void)
     const GOptionEntry entries[] = {
         { "spice-secure-channels", '\0', 0, G_OPTION_ARG_CALLBACK, parse_secure_channels,
           N_("Force the specified channels to be secured"), "<main,display,inputs,...,all>" },
+        { "spice-threaded-channels", '\0', 0, G_OPTION_ARG_CALLBACK, parse_threaded_channels,
+          N_("Run the specified channels in threads of their own"), "<display,playback,all>" },
         { "spice-disable-effects", '\0', 0, G_OPTION_ARG_CALLBACK, parse_disable_effects,
           N_("Disable guest display effects"), "<wallpaper,font-smooth,animation,all>" },
         /* Deprecated */
@@ -171,6 +197,8 @@ GOptionGroup* spice_get_option_group(void)
           N_("Subject of the host certificate (field=value pairs separated by commas)"), N_("<host-subject>") },
         { "spice-disable-audio", '\0', 0, G_OPTION_ARG_NONE, &disable_audio,
           N_("Disable audio support"), NULL },
+        { "spice-ktls", '\0', 0, G_OPTION_ARG_NONE, &ktls,
+          N_("Enable kernel TLS offload of secure connections"), NULL },
         { "spice-smartcard", '\0', 0, G_OPTION_ARG_NONE, &smartcard,
           N_("Enable smartcard support"), NULL },
         { "spice-smartcard-certificates", '\0', 0, G_OPTION_ARG_STRING, &smartcard_certificates,
@@ -189,6 +217,10 @@ GOptionGroup* spice_get_option_group(void)
           N_("Image cache size (deprecated)"), N_("<bytes>") },
         { "spice-glz-window-size", '\0', 0, G_OPTION_ARG_INT, &glz_window_size,
           N_("Glz compression history size (deprecated)"), N_("<bytes>") },
+        { "spice-decode-threads", '\0', 0, G_OPTION_ARG_INT, &decode_threads,
+          N_("Number of threads decoding images ahead of display"), N_("<threads>") },
+        { "spice-cache-dir", '\0', 0, G_OPTION_ARG_FILENAME, &cache_dir,
+          N_("Directory keeping cached images across connections"), N_("<dir>") },
         { "spice-shared-dir", '\0', 0, G_OPTION_ARG_FILENAME, &shared_dir,
           N_("Shared directory"), N_("<dir>") },
         { "spice-preferred-compression", '\0', 0, G_OPTION_ARG_CALLBACK, parse_preferred_compression,
@@ -258,6 +290,14 @@ void spice_set_session_option(SpiceSession *session)
         g_strfreev(channels);
     }
 
+    if (threaded_channels) {
+        GStrv channels;
+        channels = g_strsplit(threaded_channels, ",", -1);
+        if (channels)
+            g_object_set(session, "threaded-channels", channels, NULL);
+        g_strfreev(channels);
+    }
+
     if (ca_file)
         g_object_set(session, "ca-file", ca_file, NULL);
     if (host_subject)
@@ -319,8 +359,14 @@ void spice_set_session_option(SpiceSession *session)
         g_object_set(session, "enable-usbredir", FALSE, NULL);
     if (disable_audio)
         g_object_set(session, "enable-audio", FALSE, NULL);
+    if (ktls)
+        g_object_set(session, "enable-ktls", TRUE, NULL);
     if (cache_size)
         g_object_set(session, "cache-size", cache_size, NULL);
+    if (decode_threads)
+        g_object_set(session, "decode-threads", decode_threads, NULL);
+    if (cache_dir)
+        g_object_set(session, "cache-dir", cache_dir, NULL);
     if (glz_window_size)
         g_object_set(session, "glz-window-size", glz_window_size, NULL);
     if (shared_dir)
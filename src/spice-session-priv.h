@@ -20,6 +20,7 @@
 
 #include <glib.h>
 #include <gio/gio.h>
+#include <openssl/ssl.h>
 
 #ifdef USE_PHODAV
 #include <libphodav/phodav.h>
@@ -32,6 +33,8 @@ typedef struct _PhodavServer PhodavServer;
 #include "spice-gtk-session.h"
 #include "spice-channel-cache.h"
 #include "decode.h"
+#include "image-store.h"
+#include "gio-coroutine.h"
 
 G_BEGIN_DECLS
 
@@ -72,6 +75,13 @@ void spice_session_set_caches_hints(SpiceSession *session,
 void spice_session_get_caches(SpiceSession *session,
                               display_cache **images,
                               SpiceGlzDecoderWindow **glz_window);
+void spice_session_images_lock(SpiceSession *session);
+void spice_session_images_unlock(SpiceSession *session);
+void spice_session_images_notify(SpiceSession *session, guint64 id);
+gboolean spice_session_images_wait(SpiceSession *session, guint64 id,
+                                   GConditionWaitFunc func, gpointer data);
+SpiceDecodePool *spice_session_get_decode_pool(SpiceSession *session);
+SpiceImageStore *spice_session_get_image_store(SpiceSession *session);
 void spice_session_palettes_clear(SpiceSession *session);
 void spice_session_images_clear(SpiceSession *session);
 void spice_session_migrate_end(SpiceSession *session);
@@ -85,6 +95,12 @@ void spice_session_sync_playback_latency(SpiceSession *session);
 gboolean spice_session_get_audio_enabled(SpiceSession *session);
 gboolean spice_session_get_smartcard_enabled(SpiceSession *session);
 gboolean spice_session_get_usbredir_enabled(SpiceSession *session);
+gboolean spice_session_get_ktls_enabled(SpiceSession *session);
+SSL_SESSION *spice_session_get_tls_session(SpiceSession *session);
+void spice_session_set_tls_session(SpiceSession *session, SSL_SESSION *tls_session);
+GInetAddress *spice_session_get_connect_address(SpiceSession *session);
+void spice_session_set_connect_address(SpiceSession *session, GInetAddress *address);
+gboolean spice_session_get_channel_threaded(SpiceSession *session, SpiceChannel *channel);
 gboolean spice_session_get_gl_scanout_enabled(SpiceSession *session);
 
 PhodavServer *spice_session_get_webdav_server(SpiceSession *session);
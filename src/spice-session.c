@@ -43,7 +43,17 @@ G_STATIC_ASSERT(sizeof(SpiceSessionClass) == sizeof(GObjectClass) + 12 * sizeof(
 #define TCP_KEEPIDLE TCP_KEEPALIVE
 #endif
 
+#if OPENSSL_VERSION_NUMBER < 0x10100000 || \
+    (defined(LIBRESSL_VERSION_NUMBER) && LIBRESSL_VERSION_NUMBER < 0x20700000)
+static int SSL_SESSION_up_ref(SSL_SESSION *session)
+{
+    CRYPTO_add(&session->references, 1, CRYPTO_LOCK_SSL_SESSION);
+    return 1;
+}
+#endif
+
 #define IMAGES_CACHE_SIZE_DEFAULT (1024 * 1024 * 80)
+#define IMAGE_STORE_SIZE_DEFAULT (G_GUINT64_CONSTANT(1024) * 1024 * 1024)
 #define MIN_GLZ_WINDOW_SIZE_DEFAULT (1024 * 1024 * 12)
 #define MAX_GLZ_WINDOW_SIZE_DEFAULT MIN((LZ_MAX_WINDOW_SIZE * 4), 1024 * 1024 * 64)
 
@@ -95,6 +105,16 @@ struct _SpiceSessionPrivate {
 
     GStrv             disable_effects;
     GStrv             secure_channels;
+    GStrv             threaded_channels;
+    gboolean          ktls;
+
+    /* state shared by the connecting channels, protected by connect_lock
+     * since threaded channels connect concurrently: the TLS session
+     * resumed by the secure channels, and the address of the host the
+     * last connection went to */
+    GMutex            connect_lock;
+    SSL_SESSION       *tls_session;
+    GInetAddress      *connect_address;
 
     int               connection_id;
     int               protocol;
@@ -112,10 +132,20 @@ struct _SpiceSessionPrivate {
     guint             after_main_init;
     gboolean          for_migration;
 
+    /* the display channels may run in threads of their own, this protects
+     * the images cache, the decode pool and the image store they share */
+    GMutex            images_lock;
+    GSList            *image_waiters;
     display_cache     *images;
     SpiceGlzDecoderWindow *glz_window;
     int               images_cache_size;
     int               glz_window_size;
+    int               decode_threads;
+    SpiceDecodePool   *decode_pool;
+    gchar             *cache_dir;
+    SpiceImageStore   *image_store;
+    gboolean          image_store_failed;
+    guint8            image_store_uuid[16];
     uint32_t          n_display_channels;
     guint8            uuid[16];
     gchar             *name;
@@ -203,6 +233,11 @@ enum {
     PROP_UNIX_PATH,
     PROP_PREF_COMPRESSION,
     PROP_GL_SCANOUT,
+    PROP_CACHE_STATS,
+    PROP_DECODE_THREADS,
+    PROP_CACHE_DIR,
+    PROP_THREADED_CHANNELS,
+    PROP_KTLS,
 };
 
 /* signals */
@@ -252,6 +287,7 @@ spice_image_compress_get_type (void)
 static guint signals[SPICE_SESSION_LAST_SIGNAL];
 
 static void spice_session_channel_destroy(SpiceSession *session, SpiceChannel *channel);
+static void session_host_changed(SpiceSession *session);
 
 static void update_proxy(SpiceSession *self, const gchar *str)
 {
@@ -280,6 +316,13 @@ static void update_proxy(SpiceSession *self, const gchar *str)
     }
 }
 
+static gsize image_cache_item_size(gpointer value)
+{
+    pixman_image_t *image = value;
+
+    return (gsize)ABS(pixman_image_get_stride(image)) * pixman_image_get_height(image);
+}
+
 static void spice_session_init(SpiceSession *session)
 {
     SpiceSessionPrivate *s;
@@ -292,8 +335,11 @@ static void spice_session_init(SpiceSession *session)
     SPICE_DEBUG("Supported channels: %s", channels);
     g_free(channels);
 
+    g_mutex_init(&s->images_lock);
     s->images = cache_image_new((GDestroyNotify)pixman_image_unref);
+    cache_set_size_func(s->images, image_cache_item_size);
     s->glz_window = glz_decoder_window_new();
+    g_mutex_init(&s->connect_lock);
     update_proxy(session, NULL);
 }
 
@@ -374,6 +420,15 @@ spice_session_finalize(GObject *gobject)
 
     g_clear_pointer(&s->images, cache_free);
     glz_decoder_window_destroy(s->glz_window);
+    g_clear_pointer(&s->decode_pool, decode_pool_free);
+    g_clear_pointer(&s->image_store, image_store_free);
+    g_warn_if_fail(s->image_waiters == NULL);
+    g_mutex_clear(&s->images_lock);
+    g_free(s->cache_dir);
+    g_strfreev(s->threaded_channels);
+    g_clear_pointer(&s->tls_session, SSL_SESSION_free);
+    g_clear_object(&s->connect_address);
+    g_mutex_clear(&s->connect_lock);
 
     g_clear_pointer(&s->pubkey, g_byte_array_unref);
     g_clear_pointer(&s->ca, g_byte_array_unref);
@@ -588,6 +643,7 @@ end:
     }
     s->username = username;
     s->password = password;
+    session_host_changed(session);
     return 0;
 
 fail:
@@ -717,6 +773,33 @@ static void spice_session_get_property(GObject    *gobject,
     case PROP_GL_SCANOUT:
         g_value_set_boolean(value, s->gl_scanout);
         break;
+    case PROP_CACHE_STATS: {
+        GVariantBuilder builder;
+        display_cache_stats stats;
+
+        g_mutex_lock(&s->images_lock);
+        cache_get_stats(s->images, &stats);
+        g_mutex_unlock(&s->images_lock);
+        g_variant_builder_init(&builder, G_VARIANT_TYPE("a{st}"));
+        g_variant_builder_add(&builder, "{st}", "bytes", stats.bytes);
+        g_variant_builder_add(&builder, "{st}", "entries", stats.entries);
+        g_variant_builder_add(&builder, "{st}", "hits", stats.hits);
+        g_variant_builder_add(&builder, "{st}", "misses", stats.misses);
+        g_value_take_variant(value, g_variant_builder_end(&builder));
+        break;
+    }
+    case PROP_DECODE_THREADS:
+        g_value_set_int(value, s->decode_threads);
+        break;
+    case PROP_CACHE_DIR:
+        g_value_set_string(value, s->cache_dir);
+        break;
+    case PROP_THREADED_CHANNELS:
+        g_value_set_boxed(value, s->threaded_channels);
+        break;
+    case PROP_KTLS:
+        g_value_set_boolean(value, s->ktls);
+        break;
     default:
 	G_OBJECT_WARN_INVALID_PROPERTY_ID(gobject, prop_id, pspec);
 	break;
@@ -736,6 +819,7 @@ static void spice_session_set_property(GObject      *gobject,
     case PROP_HOST:
         g_free(s->host);
         s->host = g_value_dup_string(value);
+        session_host_changed(session);
         break;
     case PROP_UNIX_PATH:
         g_free(s->unix_path);
@@ -744,10 +828,12 @@ static void spice_session_set_property(GObject      *gobject,
     case PROP_PORT:
         g_free(s->port);
         s->port = g_value_dup_string(value);
+        session_host_changed(session);
         break;
     case PROP_TLS_PORT:
         g_free(s->tls_port);
         s->tls_port = g_value_dup_string(value);
+        session_host_changed(session);
         break;
     case PROP_USERNAME:
         g_free(s->username);
@@ -760,6 +846,7 @@ static void spice_session_set_property(GObject      *gobject,
     case PROP_CA_FILE:
         g_free(s->ca_file);
         s->ca_file = g_value_dup_string(value);
+        spice_session_set_tls_session(session, NULL);
         break;
     case PROP_CIPHERS:
         g_free(s->ciphers);
@@ -784,6 +871,7 @@ static void spice_session_set_property(GObject      *gobject,
             s->verify |= SPICE_SESSION_VERIFY_PUBKEY;
         else
             s->verify &= ~SPICE_SESSION_VERIFY_PUBKEY;
+        spice_session_set_tls_session(session, NULL);
 	break;
     case PROP_CERT_SUBJECT:
         g_free(s->cert_subject);
@@ -792,9 +880,11 @@ static void spice_session_set_property(GObject      *gobject,
             s->verify |= SPICE_SESSION_VERIFY_SUBJECT;
         else
             s->verify &= ~SPICE_SESSION_VERIFY_SUBJECT;
+        spice_session_set_tls_session(session, NULL);
         break;
     case PROP_VERIFY:
         s->verify = g_value_get_flags(value);
+        spice_session_set_tls_session(session, NULL);
         break;
     case PROP_MIGRATION_STATE:
         s->migration_state = g_value_get_enum(value);
@@ -837,12 +927,44 @@ static void spice_session_set_property(GObject      *gobject,
     case PROP_CACHE_SIZE:
         s->images_cache_size = g_value_get_int(value);
         break;
+    case PROP_DECODE_THREADS:
+        if (s->decode_threads != g_value_get_int(value)) {
+            SpiceDecodePool *pool;
+
+            g_mutex_lock(&s->images_lock);
+            s->decode_threads = g_value_get_int(value);
+            /* recreated on demand with the new number of threads */
+            pool = s->decode_pool;
+            s->decode_pool = NULL;
+            g_mutex_unlock(&s->images_lock);
+            /* finishes the pending jobs, not while holding the lock */
+            g_clear_pointer(&pool, decode_pool_free);
+        }
+        break;
+    case PROP_CACHE_DIR:
+        g_mutex_lock(&s->images_lock);
+        g_free(s->cache_dir);
+        s->cache_dir = g_value_dup_string(value);
+        /* opened on demand in the new location */
+        g_clear_pointer(&s->image_store, image_store_free);
+        s->image_store_failed = FALSE;
+        g_mutex_unlock(&s->images_lock);
+        break;
+    case PROP_THREADED_CHANNELS:
+        g_strfreev(s->threaded_channels);
+        s->threaded_channels = g_value_dup_boxed(value);
+        break;
+    case PROP_KTLS:
+        s->ktls = g_value_get_boolean(value);
+        break;
     case PROP_GLZ_WINDOW_SIZE:
         s->glz_window_size = g_value_get_int(value);
+        glz_decoder_window_set_size(s->glz_window, s->glz_window_size);
         break;
     case PROP_CA:
         g_clear_pointer(&s->ca, g_byte_array_unref);
         s->ca = g_value_dup_boxed(value);
+        spice_session_set_tls_session(session, NULL);
         break;
     case PROP_PROXY:
         update_proxy(session, g_value_get_string(value));
@@ -1551,6 +1673,112 @@ static void spice_session_class_init(SpiceSessionClass *klass)
 #endif
                               G_PARAM_READWRITE |
                               G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:cache-stats:
+     *
+     * Statistics of the images cache, as a dictionary of unsigned 64-bit
+     * counters: "bytes" and "entries" currently cached, and lookup "hits"
+     * and "misses". The server decides what the cache holds, within the
+     * #SpiceSession:cache-size it is told, so nothing is evicted.
+     *
+     * Since: 0.42
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_CACHE_STATS,
+         g_param_spec_variant("cache-stats",
+                              "Images cache statistics",
+                              "Images cache statistics",
+                              G_VARIANT_TYPE("a{st}"),
+                              NULL,
+                              G_PARAM_READABLE |
+                              G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:decode-threads:
+     *
+     * Number of worker threads decoding large images ahead of the
+     * display channels, in parallel. If 0, images are decoded when
+     * drawn.
+     *
+     * Since: 0.42
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_DECODE_THREADS,
+         g_param_spec_int("decode-threads",
+                          "Decode threads",
+                          "Number of image decoding threads",
+                          0, 64, 0,
+                          G_PARAM_READWRITE |
+                          G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:cache-dir:
+     *
+     * Directory where the cached images are also saved, as they are
+     * decoded, to be reused by the following connections instead of
+     * decoding them again. If %NULL, images are only cached in
+     * memory. The images of each guest are kept in a subdirectory named
+     * after its uuid, and aren't saved if the server doesn't send it.
+     *
+     * Since: 0.42
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_CACHE_DIR,
+         g_param_spec_string("cache-dir",
+                             "Cache directory",
+                             "Persistent image cache directory",
+                             NULL,
+                             G_PARAM_READWRITE |
+                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:threaded-channels:
+     *
+     * A string array of channel types to run in a thread of their own,
+     * rather than in the main context, so that their I/O and decoding
+     * don't compete with the user interface. The signals of these
+     * channels are still emitted in the main context, while the channel
+     * waits for them.
+     *
+     * Only the display and playback channels can run in a thread, the
+     * other types are ignored. This applies to the channels connected
+     * after it is set, and requires the ucontext coroutines.
+     *
+     * Since: 0.42
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_THREADED_CHANNELS,
+         g_param_spec_boxed ("threaded-channels",
+                             "Threaded channels",
+                             "Array of channel type to run in a thread",
+                             G_TYPE_STRV,
+                             G_PARAM_READWRITE |
+                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:enable-ktls:
+     *
+     * If set to TRUE, the secure channels let the kernel encrypt and
+     * decrypt their traffic (kTLS) when both OpenSSL and the kernel
+     * support it, and fall back to OpenSSL otherwise. Connections going
+     * through a proxy always use OpenSSL. Disabled by default, as it
+     * depends on the kernel and OpenSSL builds more than the other
+     * options.
+     *
+     * See #SpiceChannel:ktls-send and #SpiceChannel:ktls-recv to know
+     * whether a channel uses it.
+     *
+     * Since: 0.42
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_KTLS,
+         g_param_spec_boolean("enable-ktls",
+                              "Enable kernel TLS",
+                              "Enable kernel TLS offload of secure channels",
+                              FALSE,
+                              G_PARAM_READWRITE |
+                              G_PARAM_STATIC_STRINGS));
 }
 
 G_GNUC_INTERNAL
@@ -1633,6 +1861,7 @@ SpiceSession *spice_session_new_from_session(SpiceSession *session)
                  "enable-smartcard", &c->smartcard,
                  "enable-audio", &c->audio,
                  "enable-usbredir", &c->usbredir,
+                 "enable-ktls", &c->ktls,
                  "ca", &c->ca,
                  NULL);
 
@@ -1735,7 +1964,9 @@ static void cache_clear_all(SpiceSession *self)
 {
     SpiceSessionPrivate *s = self->priv;
 
+    g_mutex_lock(&s->images_lock);
     cache_clear(s->images);
+    g_mutex_unlock(&s->images_lock);
     glz_decoder_window_clear(s->glz_window);
 }
 
@@ -1793,6 +2024,8 @@ void spice_session_start_migrating(SpiceSession *session,
     SWAP_STR(s->port, m->port);
     SWAP_STR(s->tls_port, m->tls_port);
     SWAP_STR(s->unix_path, m->unix_path);
+    session_host_changed(session);
+    session_host_changed(s->migration);
 
     g_warn_if_fail(g_list_length(s->channels) == g_list_length(m->channels));
 
@@ -2088,28 +2321,126 @@ struct spice_open_host {
     SpiceChannel *channel;
     SpiceURI *proxy;
     int port;
+    gboolean known_address;
     GCancellable *cancellable;
     GError *error;
     GSocketConnection *connection;
     GSocketClient *client;
 };
 
+/* any context */
+G_GNUC_INTERNAL
+void spice_session_set_connect_address(SpiceSession *session, GInetAddress *address)
+{
+    SpiceSessionPrivate *s = session->priv;
+    GInetAddress *old;
+
+    if (address != NULL)
+        g_object_ref(address);
+
+    g_mutex_lock(&s->connect_lock);
+    old = s->connect_address;
+    s->connect_address = address;
+    g_mutex_unlock(&s->connect_lock);
+
+    g_clear_object(&old);
+}
+
+/* any context */
+G_GNUC_INTERNAL
+GInetAddress *spice_session_get_connect_address(SpiceSession *session)
+{
+    SpiceSessionPrivate *s = session->priv;
+    GInetAddress *address;
+
+    g_mutex_lock(&s->connect_lock);
+    address = s->connect_address ? g_object_ref(s->connect_address) : NULL;
+    g_mutex_unlock(&s->connect_lock);
+
+    return address;
+}
+
+/* the address resolved for the host, and the TLS session to resume, only
+ * hold for the host they were obtained from, and the ports connected with */
+/* any context */
+static void session_host_changed(SpiceSession *session)
+{
+    spice_session_set_connect_address(session, NULL);
+    spice_session_set_tls_session(session, NULL);
+}
+
+static void open_host_connectable_connect(spice_open_host *open_host, GSocketConnectable *connectable);
+
+/*
+ * The first channel resolves the host, and GSocketClient races its
+ * addresses. The address that answered is kept in the session, so the
+ * next channels connect to it right away. If it stops answering, the
+ * channel goes through the resolution again.
+ */
+/* main context */
+static void open_host_connect_host(spice_open_host *open_host)
+{
+    SpiceSessionPrivate *s = open_host->session->priv;
+    GSocketConnectable *address = NULL;
+    GInetAddress *inet_address = spice_session_get_connect_address(open_host->session);
+
+    if (inet_address != NULL) {
+        gchar *str = g_inet_address_to_string(inet_address);
+        SPICE_DEBUG("open host %s:%d at %s", s->host, open_host->port, str);
+        g_free(str);
+        address = G_SOCKET_CONNECTABLE(g_inet_socket_address_new(inet_address, open_host->port));
+        open_host->known_address = TRUE;
+        g_object_unref(inet_address);
+    } else {
+        SPICE_DEBUG("open host %s:%d", s->host, open_host->port);
+        address = g_network_address_parse(s->host, open_host->port, &open_host->error);
+        open_host->known_address = FALSE;
+    }
+
+    if (address == NULL || open_host->error != NULL) {
+        coroutine_yieldto(open_host->from, NULL);
+        return;
+    }
+
+    open_host_connectable_connect(open_host, address);
+    g_object_unref(address);
+}
+
 static void socket_client_connect_ready(GObject *source_object, GAsyncResult *result,
                                         gpointer data)
 {
     GSocketClient *client = G_SOCKET_CLIENT(source_object);
     spice_open_host *open_host = data;
     GSocketConnection *connection = NULL;
+    GSocketAddress *remote;
 
     CHANNEL_DEBUG(open_host->channel, "connect ready");
     connection = g_socket_client_connect_finish(client, result, &open_host->error);
     if (connection == NULL) {
         g_warn_if_fail(open_host->error != NULL);
+        if (open_host->known_address &&
+            !g_error_matches(open_host->error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            CHANNEL_DEBUG(open_host->channel, "known address failed: %s, resolving again",
+                          open_host->error->message);
+            g_clear_error(&open_host->error);
+            spice_session_set_connect_address(open_host->session, NULL);
+            open_host_connect_host(open_host);
+            return;
+        }
         goto end;
     }
 
     open_host->connection = connection;
 
+    /* remember the address that won the race for the next channels */
+    remote = g_socket_connection_get_remote_address(connection, NULL);
+    if (!open_host->known_address && open_host->proxy == NULL &&
+        G_IS_INET_SOCKET_ADDRESS(remote)) {
+        spice_session_set_connect_address(open_host->session,
+            g_inet_socket_address_get_address(G_INET_SOCKET_ADDRESS(remote)));
+    }
+    g_clear_object(&remote);
+
 end:
     coroutine_yieldto(open_host->from, NULL);
 }
@@ -2183,21 +2514,16 @@ static gboolean open_host_idle_cb(gpointer data)
                                         spice_uri_get_hostname(open_host->proxy),
                                         open_host->cancellable,
                                         proxy_lookup_ready, open_host);
-    } else {
+    } else if (s->unix_path) {
         GSocketConnectable *address = NULL;
 
-        if (s->unix_path) {
-            SPICE_DEBUG("open unix path %s", s->unix_path);
+        SPICE_DEBUG("open unix path %s", s->unix_path);
 #ifdef G_OS_UNIX
-            address = G_SOCKET_CONNECTABLE(g_unix_socket_address_new(s->unix_path));
+        address = G_SOCKET_CONNECTABLE(g_unix_socket_address_new(s->unix_path));
 #else
-            g_set_error_literal(&open_host->error, SPICE_CLIENT_ERROR, SPICE_CLIENT_ERROR_FAILED,
-                                "Unix path unsupported on this platform");
+        g_set_error_literal(&open_host->error, SPICE_CLIENT_ERROR, SPICE_CLIENT_ERROR_FAILED,
+                            "Unix path unsupported on this platform");
 #endif
-        } else {
-            SPICE_DEBUG("open host %s:%d", s->host, open_host->port);
-            address = g_network_address_parse(s->host, open_host->port, &open_host->error);
-        }
 
         if (address == NULL || open_host->error != NULL) {
             coroutine_yieldto(open_host->from, NULL);
@@ -2206,6 +2532,8 @@ static gboolean open_host_idle_cb(gpointer data)
 
         open_host_connectable_connect(open_host, address);
         g_object_unref(address);
+    } else {
+        open_host_connect_host(open_host);
     }
 
     if (open_host->proxy != NULL) {
@@ -2578,6 +2906,126 @@ void spice_session_get_caches(SpiceSession *session,
         *glz_window = s->glz_window;
 }
 
+/*
+ * The images cache, the decode pool and the image store are shared by the
+ * display channels, which may run in threads of their own. They must only
+ * be used with this lock held.
+ */
+G_GNUC_INTERNAL
+void spice_session_images_lock(SpiceSession *session)
+{
+    g_return_if_fail(SPICE_IS_SESSION(session));
+
+    g_mutex_lock(&session->priv->images_lock);
+}
+
+G_GNUC_INTERNAL
+void spice_session_images_unlock(SpiceSession *session)
+{
+    g_return_if_fail(SPICE_IS_SESSION(session));
+
+    g_mutex_unlock(&session->priv->images_lock);
+}
+
+typedef struct SpiceImageWaiter {
+    guint64          id;
+    GCoroutineNotify notify;
+} SpiceImageWaiter;
+
+/* any thread, with the images lock held */
+G_GNUC_INTERNAL
+void spice_session_images_notify(SpiceSession *session, guint64 id)
+{
+    g_return_if_fail(SPICE_IS_SESSION(session));
+
+    for (GSList *l = session->priv->image_waiters; l != NULL; l = l->next) {
+        SpiceImageWaiter *waiter = l->data;
+
+        if (waiter->id == id)
+            g_coroutine_notify(&waiter->notify);
+    }
+}
+
+/*
+ * coroutine context, without the images lock held
+ *
+ * Waits until @func returns %TRUE. Another display channel may add the
+ * image from its own thread, so @func is checked again each time image
+ * @id is notified with spice_session_images_notify().
+ *
+ * Returns: %TRUE if the condition was reached, %FALSE if cancelled
+ */
+G_GNUC_INTERNAL
+gboolean spice_session_images_wait(SpiceSession *session, guint64 id,
+                                   GConditionWaitFunc func, gpointer data)
+{
+    g_return_val_if_fail(SPICE_IS_SESSION(session), FALSE);
+
+    SpiceSessionPrivate *s = session->priv;
+    SpiceImageWaiter waiter = { .id = id };
+    gboolean ready;
+
+    g_coroutine_notify_init(&waiter.notify);
+    g_mutex_lock(&s->images_lock);
+    s->image_waiters = g_slist_prepend(s->image_waiters, &waiter);
+    g_mutex_unlock(&s->images_lock);
+
+    ready = g_coroutine_condition_wait_notified(g_coroutine_self(), func, data,
+                                                &waiter.notify);
+
+    g_mutex_lock(&s->images_lock);
+    s->image_waiters = g_slist_remove(s->image_waiters, &waiter);
+    g_mutex_unlock(&s->images_lock);
+    g_coroutine_notify_clear(&waiter.notify);
+
+    return ready;
+}
+
+/* with the images lock held */
+G_GNUC_INTERNAL
+SpiceDecodePool *spice_session_get_decode_pool(SpiceSession *session)
+{
+    g_return_val_if_fail(SPICE_IS_SESSION(session), NULL);
+
+    SpiceSessionPrivate *s = session->priv;
+
+    if (s->decode_threads > 0 && s->decode_pool == NULL)
+        s->decode_pool = decode_pool_new(s->decode_threads, s->glz_window);
+
+    return s->decode_pool;
+}
+
+/*
+ * The image ids are only unique within a guest, so the images of each
+ * guest are stored in a subdirectory named after its uuid. There is no
+ * store until the main channel received the uuid.
+ *
+ * with the images lock held
+ */
+G_GNUC_INTERNAL
+SpiceImageStore *spice_session_get_image_store(SpiceSession *session)
+{
+    static const guint8 no_uuid[16] = { 0, };
+
+    g_return_val_if_fail(SPICE_IS_SESSION(session), NULL);
+
+    SpiceSessionPrivate *s = session->priv;
+
+    if (s->cache_dir != NULL && s->image_store == NULL && !s->image_store_failed &&
+        memcmp(s->uuid, no_uuid, sizeof(s->uuid)) != 0) {
+        gchar *uuid = spice_uuid_to_string(s->uuid);
+        gchar *dir = g_build_filename(s->cache_dir, uuid, NULL);
+
+        s->image_store = image_store_new(dir, IMAGE_STORE_SIZE_DEFAULT);
+        s->image_store_failed = s->image_store == NULL;
+        memcpy(s->image_store_uuid, s->uuid, sizeof(s->uuid));
+        g_free(dir);
+        g_free(uuid);
+    }
+
+    return s->image_store;
+}
+
 G_GNUC_INTERNAL
 void spice_session_set_caches_hints(SpiceSession *session,
                                     uint32_t pci_ram_size,
@@ -2599,6 +3047,7 @@ void spice_session_set_caches_hints(SpiceSession *session,
         s->glz_window_size = MIN(MAX_GLZ_WINDOW_SIZE_DEFAULT, pci_ram_size / 2);
         s->glz_window_size = MAX(MIN_GLZ_WINDOW_SIZE_DEFAULT, s->glz_window_size);
     }
+    glz_decoder_window_set_size(s->glz_window, s->glz_window_size);
 }
 
 G_GNUC_INTERNAL
@@ -2618,6 +3067,15 @@ void spice_session_set_uuid(SpiceSession *session, guint8 uuid[16])
 
     memcpy(s->uuid, uuid, sizeof(s->uuid));
 
+    /* the stored images of another guest don't apply */
+    g_mutex_lock(&s->images_lock);
+    if (s->image_store != NULL &&
+        memcmp(s->image_store_uuid, s->uuid, sizeof(s->uuid)) != 0) {
+        g_clear_pointer(&s->image_store, image_store_free);
+        s->image_store_failed = FALSE;
+    }
+    g_mutex_unlock(&s->images_lock);
+
     g_coroutine_object_notify(G_OBJECT(session), "uuid");
 }
 
@@ -2818,6 +3276,73 @@ gboolean spice_session_get_audio_enabled(SpiceSession *session)
     return session->priv->audio;
 }
 
+G_GNUC_INTERNAL
+gboolean spice_session_get_ktls_enabled(SpiceSession *session)
+{
+    g_return_val_if_fail(SPICE_IS_SESSION(session), FALSE);
+
+    return session->priv->ktls && session->priv->proxy == NULL;
+}
+
+/*
+ * The TLS session of the last secure channel handshake, that the next
+ * secure channels resume instead of doing a full handshake of their own.
+ * It is forgotten when the host or the TLS port change.
+ *
+ * Returns: (transfer full): the TLS session, or %NULL
+ */
+/* any context */
+G_GNUC_INTERNAL
+SSL_SESSION *spice_session_get_tls_session(SpiceSession *session)
+{
+    SpiceSessionPrivate *s;
+    SSL_SESSION *tls_session;
+
+    g_return_val_if_fail(SPICE_IS_SESSION(session), NULL);
+
+    s = session->priv;
+    g_mutex_lock(&s->connect_lock);
+    tls_session = s->tls_session;
+    if (tls_session != NULL)
+        SSL_SESSION_up_ref(tls_session);
+    g_mutex_unlock(&s->connect_lock);
+
+    return tls_session;
+}
+
+/* any context */
+G_GNUC_INTERNAL
+void spice_session_set_tls_session(SpiceSession *session, SSL_SESSION *tls_session)
+{
+    SpiceSessionPrivate *s;
+    SSL_SESSION *old;
+
+    g_return_if_fail(SPICE_IS_SESSION(session));
+
+    s = session->priv;
+    if (tls_session != NULL)
+        SSL_SESSION_up_ref(tls_session);
+
+    g_mutex_lock(&s->connect_lock);
+    old = s->tls_session;
+    s->tls_session = tls_session;
+    g_mutex_unlock(&s->connect_lock);
+
+    g_clear_pointer(&old, SSL_SESSION_free);
+}
+
+G_GNUC_INTERNAL
+gboolean spice_session_get_channel_threaded(SpiceSession *session, SpiceChannel *channel)
+{
+    g_return_val_if_fail(SPICE_IS_SESSION(session), FALSE);
+
+    SpiceSessionPrivate *s = session->priv;
+    const char *name = spice_channel_type_to_string(channel->priv->channel_type);
+
+    return spice_strv_contains(s->threaded_channels, "all") ||
+           spice_strv_contains(s->threaded_channels, name);
+}
+
 G_GNUC_INTERNAL
 gboolean spice_session_get_usbredir_enabled(SpiceSession *session)
 {
@@ -31,6 +31,9 @@ gchar* spice_dos2unix(const gchar *str, gssize len);
 void spice_mono_edge_highlight(unsigned width, unsigned hight,
                                const guint8 *and, const guint8 *xor, guint8 *dest);
 GMainContext *spice_main_context(void);
+void spice_util_set_thread_context(GMainContext *context);
+GMainContext *spice_thread_context(void);
+gboolean spice_util_in_channel_thread(void);
 guint g_spice_timeout_add(guint interval, GSourceFunc function, gpointer data);
 guint g_spice_timeout_add_seconds(guint interval, GSourceFunc function, gpointer data);
 guint g_spice_timeout_add_full(gint priority, guint interval, GSourceFunc function,
@@ -39,4 +42,11 @@ guint g_spice_idle_add(GSourceFunc function, gpointer data);
 guint g_spice_child_watch_add(GPid pid, GChildWatchFunc function, gpointer data);
 gboolean g_spice_source_remove(guint tag);
 
+/* the same, for the sources of another thread */
+guint g_spice_context_timeout_add_full(GMainContext *context, gint priority, guint interval,
+                                       GSourceFunc function, gpointer data,
+                                       GDestroyNotify notify);
+guint g_spice_context_idle_add(GMainContext *context, GSourceFunc function, gpointer data);
+gboolean g_spice_context_source_remove(GMainContext *context, guint tag);
+
 G_END_DECLS
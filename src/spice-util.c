@@ -516,6 +516,47 @@ GMainContext *spice_main_context(void)
     return spice_context;
 }
 
+static GPrivate thread_context;
+
+/*
+ * spice_util_set_thread_context:
+ * @context: the context of the calling thread, or %NULL
+ *
+ * Makes the sources of the calling thread, added with the g_spice_*()
+ * helpers, attach to @context rather than to the main context. This is
+ * used by the channels running in a thread of their own.
+ */
+G_GNUC_INTERNAL
+void spice_util_set_thread_context(GMainContext *context)
+{
+    g_private_set(&thread_context, context);
+}
+
+/*
+ * spice_thread_context:
+ *
+ * Returns: the context set with spice_util_set_thread_context() for the
+ * calling thread, or else the main context.
+ */
+G_GNUC_INTERNAL
+GMainContext *spice_thread_context(void)
+{
+    GMainContext *context = g_private_get(&thread_context);
+
+    return context ? context : spice_context;
+}
+
+/*
+ * spice_util_in_channel_thread:
+ *
+ * Returns: %TRUE if the calling thread is the thread of a channel.
+ */
+G_GNUC_INTERNAL
+gboolean spice_util_in_channel_thread(void)
+{
+    return g_private_get(&thread_context) != NULL;
+}
+
 G_GNUC_INTERNAL
 guint
 g_spice_timeout_add(guint interval,
@@ -538,7 +579,7 @@ g_spice_timeout_add_seconds(guint interval,
 
     g_return_val_if_fail(function != NULL, 0);
 
-    context = spice_main_context();
+    context = spice_thread_context();
 
     source = g_timeout_source_new_seconds(interval);
     g_source_set_callback(source, function, data, NULL);
@@ -555,14 +596,25 @@ g_spice_timeout_add_full (gint priority,
                           GSourceFunc function,
                           gpointer data,
                           GDestroyNotify notify)
+{
+    return g_spice_context_timeout_add_full(spice_thread_context(), priority,
+                                            interval, function, data, notify);
+}
+
+G_GNUC_INTERNAL
+guint
+g_spice_context_timeout_add_full(GMainContext *context,
+                                 gint priority,
+                                 guint interval,
+                                 GSourceFunc function,
+                                 gpointer data,
+                                 GDestroyNotify notify)
 {
     GSource *source;
-    GMainContext *context;
     guint id;
 
     g_return_val_if_fail(function != NULL, 0);
 
-    context = spice_main_context();
     source = g_timeout_source_new(interval);
 
     if (priority != G_PRIORITY_DEFAULT)
@@ -580,15 +632,21 @@ G_GNUC_INTERNAL
 guint
 g_spice_idle_add(GSourceFunc function,
                  gpointer data)
+{
+    return g_spice_context_idle_add(spice_thread_context(), function, data);
+}
+
+G_GNUC_INTERNAL
+guint
+g_spice_context_idle_add(GMainContext *context,
+                         GSourceFunc function,
+                         gpointer data)
 {
     GSource *source = NULL;
-    GMainContext *context;
     guint id;
 
     g_return_val_if_fail(function != NULL, 0);
 
-    context = spice_main_context();
-
     source = g_idle_source_new();
     g_source_set_callback(source, function, data, NULL);
     id = g_source_attach(source, context);
@@ -609,7 +667,7 @@ g_spice_child_watch_add(GPid pid,
 
     g_return_val_if_fail(function != NULL, 0);
 
-    context = spice_main_context();
+    context = spice_thread_context();
 
     source = g_child_watch_source_new(pid);
     g_source_set_callback(source, (GSourceFunc) function, data, NULL);
@@ -622,12 +680,19 @@ g_spice_child_watch_add(GPid pid,
 G_GNUC_INTERNAL
 gboolean
 g_spice_source_remove(guint tag)
+{
+    return g_spice_context_source_remove(spice_thread_context(), tag);
+}
+
+G_GNUC_INTERNAL
+gboolean
+g_spice_context_source_remove(GMainContext *context, guint tag)
 {
     GSource *source;
 
     g_return_val_if_fail(tag > 0, FALSE);
 
-    source = g_main_context_find_source_by_id(spice_main_context(), tag);
+    source = g_main_context_find_source_by_id(context, tag);
     if (source)
         g_source_destroy(source);
     else
@@ -66,6 +66,45 @@ static const char *spice_egl_fragment_src =     \
   }                                             \
 ";
 
+/*
+ * 16 bits canvases are uploaded as they are, and expanded to 24 bits
+ * here, replicating the top bits of each channel into the low ones.
+ * Integer textures can't be filtered, the 4 nearest pixels are mixed.
+ */
+static const char *spice_egl_canvas16_fragment_src =                    \
+"                                                                       \
+  #version 130\n                                                        \
+                                                                        \
+  in vec2 tcoords;                                                      \
+  out vec4 fragmentColor;                                               \
+  uniform usampler2D samp;                                              \
+  uniform int green_bits;                                               \
+                                                                        \
+  vec3 expand(ivec2 pos)                                                \
+  {                                                                     \
+    uint s = texelFetch(samp, pos, 0).r;                                \
+    uint g = uint(green_bits);                                          \
+    uvec3 c = uvec3(s >> (5u + g), s >> 5u, s) &                        \
+              uvec3(0x1fu, (1u << g) - 1u, 0x1fu);                      \
+    c = (c << uvec3(3u, 8u - g, 3u)) | (c >> uvec3(2u, 2u * g - 8u, 2u)); \
+    return vec3(c) / 255.0;                                             \
+  }                                                                     \
+                                                                        \
+  void main()                                                           \
+  {                                                                     \
+    ivec2 size = textureSize(samp, 0);                                  \
+    vec2 pos = tcoords * vec2(size) - 0.5;                              \
+    vec2 f = fract(pos);                                                \
+    ivec2 p0 = clamp(ivec2(floor(pos)), ivec2(0), size - 1);            \
+    ivec2 p1 = clamp(ivec2(floor(pos)) + 1, ivec2(0), size - 1);        \
+    vec3 top = mix(expand(p0), expand(ivec2(p1.x, p0.y)), f.x);         \
+    vec3 bottom = mix(expand(ivec2(p0.x, p1.y)), expand(p1), f.x);      \
+    fragmentColor = vec4(mix(top, bottom, f.y), 1.0);                   \
+  }                                                                     \
+";
+
+static void spice_egl_canvas_upload(SpiceDisplay *display);
+
 static void apply_ortho(guint mproj, float left, float right,
                         float bottom, float top, float near, float far)
 
@@ -88,19 +127,19 @@ static void apply_ortho(guint mproj, float left, float right,
     glUniformMatrix4fv(mproj, 1, GL_FALSE, &ortho[0]);
 }
 
-static gboolean spice_egl_init_shaders(SpiceDisplay *display, GError **err)
+/* attr_pos and attr_tex are the vertex attributes locations, or -1 */
+static GLuint spice_egl_compile_program(const char *vertex_src,
+                                        const char *fragment_src,
+                                        GLint attr_pos, GLint attr_tex,
+                                        GError **err)
 {
-    SpiceDisplayPrivate *d = display->priv;
-    GLuint fs = 0, vs = 0, buf;
-    GLint status, tex_loc, prog;
-    gboolean success = FALSE;
+    GLuint fs = 0, vs = 0, prog = 0;
+    GLint status;
     gchar log[1000] = { 0, };
     GLsizei len;
 
-    glGetIntegerv(GL_CURRENT_PROGRAM, &prog);
-
     fs = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fs, 1, (const char **)&spice_egl_fragment_src, NULL);
+    glShaderSource(fs, 1, &fragment_src, NULL);
     glCompileShader(fs);
     glGetShaderiv(fs, GL_COMPILE_STATUS, &status);
     if (!status) {
@@ -111,7 +150,7 @@ static gboolean spice_egl_init_shaders(SpiceDisplay *display, GError **err)
     }
 
     vs = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vs, 1, (const char **)&spice_egl_vertex_src, NULL);
+    glShaderSource(vs, 1, &vertex_src, NULL);
     glCompileShader(vs);
     glGetShaderiv(vs, GL_COMPILE_STATUS, &status);
     if (!status) {
@@ -121,21 +160,87 @@ static gboolean spice_egl_init_shaders(SpiceDisplay *display, GError **err)
         goto end;
     }
 
-    d->egl.prog = glCreateProgram();
-    glAttachShader(d->egl.prog, fs);
-    glAttachShader(d->egl.prog, vs);
-    glLinkProgram(d->egl.prog);
-    glGetProgramiv(d->egl.prog, GL_LINK_STATUS, &status);
+    prog = glCreateProgram();
+    glAttachShader(prog, fs);
+    glAttachShader(prog, vs);
+    if (attr_pos != -1) {
+        glBindAttribLocation(prog, attr_pos, "position");
+    }
+    if (attr_tex != -1) {
+        glBindAttribLocation(prog, attr_tex, "texcoords");
+    }
+    glLinkProgram(prog);
+    glGetProgramiv(prog, GL_LINK_STATUS, &status);
     if (!status) {
-        glGetProgramInfoLog(d->egl.prog, sizeof(log), &len, log);
+        glGetProgramInfoLog(prog, sizeof(log), &len, log);
         g_set_error(err, SPICE_CLIENT_ERROR, SPICE_CLIENT_ERROR_FAILED,
                     "error linking shaders: %s", log);
+        glDeleteProgram(prog);
+        prog = 0;
         goto end;
     }
 
+    glDetachShader(prog, fs);
+    glDetachShader(prog, vs);
+
+end:
+    if (fs) {
+        glDeleteShader(fs);
+    }
+    if (vs) {
+        glDeleteShader(vs);
+    }
+
+    return prog;
+}
+
+/* the canvas program shares the vertex attributes of the main one */
+static void spice_egl_init_canvas16_shaders(SpiceDisplay *display)
+{
+    SpiceDisplayPrivate *d = display->priv;
+    GError *err = NULL;
+    GLint tex_loc;
+
+    d->egl.canvas_prog = spice_egl_compile_program(spice_egl_vertex_src,
+                                                   spice_egl_canvas16_fragment_src,
+                                                   d->egl.attr_pos, d->egl.attr_tex,
+                                                   &err);
+    if (!d->egl.canvas_prog) {
+        DISPLAY_DEBUG(display, "16 bits canvases will be converted by the CPU: %s",
+                      err->message);
+        g_clear_error(&err);
+        return;
+    }
+
+    glUseProgram(d->egl.canvas_prog);
+    tex_loc = glGetUniformLocation(d->egl.canvas_prog, "samp");
+    g_assert(tex_loc != -1);
+    d->egl.canvas_mproj = glGetUniformLocation(d->egl.canvas_prog, "mproj");
+    g_assert(d->egl.canvas_mproj != -1);
+    d->egl.canvas_green_bits = glGetUniformLocation(d->egl.canvas_prog, "green_bits");
+    g_assert(d->egl.canvas_green_bits != -1);
+
+    glUniform1i(tex_loc, 0);
+    glGenTextures(1, &d->egl.tex_canvas_id);
+}
+
+static gboolean spice_egl_init_shaders(SpiceDisplay *display, GError **err)
+{
+    SpiceDisplayPrivate *d = display->priv;
+    GLuint buf;
+    GLint tex_loc, prog;
+
+    glGetIntegerv(GL_CURRENT_PROGRAM, &prog);
+
+    d->egl.prog = spice_egl_compile_program(spice_egl_vertex_src,
+                                            spice_egl_fragment_src,
+                                            -1, -1, err);
+    if (!d->egl.prog) {
+        glUseProgram(prog);
+        return FALSE;
+    }
+
     glUseProgram(d->egl.prog);
-    glDetachShader(d->egl.prog, fs);
-    glDetachShader(d->egl.prog, vs);
 
     d->egl.attr_pos = glGetAttribLocation(d->egl.prog, "position");
     g_assert(d->egl.attr_pos != -1);
@@ -163,18 +268,10 @@ static gboolean spice_egl_init_shaders(SpiceDisplay *display, GError **err)
     glGenTextures(1, &d->egl.tex_id);
     glGenTextures(1, &d->egl.tex_pointer_id);
 
-    success = TRUE;
-
-end:
-    if (fs) {
-        glDeleteShader(fs);
-    }
-    if (vs) {
-        glDeleteShader(vs);
-    }
+    spice_egl_init_canvas16_shaders(display);
 
     glUseProgram(prog);
-    return success;
+    return TRUE;
 }
 
 G_GNUC_INTERNAL
@@ -390,6 +487,14 @@ void spice_egl_unrealize_display(SpiceDisplay *display)
         d->egl.tex_pointer_id = 0;
     }
 
+    if (d->egl.tex_canvas_id) {
+        glDeleteTextures(1, &d->egl.tex_canvas_id);
+        d->egl.tex_canvas_id = 0;
+        d->egl.canvas_width = 0;
+        d->egl.canvas_height = 0;
+    }
+    g_clear_pointer(&d->egl.canvas_damage, cairo_region_destroy);
+
     if (d->egl.vbuf_id) {
         glDeleteBuffers(1, &d->egl.vbuf_id);
         d->egl.vbuf_id = 0;
@@ -400,6 +505,11 @@ void spice_egl_unrealize_display(SpiceDisplay *display)
         d->egl.prog = 0;
     }
 
+    if (d->egl.canvas_prog) {
+        glDeleteProgram(d->egl.canvas_prog);
+        d->egl.canvas_prog = 0;
+    }
+
 #ifdef GDK_WINDOWING_X11
     if (GDK_IS_X11_DISPLAY(gdk_display_get_default())) {
         /* egl.surface && egl.ctx are only created on x11, see
@@ -438,6 +548,10 @@ void spice_egl_resize_display(SpiceDisplay *display, int w, int h)
 
     glUseProgram(d->egl.prog);
     apply_ortho(d->egl.mproj, 0, w, 0, h, -1, 1);
+    if (d->egl.canvas_prog) {
+        glUseProgram(d->egl.canvas_prog);
+        apply_ortho(d->egl.canvas_mproj, 0, w, 0, h, -1, 1);
+    }
     glViewport(0, 0, w, h);
 
     if (d->ready)
@@ -535,6 +649,8 @@ void spice_egl_update_display(SpiceDisplay *display)
     SpiceDisplayPrivate *d = display->priv;
     double s;
     int x, y, w, h;
+    guint32 width, height;
+    gboolean y0top;
     gdouble tx, ty, tw, th;
     int prog;
 
@@ -547,10 +663,21 @@ void spice_egl_update_display(SpiceDisplay *display)
     glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
     glClear(GL_COLOR_BUFFER_BIT);
 
-    tx = (gdouble) d->area.x / d->egl.scanout.width;
-    ty = (gdouble) d->area.y / d->egl.scanout.height;
-    tw = (gdouble) d->area.width / d->egl.scanout.width;
-    th = (gdouble) d->area.height / d->egl.scanout.height;
+    /* the canvas is uploaded top row first, like a y0top scanout */
+    if (d->egl.canvas) {
+        width = d->egl.canvas_width;
+        height = d->egl.canvas_height;
+        y0top = TRUE;
+    } else {
+        width = d->egl.scanout.width;
+        height = d->egl.scanout.height;
+        y0top = d->egl.scanout.y0top;
+    }
+
+    tx = (gdouble) d->area.x / width;
+    ty = (gdouble) d->area.y / height;
+    tw = (gdouble) d->area.width / width;
+    th = (gdouble) d->area.height / height;
 
     /* convert to opengl coordinates, 0 is bottom, 1 is top. ty should
      * be the bottom of the area, since th is upward */
@@ -567,23 +694,37 @@ void spice_egl_update_display(SpiceDisplay *display)
 
 
     /* if the scanout is inverted, then invert coordinates and direction too */
-    if (!d->egl.scanout.y0top) {
+    if (!y0top) {
         ty = 1 - ty;
         th = -1 * th;
     }
     DISPLAY_DEBUG(display, "update %f +%d+%d %dx%d +%f+%f %fx%f", s, x, y, w, h,
                   tx, ty, tw, th);
-    glBindTexture(GL_TEXTURE_2D, d->egl.tex_id);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-    glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, (GLeglImageOES)d->egl.image);
 
     glDisable(GL_BLEND);
     glGetIntegerv(GL_CURRENT_PROGRAM, &prog);
-    glUseProgram(d->egl.prog);
+    if (d->egl.canvas) {
+        spice_egl_canvas_upload(display);
+        glBindTexture(GL_TEXTURE_2D, d->egl.tex_canvas_id);
+        if (d->canvas.format == SPICE_SURFACE_FMT_16_555 ||
+            d->canvas.format == SPICE_SURFACE_FMT_16_565) {
+            glUseProgram(d->egl.canvas_prog);
+            glUniform1i(d->egl.canvas_green_bits,
+                        d->canvas.format == SPICE_SURFACE_FMT_16_565 ? 6 : 5);
+        } else {
+            glUseProgram(d->egl.prog);
+        }
+    } else {
+        glBindTexture(GL_TEXTURE_2D, d->egl.tex_id);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+        glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, (GLeglImageOES)d->egl.image);
+        glUseProgram(d->egl.prog);
+    }
     client_draw_rect_tex(display, x, y, w, h,
                          tx, ty, tw, th);
+    glUseProgram(d->egl.prog);
 
     if (d->mouse_mode == SPICE_MOUSE_MODE_SERVER &&
         d->mouse_guest_x != -1 && d->mouse_guest_y != -1 &&
@@ -671,3 +812,89 @@ gboolean spice_egl_update_scanout(SpiceDisplay *display,
 
     return TRUE;
 }
+
+/* r is in canvas coordinates, the whole monitor area if it is NULL */
+G_GNUC_INTERNAL
+void spice_egl_canvas_invalidate(SpiceDisplay *display, const GdkRectangle *r)
+{
+    SpiceDisplayPrivate *d = display->priv;
+
+    if (d->egl.canvas_damage == NULL)
+        d->egl.canvas_damage = cairo_region_create();
+
+    cairo_region_union_rectangle(d->egl.canvas_damage, r ? r : &d->area);
+}
+
+/* beyond that, the extents of the damage are uploaded at once */
+#define CANVAS_MAX_UPLOAD_RECTS 32
+
+/*
+ * Applies the damage collected since the last frame to the canvas
+ * texture, which keeps the primary surface across frames.
+ */
+static void spice_egl_canvas_upload(SpiceDisplay *display)
+{
+    SpiceDisplayPrivate *d = display->priv;
+    gboolean bpp16 = d->canvas.format == SPICE_SURFACE_FMT_16_555 ||
+                     d->canvas.format == SPICE_SURFACE_FMT_16_565;
+    int bpp = bpp16 ? 2 : 4;
+    cairo_rectangle_int_t rect;
+    int i, n;
+
+    if (d->canvas.data_origin == NULL)
+        return;
+
+    glBindTexture(GL_TEXTURE_2D, d->egl.tex_canvas_id);
+    if (d->egl.canvas_width != d->canvas.width ||
+        d->egl.canvas_height != d->canvas.height ||
+        d->egl.canvas_format != d->canvas.format) {
+        if (bpp16) {
+            /* integer textures can't be filtered */
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_R16UI,
+                         d->canvas.width, d->canvas.height, 0,
+                         GL_RED_INTEGER, GL_UNSIGNED_SHORT, NULL);
+        } else {
+            /* no alpha, the canvas is opaque whatever the x of xRGB holds */
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8,
+                         d->canvas.width, d->canvas.height, 0,
+                         GL_BGRA, GL_UNSIGNED_BYTE, NULL);
+        }
+        d->egl.canvas_width = d->canvas.width;
+        d->egl.canvas_height = d->canvas.height;
+        d->egl.canvas_format = d->canvas.format;
+        spice_egl_canvas_invalidate(display, NULL);
+    }
+
+    if (d->egl.canvas_damage == NULL || cairo_region_is_empty(d->egl.canvas_damage)) {
+        glBindTexture(GL_TEXTURE_2D, 0);
+        return;
+    }
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, bpp);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, d->canvas.stride / bpp);
+    n = cairo_region_num_rectangles(d->egl.canvas_damage);
+    for (i = 0; i < n; i++) {
+        const guint8 *src = d->canvas.data_origin;
+
+        if (n > CANVAS_MAX_UPLOAD_RECTS) {
+            cairo_region_get_extents(d->egl.canvas_damage, &rect);
+            n = 0;
+        } else {
+            cairo_region_get_rectangle(d->egl.canvas_damage, i, &rect);
+        }
+
+        src += rect.y * d->canvas.stride + rect.x * bpp;
+        glTexSubImage2D(GL_TEXTURE_2D, 0, rect.x, rect.y, rect.width, rect.height,
+                        bpp16 ? GL_RED_INTEGER : GL_BGRA,
+                        bpp16 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_BYTE, src);
+    }
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    g_clear_pointer(&d->egl.canvas_damage, cairo_region_destroy);
+}
@@ -149,10 +149,20 @@ struct _SpiceDisplayPrivate {
         EGLImageKHR         image;
         gboolean            call_draw_done;
         SpiceGlScanout      scanout;
+        /* software canvases drawn with GL, see SPICE_GL_CANVAS */
+        gboolean            canvas_allowed;
+        gboolean            canvas;
+        guint               canvas_prog; /* expands 16 bits canvases */
+        gint                canvas_mproj, canvas_green_bits;
+        guint               tex_canvas_id;
+        gint                canvas_width, canvas_height;
+        enum SpiceSurfaceFmt canvas_format;
+        cairo_region_t      *canvas_damage;
     } egl;
 #endif // HAVE_EGL
     double scroll_delta_y;
     GWeakRef overlay_weak_ref;
+    guint present_tick_id;
 };
 
 int      spice_cairo_image_create                 (SpiceDisplay *display);
@@ -170,6 +180,7 @@ gboolean spice_egl_update_scanout            (SpiceDisplay *display,
                                               const SpiceGlScanout *scanout,
                                               GError **err);
 void     spice_egl_cursor_set                (SpiceDisplay *display);
+void     spice_egl_canvas_invalidate         (SpiceDisplay *display, const GdkRectangle *r);
 
 #ifdef HAVE_EGL
 void     spice_display_widget_gl_scanout     (SpiceDisplay *display);
@@ -56,6 +56,7 @@
 #include "vncdisplaykeymap.h"
 #include "spice-grabsequence-priv.h"
 #include "spice-util-priv.h"
+#include "color-convert.h"
 
 
 /**
@@ -670,6 +671,7 @@ static void spice_display_init(SpiceDisplay *display)
     gtk_stack_set_visible_child(d->stack, area);
 
 #if HAVE_EGL
+    d->egl.canvas_allowed = g_getenv("SPICE_GL_CANVAS") != NULL;
     area = gtk_gl_area_new();
     gtk_gl_area_set_required_version(GTK_GL_AREA(area), 3, 2);
     gtk_gl_area_set_auto_render(GTK_GL_AREA(area), false);
@@ -1406,26 +1408,12 @@ static void recalc_geometry(GtkWidget *widget)
 
 /* ---------------------------------------------------------------- */
 
-#define CONVERT_0565_TO_0888(s)                                         \
-    (((((s) << 3) & 0xf8) | (((s) >> 2) & 0x7)) |                       \
-     ((((s) << 5) & 0xfc00) | (((s) >> 1) & 0x300)) |                   \
-     ((((s) << 8) & 0xf80000) | (((s) << 3) & 0x70000)))
-
-#define CONVERT_0565_TO_8888(s) (CONVERT_0565_TO_0888(s) | 0xff000000)
-
-#define CONVERT_0555_TO_0888(s)                                         \
-    (((((s) & 0x001f) << 3) | (((s) & 0x001c) >> 2)) |                  \
-     ((((s) & 0x03e0) << 6) | (((s) & 0x0380) << 1)) |                  \
-     ((((s) & 0x7c00) << 9) | ((((s) & 0x7000)) << 4)))
-
-#define CONVERT_0555_TO_8888(s) (CONVERT_0555_TO_0888(s) | 0xff000000)
-
 static gboolean do_color_convert(SpiceDisplay *display, GdkRectangle *r)
 {
     SpiceDisplayPrivate *d = display->priv;
     guint32 *dest = d->canvas.data;
     guint16 *src = d->canvas.data_origin;
-    gint x, y;
+    gint y;
 
     g_return_val_if_fail(r != NULL, false);
     g_return_val_if_fail(d->canvas.format == SPICE_SURFACE_FMT_16_555 ||
@@ -1434,37 +1422,25 @@ static gboolean do_color_convert(SpiceDisplay *display, GdkRectangle *r)
     src += (d->canvas.stride / 2) * r->y + r->x;
     dest += d->area.width * (r->y - d->area.y) + (r->x - d->area.x);
 
-    if (d->canvas.format == SPICE_SURFACE_FMT_16_555) {
-        for (y = 0; y < r->height; y++) {
-            for (x = 0; x < r->width; x++) {
-                dest[x] = CONVERT_0555_TO_0888(src[x]);
-            }
-
-            dest += d->area.width;
-            src += d->canvas.stride / 2;
+    for (y = 0; y < r->height; y++) {
+        if (d->canvas.format == SPICE_SURFACE_FMT_16_555) {
+            color_convert_0555_to_0888(src, dest, r->width);
+        } else {
+            color_convert_0565_to_0888(src, dest, r->width);
         }
-    } else if (d->canvas.format == SPICE_SURFACE_FMT_16_565) {
-        for (y = 0; y < r->height; y++) {
-            for (x = 0; x < r->width; x++) {
-                dest[x] = CONVERT_0565_TO_0888(src[x]);
-            }
 
-            dest += d->area.width;
-            src += d->canvas.stride / 2;
-        }
+        dest += d->area.width;
+        src += d->canvas.stride / 2;
     }
 
     return true;
 }
 
 #if HAVE_EGL
-static void set_egl_enabled(SpiceDisplay *display, bool enabled)
+static void set_gl_area_visible(SpiceDisplay *display, bool visible)
 {
     SpiceDisplayPrivate *d = display->priv;
 
-    if (egl_enabled(d) == enabled)
-        return;
-
 #ifdef GDK_WINDOWING_X11
     if (GDK_IS_X11_DISPLAY(gdk_display_get_default())) {
         /* even though the function is marked as deprecated, it's the
@@ -1472,22 +1448,126 @@ static void set_egl_enabled(SpiceDisplay *display, bool enabled)
          * resized. */
         GtkWidget *area = gtk_stack_get_child_by_name(d->stack, "draw-area");
         G_GNUC_BEGIN_IGNORE_DEPRECATIONS
-        gtk_widget_set_double_buffered(GTK_WIDGET(area), !enabled);
+        gtk_widget_set_double_buffered(GTK_WIDGET(area), !visible);
         G_GNUC_END_IGNORE_DEPRECATIONS
     } else
 #endif
     {
         gtk_stack_set_visible_child_name(d->stack,
-                                         enabled ? "gl-area" : "draw-area");
+                                         visible ? "gl-area" : "draw-area");
     }
 
-    if (enabled && d->egl.context_ready) {
+    if (visible && d->egl.context_ready) {
         gint scale_factor = gtk_widget_get_scale_factor(GTK_WIDGET(display));
         spice_egl_resize_display(display, d->ww * scale_factor, d->wh * scale_factor);
     }
+}
+
+static void set_egl_enabled(SpiceDisplay *display, bool enabled)
+{
+    SpiceDisplayPrivate *d = display->priv;
+
+    if (egl_enabled(d) == enabled)
+        return;
+
+    /* the GL area stays visible when it draws the canvas */
+    if (!d->egl.canvas)
+        set_gl_area_visible(display, enabled);
 
     d->egl.enabled = enabled;
 }
+
+/* on X11, EGL draws directly on the window of the drawing area */
+static void egl_init_draw_area(SpiceDisplay *display)
+{
+#ifdef GDK_WINDOWING_X11
+    SpiceDisplayPrivate *d = display->priv;
+    GtkWidget *area = gtk_stack_get_child_by_name(d->stack, "draw-area");
+    GError *err = NULL;
+
+    if (GDK_IS_X11_DISPLAY(gdk_display_get_default()) &&
+        !d->egl.context_ready &&
+        gtk_widget_get_realized(area)) {
+        if (!spice_egl_init(display, &err)) {
+            g_critical("egl init failed: %s", err->message);
+            g_clear_error(&err);
+        }
+
+        if (!spice_egl_realize_display(display, gtk_widget_get_window(area), &err)) {
+            g_critical("egl realize failed: %s", err->message);
+            g_clear_error(&err);
+        }
+
+        gint scale_factor = gtk_widget_get_scale_factor(GTK_WIDGET(display));
+        spice_egl_resize_display(display, d->ww * scale_factor, d->wh * scale_factor);
+    }
+#endif
+}
+
+/*
+ * With SPICE_GL_CANVAS set, software canvases are kept in a texture
+ * updated with the invalidated rectangles and scaled by the GPU, 16 bits
+ * ones being expanded by a shader instead of converted by the CPU.
+ */
+static bool egl_canvas_enable(SpiceDisplay *display)
+{
+    SpiceDisplayPrivate *d = display->priv;
+    bool bpp16 = d->canvas.format == SPICE_SURFACE_FMT_16_555 ||
+                 d->canvas.format == SPICE_SURFACE_FMT_16_565;
+
+    if (!d->egl.canvas_allowed || egl_enabled(d) ||
+        (!bpp16 &&
+         d->canvas.format != SPICE_SURFACE_FMT_32_xRGB &&
+         d->canvas.format != SPICE_SURFACE_FMT_32_ARGB))
+        return false;
+
+    if (!d->egl.context_ready) {
+#ifdef GDK_WINDOWING_X11
+        if (GDK_IS_X11_DISPLAY(gdk_display_get_default())) {
+            egl_init_draw_area(display);
+        } else
+#endif
+        {
+            /* the context is created when the GL area is realized */
+            gtk_widget_realize(gtk_stack_get_child_by_name(d->stack, "gl-area"));
+        }
+    }
+
+    if (!d->egl.context_ready || (bpp16 && d->egl.canvas_prog == 0))
+        return false;
+
+    d->egl.canvas = TRUE;
+    spice_egl_canvas_invalidate(display, NULL);
+    set_gl_area_visible(display, true);
+
+    return true;
+}
+
+static void egl_canvas_disable(SpiceDisplay *display)
+{
+    SpiceDisplayPrivate *d = display->priv;
+
+    if (!d->egl.canvas)
+        return;
+
+    d->egl.canvas = FALSE;
+    if (!egl_enabled(d))
+        set_gl_area_visible(display, false);
+}
+
+/* returns true if the canvas is redrawn by the GL area */
+static bool egl_canvas_queue_render(SpiceDisplay *display)
+{
+    SpiceDisplayPrivate *d = display->priv;
+    GtkWidget *gl = gtk_stack_get_child_by_name(d->stack, "gl-area");
+
+    if (!d->egl.canvas || gtk_stack_get_visible_child(d->stack) != gl)
+        return false;
+
+    gtk_gl_area_queue_render(GTK_GL_AREA(gl));
+
+    return true;
+}
 #endif
 
 static gboolean draw_event(GtkWidget *widget, cairo_t *cr, gpointer data)
@@ -1497,7 +1577,7 @@ static gboolean draw_event(GtkWidget *widget, cairo_t *cr, gpointer data)
     g_return_val_if_fail(d != NULL, false);
 
 #if HAVE_EGL
-    if (egl_enabled(d) &&
+    if ((egl_enabled(d) || d->egl.canvas) &&
         g_str_equal(gtk_stack_get_visible_child_name(d->stack), "draw-area")) {
         spice_egl_update_display(display);
         return false;
@@ -2304,7 +2384,7 @@ static void size_allocate(GtkWidget *widget, GtkAllocation *conf, gpointer data)
         d->wh = conf->height;
         recalc_geometry(widget);
 #if HAVE_EGL
-        if (egl_enabled(d)) {
+        if (egl_enabled(d) || d->egl.canvas) {
             gint scale_factor = gtk_widget_get_scale_factor(widget);
             spice_egl_resize_display(display, conf->width * scale_factor, conf->height * scale_factor);
         }
@@ -2328,11 +2408,54 @@ static void update_image(SpiceDisplay *display)
 {
     SpiceDisplayPrivate *d = display->priv;
 
+#if HAVE_EGL
+    if (egl_canvas_enable(display))
+        return;
+    egl_canvas_disable(display);
+#endif
+
     spice_cairo_image_create(display);
     if (d->canvas.convert)
         do_color_convert(display, &d->area);
 }
 
+static gboolean present_tick(GtkWidget *widget, GdkFrameClock *clock, gpointer data)
+{
+    SpiceDisplay *display = SPICE_DISPLAY(widget);
+
+    spice_display_channel_present(display->priv->display);
+
+    return G_SOURCE_CONTINUE;
+}
+
+/* Presents the video stream frames on the frame clock ticks, which only
+ * run while there are streams to avoid needless wakeups. */
+static void update_paced_presentation(SpiceDisplay *display, gboolean paced)
+{
+    SpiceDisplayPrivate *d = display->priv;
+    guint n_streams = 0;
+
+    if (d->display == NULL)
+        return;
+
+    g_object_set(d->display, "paced-presentation", paced, NULL);
+    if (paced)
+        g_object_get(d->display, "n-video-streams", &n_streams, NULL);
+
+    if (n_streams > 0 && d->present_tick_id == 0) {
+        d->present_tick_id = gtk_widget_add_tick_callback(GTK_WIDGET(display),
+                                                          present_tick, NULL, NULL);
+    } else if (n_streams == 0 && d->present_tick_id != 0) {
+        gtk_widget_remove_tick_callback(GTK_WIDGET(display), d->present_tick_id);
+        d->present_tick_id = 0;
+    }
+}
+
+static void n_video_streams_changed(SpiceDisplay *display)
+{
+    update_paced_presentation(display, gtk_widget_get_realized(GTK_WIDGET(display)));
+}
+
 static void realize(GtkWidget *widget)
 {
     SpiceDisplay *display = SPICE_DISPLAY(widget);
@@ -2345,12 +2468,14 @@ static void realize(GtkWidget *widget)
                                            &d->keycode_maplen);
 
     update_image(display);
+    update_paced_presentation(display, TRUE);
 }
 
 static void unrealize(GtkWidget *widget)
 {
     SpiceDisplay *display = SPICE_DISPLAY(widget);
 
+    update_paced_presentation(display, FALSE);
     spice_cairo_image_destroy(display);
 #if HAVE_EGL
     if (display->priv->egl.context_ready) {
@@ -2934,21 +3059,17 @@ static gboolean set_overlay(SpiceChannel *channel, void* pipeline_ptr, SpiceDisp
     return false;
 }
 
-static void invalidate(SpiceChannel *channel,
-                       gint x, gint y, gint w, gint h, gpointer data)
+static void invalidate_region(SpiceChannel *channel,
+                              const SpiceDisplayRect *rects, guint n_rects,
+                              gpointer data)
 {
     SpiceDisplay *display = data;
     SpiceDisplayPrivate *d = display->priv;
+    cairo_region_t *region;
     int display_x, display_y;
-    int x1, y1, x2, y2;
     double s;
     gint scale_factor;
-    GdkRectangle rect = {
-        .x = x,
-        .y = y,
-        .width = w,
-        .height = h
-    };
+    guint i;
 
 #if HAVE_EGL
     set_egl_enabled(display, false);
@@ -2957,12 +3078,6 @@ static void invalidate(SpiceChannel *channel,
     if (!gtk_widget_get_window(GTK_WIDGET(display)))
         return;
 
-    if (!gdk_rectangle_intersect(&rect, &d->area, &rect))
-        return;
-
-    if (d->canvas.convert)
-        do_color_convert(display, &rect);
-
     scale_factor = gtk_widget_get_scale_factor(GTK_WIDGET(display));
     spice_display_get_scaling(display, &s,
                               &display_x, &display_y,
@@ -2970,21 +3085,65 @@ static void invalidate(SpiceChannel *channel,
     display_x /= scale_factor;
     display_y /= scale_factor;
 
-    if (s * scale_factor > 1) {
-        rect.x -= 1;
-        rect.y -= 1;
-        rect.width += 2;
-        rect.height += 2;
+    region = cairo_region_create();
+    for (i = 0; i < n_rects; i++) {
+        int x1, y1, x2, y2;
+        GdkRectangle rect = {
+            .x = rects[i].x,
+            .y = rects[i].y,
+            .width = rects[i].width,
+            .height = rects[i].height
+        };
+
+        if (!gdk_rectangle_intersect(&rect, &d->area, &rect))
+            continue;
+
+#if HAVE_EGL
+        if (d->egl.canvas) {
+            spice_egl_canvas_invalidate(display, &rect);
+        } else
+#endif
+        if (d->canvas.convert)
+            do_color_convert(display, &rect);
+
+        if (s * scale_factor > 1) {
+            rect.x -= 1;
+            rect.y -= 1;
+            rect.width += 2;
+            rect.height += 2;
+        }
+
+        x1 = floor ((rect.x - d->area.x) * s) / scale_factor;
+        y1 = floor ((rect.y - d->area.y) * s) / scale_factor;
+        x2 = ceil ((rect.x - d->area.x + rect.width) * s) / scale_factor;
+        y2 = ceil ((rect.y - d->area.y + rect.height) * s) / scale_factor;
+
+        cairo_region_union_rectangle(region, &(cairo_rectangle_int_t) {
+            .x = display_x + x1,
+            .y = display_y + y1,
+            .width = x2 - x1,
+            .height = y2 - y1
+        });
+    }
+
+#if HAVE_EGL
+    if (!cairo_region_is_empty(region) && d->egl.canvas &&
+        egl_canvas_queue_render(display)) {
+        cairo_region_destroy(region);
+        return;
     }
+#endif
 
-    x1 = floor ((rect.x - d->area.x) * s) / scale_factor;
-    y1 = floor ((rect.y - d->area.y) * s) / scale_factor;
-    x2 = ceil ((rect.x - d->area.x + rect.width) * s) / scale_factor;
-    y2 = ceil ((rect.y - d->area.y + rect.height) * s) / scale_factor;
+    if (!gtk_widget_get_has_window(GTK_WIDGET(display))) {
+        GtkAllocation allocation;
 
-    queue_draw_area(display,
-                    display_x + x1, display_y + y1,
-                    x2 - x1, y2 - y1);
+        gtk_widget_get_allocation(GTK_WIDGET(display), &allocation);
+        cairo_region_translate(region, allocation.x, allocation.y);
+    }
+
+    /* a single redraw for all the rectangles updated together */
+    gtk_widget_queue_draw_region(GTK_WIDGET(display), region);
+    cairo_region_destroy(region);
 }
 
 static void mark(SpiceDisplay *display, gint mark)
@@ -3095,7 +3254,7 @@ static void update_mouse_cursor(SpiceDisplay *display)
                                          hotspot_y);
 
 #if HAVE_EGL
-    if (egl_enabled(d))
+    if (egl_enabled(d) || d->egl.canvas)
         spice_egl_cursor_set(display);
 #endif
     if (d->show_cursor) {
@@ -3207,6 +3366,11 @@ static void cursor_invalidate(SpiceDisplay *display)
     if (!d->ready || !d->monitor_ready)
         return;
 
+#if HAVE_EGL
+    if (egl_canvas_queue_render(display))
+        return;
+#endif
+
     spice_display_get_scaling(display, &s, &x, &y, NULL, NULL);
     scale_factor = gtk_widget_get_scale_factor(GTK_WIDGET(display));
 
@@ -3284,27 +3448,10 @@ void spice_display_widget_gl_scanout(SpiceDisplay *display)
 
     DISPLAY_DEBUG(display, "%s: got scanout",  __FUNCTION__);
 
-#ifdef GDK_WINDOWING_X11
-    GtkWidget *area = gtk_stack_get_child_by_name(d->stack, "draw-area");
-
-    if (GDK_IS_X11_DISPLAY(gdk_display_get_default()) &&
-        !d->egl.context_ready &&
-        gtk_widget_get_realized(area)) {
-        if (!spice_egl_init(display, &err)) {
-            g_critical("egl init failed: %s", err->message);
-            g_clear_error(&err);
-        }
-
-        if (!spice_egl_realize_display(display, gtk_widget_get_window(area), &err)) {
-            g_critical("egl realize failed: %s", err->message);
-            g_clear_error(&err);
-        }
-
-        gint scale_factor = gtk_widget_get_scale_factor(GTK_WIDGET(display));
-        spice_egl_resize_display(display, d->ww * scale_factor, d->wh * scale_factor);
-    }
-#endif
+    egl_init_draw_area(display);
 
+    /* the scanout replaces the canvas */
+    d->egl.canvas = FALSE;
     set_egl_enabled(display, true);
 
     if (d->egl.context_ready) {
@@ -3383,8 +3530,8 @@ static void channel_new(SpiceSession *s, SpiceChannel *channel, SpiceDisplay *di
                                       G_CALLBACK(primary_create), display, 0);
         spice_g_signal_connect_object(channel, "display-primary-destroy",
                                       G_CALLBACK(primary_destroy), display, 0);
-        spice_g_signal_connect_object(channel, "display-invalidate",
-                                      G_CALLBACK(invalidate), display, 0);
+        spice_g_signal_connect_object(channel, "invalidate-region",
+                                      G_CALLBACK(invalidate_region), display, 0);
         spice_g_signal_connect_object(channel, "display-mark",
                                       G_CALLBACK(mark), display, G_CONNECT_AFTER | G_CONNECT_SWAPPED);
         spice_g_signal_connect_object(channel, "notify::monitors",
@@ -3392,6 +3539,10 @@ static void channel_new(SpiceSession *s, SpiceChannel *channel, SpiceDisplay *di
                                       display, G_CONNECT_AFTER | G_CONNECT_SWAPPED);
         spice_g_signal_connect_object(channel, "gst-video-overlay",
                                       G_CALLBACK(set_overlay), display, G_CONNECT_AFTER);
+        spice_g_signal_connect_object(channel, "notify::n-video-streams",
+                                      G_CALLBACK(n_video_streams_changed),
+                                      display, G_CONNECT_SWAPPED);
+        n_video_streams_changed(display);
         if (spice_display_channel_get_primary(channel, 0, &primary)) {
             primary_create(channel, primary.format, primary.width, primary.height,
                            primary.stride, primary.shmid, primary.data, display);
@@ -3471,6 +3622,7 @@ static void channel_destroy(SpiceSession *s, SpiceChannel *channel, SpiceDisplay
         if (id != d->channel_id)
             return;
         primary_destroy(d->display, display);
+        update_paced_presentation(display, FALSE);
         d->display = NULL;
         return;
     }
@@ -3600,24 +3752,43 @@ GdkPixbuf *spice_display_get_pixbuf(SpiceDisplay *display)
 #endif
     {
         guchar *src, *dest;
+        guint32 *row = NULL;
         int x, y;
 
         /* TODO: ensure d->data has been exposed? */
-        g_return_val_if_fail(d->canvas.data != NULL, NULL);
+        g_return_val_if_fail(d->canvas.data_origin != NULL, NULL);
         data = g_malloc0(d->area.width * d->area.height * 3);
-        src = d->canvas.data;
+        src = d->canvas.data_origin;
         dest = data;
 
-        src += d->area.y * d->canvas.stride + d->area.x * 4;
+        /* 16 bits canvases are read from the surface, they may not be
+         * converted when drawn with GL */
+        if (d->canvas.format == SPICE_SURFACE_FMT_16_555 ||
+            d->canvas.format == SPICE_SURFACE_FMT_16_565) {
+            row = g_new(guint32, d->area.width);
+            src += d->area.y * d->canvas.stride + d->area.x * 2;
+        } else {
+            src += d->area.y * d->canvas.stride + d->area.x * 4;
+        }
         for (y = 0; y < d->area.height; ++y) {
+            const guchar *pixels = src;
+
+            if (d->canvas.format == SPICE_SURFACE_FMT_16_555) {
+                color_convert_0555_to_0888((const guint16 *)src, row, d->area.width);
+                pixels = (const guchar *)row;
+            } else if (d->canvas.format == SPICE_SURFACE_FMT_16_565) {
+                color_convert_0565_to_0888((const guint16 *)src, row, d->area.width);
+                pixels = (const guchar *)row;
+            }
             for (x = 0; x < d->area.width; ++x) {
-                dest[0] = src[x * 4 + 2];
-                dest[1] = src[x * 4 + 1];
-                dest[2] = src[x * 4 + 0];
+                dest[0] = pixels[x * 4 + 2];
+                dest[1] = pixels[x * 4 + 1];
+                dest[2] = pixels[x * 4 + 0];
                 dest += 3;
             }
             src += d->canvas.stride;
         }
+        g_free(row);
         pixbuf = gdk_pixbuf_new_from_data(data, GDK_COLORSPACE_RGB, false,
                                           8, d->area.width, d->area.height,
                                           d->area.width * 3,
@@ -0,0 +1,163 @@
+/*
+ * Compares the display caches with the GHashTable based implementation
+ * they replaced, on an operation mix modelled after pixmap cache traces:
+ * mostly lookups of recently used images, with the server adding new
+ * images and invalidating old ones at a steady rate.
+ */
+#include <glib.h>
+
+#include "spice-channel-cache.h"
+
+enum {
+    OP_FIND,
+    OP_ADD,
+    OP_REMOVE,
+};
+
+typedef struct {
+    guint8 op;
+    guint64 id;
+} TraceOp;
+
+/* the replaced implementation, boxing each key in a heap item */
+typedef struct {
+    guint64 id;
+    gboolean lossy;
+    guint32 ref_count;
+} LegacyItem;
+
+static void legacy_add(GHashTable *table, guint64 id, gpointer value)
+{
+    LegacyItem *item = g_new(LegacyItem, 1);
+    LegacyItem *current;
+    gpointer current_value;
+
+    item->id = id;
+    item->lossy = FALSE;
+    item->ref_count = 1;
+    if (g_hash_table_lookup_extended(table, &id, (gpointer *)&current, &current_value))
+        item->ref_count = current->ref_count + 1;
+    g_hash_table_replace(table, item, value);
+}
+
+static void legacy_remove(GHashTable *table, guint64 id)
+{
+    LegacyItem *item;
+    gpointer value;
+
+    if (g_hash_table_lookup_extended(table, &id, (gpointer *)&item, &value)) {
+        if (--item->ref_count == 0)
+            g_hash_table_remove(table, &id);
+    }
+}
+
+/* keeps the lookups from being optimized out */
+static volatile guint lookups_found;
+
+static TraceOp *make_trace(guint n_ops, guint working_set, guint find_pct, guint remove_pct)
+{
+    TraceOp *trace = g_new(TraceOp, n_ops);
+    GRand *rand = g_rand_new_with_seed(42);
+    guint64 next_id = 1;
+    guint i;
+
+    for (i = 0; i < n_ops; i++) {
+        guint r = g_rand_int_range(rand, 0, 100);
+        /* recently added images are the most likely to be used */
+        guint64 back = (guint64)(working_set * g_rand_double(rand) * g_rand_double(rand));
+        guint64 id = next_id > back ? next_id - back : 1;
+
+        if (r < find_pct) {
+            trace[i].op = OP_FIND;
+        } else if (r < find_pct + remove_pct) {
+            trace[i].op = OP_REMOVE;
+            id = next_id > working_set ? next_id - working_set : 1;
+        } else {
+            trace[i].op = OP_ADD;
+            id = next_id++;
+        }
+        /* ids sent by the server are not small sequential integers */
+        trace[i].id = id * G_GUINT64_CONSTANT(0x100000001b3) ^ G_GUINT64_CONSTANT(0xcbf29ce484222325);
+    }
+    g_rand_free(rand);
+
+    return trace;
+}
+
+static gdouble run_cache(const TraceOp *trace, guint n_ops)
+{
+    display_cache *cache = cache_image_new(NULL);
+    gint64 start = g_get_monotonic_time();
+    guint i, found = 0;
+
+    for (i = 0; i < n_ops; i++) {
+        switch (trace[i].op) {
+        case OP_FIND:
+            found += cache_find(cache, trace[i].id) != NULL;
+            break;
+        case OP_ADD:
+            cache_add(cache, trace[i].id, GSIZE_TO_POINTER(i + 1));
+            break;
+        case OP_REMOVE:
+            cache_remove(cache, trace[i].id);
+            break;
+        }
+    }
+    cache_free(cache);
+    lookups_found += found;
+
+    return (g_get_monotonic_time() - start) / 1000.0;
+}
+
+static gdouble run_legacy(const TraceOp *trace, guint n_ops)
+{
+    GHashTable *table = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, NULL);
+    gint64 start = g_get_monotonic_time();
+    guint i, found = 0;
+
+    for (i = 0; i < n_ops; i++) {
+        switch (trace[i].op) {
+        case OP_FIND:
+            found += g_hash_table_lookup(table, &trace[i].id) != NULL;
+            break;
+        case OP_ADD:
+            legacy_add(table, trace[i].id, GSIZE_TO_POINTER(i + 1));
+            break;
+        case OP_REMOVE:
+            legacy_remove(table, trace[i].id);
+            break;
+        }
+    }
+    g_hash_table_unref(table);
+    lookups_found += found;
+
+    return (g_get_monotonic_time() - start) / 1000.0;
+}
+
+int main(int argc, char* argv[])
+{
+    static const struct {
+        const char *name;
+        guint find_pct;
+        guint remove_pct;
+    } mixes[] = {
+        { "lookup-heavy", 90, 5 },
+        { "steady", 70, 15 },
+        { "churn", 40, 30 },
+    };
+    const guint n_ops = 2000000;
+    const guint working_set = 4096;
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(mixes); i++) {
+        TraceOp *trace = make_trace(n_ops, working_set, mixes[i].find_pct, mixes[i].remove_pct);
+        gdouble legacy = run_legacy(trace, n_ops);
+        gdouble cache = run_cache(trace, n_ops);
+
+        g_print("%-13s ghashtable %8.2f ms, display_cache %8.2f ms (x%.2f)\n",
+                mixes[i].name, legacy, cache, legacy / cache);
+        g_free(trace);
+    }
+
+    return 0;
+}
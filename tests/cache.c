@@ -0,0 +1,165 @@
+#include <glib.h>
+
+#include "spice-channel-cache.h"
+
+static guint n_destroyed;
+
+static void value_destroy(gpointer value)
+{
+    n_destroyed++;
+}
+
+/* values are their own size, in bytes */
+static gsize value_size(gpointer value)
+{
+    return GPOINTER_TO_SIZE(value);
+}
+
+static void test_cache_refcount(void)
+{
+    display_cache *cache = cache_image_new(value_destroy);
+    gboolean lossy;
+
+    n_destroyed = 0;
+    cache_add(cache, 1, GSIZE_TO_POINTER(10));
+    cache_add(cache, 1, GSIZE_TO_POINTER(10));
+    g_assert_cmpuint(n_destroyed, ==, 1);
+
+    /* added twice, must be removed twice */
+    g_assert_true(cache_remove(cache, 1));
+    g_assert_nonnull(cache_find(cache, 1));
+    g_assert_true(cache_remove(cache, 1));
+    g_assert_null(cache_find(cache, 1));
+    g_assert_false(cache_remove(cache, 1));
+    g_assert_cmpuint(n_destroyed, ==, 2);
+
+    cache_add_lossy(cache, 2, GSIZE_TO_POINTER(20), TRUE);
+    g_assert_nonnull(cache_find_lossy(cache, 2, &lossy));
+    g_assert_true(lossy);
+    cache_replace_lossy(cache, 2, GSIZE_TO_POINTER(20), FALSE);
+    g_assert_nonnull(cache_find_lossy(cache, 2, &lossy));
+    g_assert_false(lossy);
+
+    cache_free(cache);
+    g_assert_cmpuint(n_destroyed, ==, 4);
+}
+
+static void collect_id(uint64_t id, gpointer value, gboolean lossy, gpointer user_data)
+{
+    GArray *ids = user_data;
+
+    g_array_append_val(ids, id);
+}
+
+static void test_cache_lru(void)
+{
+    display_cache *cache = cache_image_new(value_destroy);
+    display_cache_stats stats;
+    GArray *ids = g_array_new(FALSE, FALSE, sizeof(uint64_t));
+
+    n_destroyed = 0;
+    cache_set_size_func(cache, value_size);
+    cache_add(cache, 1, GSIZE_TO_POINTER(40));
+    cache_add(cache, 2, GSIZE_TO_POINTER(40));
+
+    /* 1 becomes the most recently used */
+    g_assert_nonnull(cache_find(cache, 1));
+    cache_add(cache, 3, GSIZE_TO_POINTER(40));
+    g_assert_null(cache_find(cache, 4));
+
+    /* nothing is evicted, whatever the accounted size */
+    cache_get_stats(cache, &stats);
+    g_assert_cmpuint(stats.bytes, ==, 120);
+    g_assert_cmpuint(stats.entries, ==, 3);
+    g_assert_cmpuint(stats.hits, ==, 1);
+    g_assert_cmpuint(stats.misses, ==, 1);
+    g_assert_cmpuint(n_destroyed, ==, 0);
+
+    /* least recently used first */
+    cache_foreach(cache, collect_id, ids);
+    g_assert_cmpuint(ids->len, ==, 3);
+    g_assert_cmpuint(g_array_index(ids, uint64_t, 0), ==, 2);
+    g_assert_cmpuint(g_array_index(ids, uint64_t, 1), ==, 1);
+    g_assert_cmpuint(g_array_index(ids, uint64_t, 2), ==, 3);
+    g_array_unref(ids);
+
+    g_assert_true(cache_remove(cache, 2));
+    cache_get_stats(cache, &stats);
+    g_assert_cmpuint(stats.bytes, ==, 80);
+
+    cache_clear(cache);
+    cache_get_stats(cache, &stats);
+    g_assert_cmpuint(stats.bytes, ==, 0);
+    g_assert_cmpuint(stats.entries, ==, 0);
+
+    cache_free(cache);
+}
+
+static void check_lru(display_cache *cache)
+{
+    guint32 i, prev = CACHE_NIL, n = 0;
+
+    for (i = cache->lru_head; i != CACHE_NIL; i = cache->slots[i].lru_next) {
+        g_assert_cmpuint(cache->slots[i].dist, !=, 0);
+        g_assert_cmpuint(cache->slots[i].lru_prev, ==, prev);
+        prev = i;
+        n++;
+    }
+    g_assert_cmpuint(cache->lru_tail, ==, prev);
+    g_assert_cmpuint(n, ==, cache->n_items);
+}
+
+/* random adds and removes, checked against a plain array */
+static void test_cache_random(void)
+{
+    enum { N_IDS = 2000, N_OPS = 200000 };
+    display_cache *cache = cache_new(NULL);
+    guint32 *expected = g_new0(guint32, N_IDS);
+    guint32 seed = 1, i, n = 0;
+
+    for (i = 0; i < N_OPS; i++) {
+        guint32 k, op;
+        guint64 id;
+
+        seed = seed * 1103515245 + 12345;
+        k = (seed >> 8) % N_IDS;
+        op = (seed >> 24) % 4;
+        /* spread the ids like the server ones */
+        id = (guint64)k * G_GUINT64_CONSTANT(0x9e3779b97f4a7c15);
+
+        if (op == 0) {
+            g_assert_cmpuint(cache_remove(cache, id), ==, expected[k] != 0);
+            n -= expected[k] != 0;
+            expected[k] = 0;
+        } else if (op == 1) {
+            n += expected[k] == 0;
+            expected[k] = i + 1;
+            cache_add(cache, id, GSIZE_TO_POINTER(i + 1));
+        } else {
+            g_assert_cmpuint(GPOINTER_TO_SIZE(cache_find(cache, id)), ==, expected[k]);
+        }
+        g_assert_cmpuint(cache->n_items, ==, n);
+        if (i % 1000 == 0)
+            check_lru(cache);
+    }
+
+    for (i = 0; i < N_IDS; i++) {
+        guint64 id = (guint64)i * G_GUINT64_CONSTANT(0x9e3779b97f4a7c15);
+        g_assert_cmpuint(GPOINTER_TO_SIZE(cache_find(cache, id)), ==, expected[i]);
+    }
+    check_lru(cache);
+
+    g_free(expected);
+    cache_free(cache);
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/cache/refcount", test_cache_refcount);
+    g_test_add_func("/cache/lru", test_cache_lru);
+    g_test_add_func("/cache/random", test_cache_random);
+
+    return g_test_run();
+}
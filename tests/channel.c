@@ -0,0 +1,213 @@
+#include <string.h>
+#include <glib.h>
+#include <spice-client.h>
+
+#ifdef G_OS_UNIX
+#include <unistd.h>
+#include <sys/socket.h>
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+
+/* a minimal display server on the other end of a socket pair */
+typedef struct {
+    int fd;
+    int passed_fd;
+} FakeServer;
+
+static void server_read(int fd, void *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = read(fd, data, len);
+
+        g_assert_cmpint(n, >, 0);
+        data = (guint8 *)data + n;
+        len -= n;
+    }
+}
+
+static void server_write(int fd, const void *data, size_t len)
+{
+    g_assert_cmpint(write(fd, data, len), ==, len);
+}
+
+static void server_link(FakeServer *server)
+{
+    SpiceLinkHeader header;
+    SpiceLinkReply reply = { 0, };
+    EVP_PKEY_CTX *ctx;
+    EVP_PKEY *key = NULL;
+    guint8 *pubkey = reply.pub_key;
+    guint8 *buffer;
+    guint32 result = GUINT32_TO_LE(SPICE_LINK_ERR_OK);
+
+    server_read(server->fd, &header, sizeof(header));
+    g_assert_cmpuint(header.magic, ==, SPICE_MAGIC);
+    buffer = g_malloc(GUINT32_FROM_LE(header.size));
+    server_read(server->fd, buffer, GUINT32_FROM_LE(header.size));
+    g_free(buffer);
+
+    /* the client encrypts the ticket with the key of the server */
+    ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL);
+    g_assert_nonnull(ctx);
+    g_assert_cmpint(EVP_PKEY_keygen_init(ctx), ==, 1);
+    g_assert_cmpint(EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, 1024), ==, 1);
+    g_assert_cmpint(EVP_PKEY_keygen(ctx, &key), ==, 1);
+    g_assert_cmpint(i2d_PUBKEY(key, &pubkey), ==, SPICE_TICKET_PUBKEY_BYTES);
+    EVP_PKEY_CTX_free(ctx);
+
+    /* no capabilities: spice ticket and full message headers */
+    reply.error = GUINT32_TO_LE(SPICE_LINK_ERR_OK);
+    reply.caps_offset = GUINT32_TO_LE(sizeof(reply));
+    header.magic = SPICE_MAGIC;
+    header.major_version = GUINT32_TO_LE(SPICE_VERSION_MAJOR);
+    header.minor_version = GUINT32_TO_LE(SPICE_VERSION_MINOR);
+    header.size = GUINT32_TO_LE(sizeof(reply));
+    server_write(server->fd, &header, sizeof(header));
+    server_write(server->fd, &reply, sizeof(reply));
+
+    buffer = g_malloc(EVP_PKEY_size(key));
+    server_read(server->fd, buffer, EVP_PKEY_size(key));
+    g_free(buffer);
+    EVP_PKEY_free(key);
+
+    server_write(server->fd, &result, sizeof(result));
+}
+
+static void server_send_msg(FakeServer *server, guint16 type,
+                            const guint32 *data, guint32 n_data)
+{
+    SpiceDataHeader header = {
+        .serial = GUINT64_TO_LE(1),
+        .type = GUINT16_TO_LE(type),
+        .size = GUINT32_TO_LE(n_data * sizeof(guint32)),
+        .sub_list = 0,
+    };
+    guint32 i;
+
+    server_write(server->fd, &header, sizeof(header));
+    for (i = 0; i < n_data; i++) {
+        guint32 le = GUINT32_TO_LE(data[i]);
+
+        server_write(server->fd, &le, sizeof(le));
+    }
+}
+
+static void server_send_fd(FakeServer *server, int fd)
+{
+    struct msghdr msg = { NULL, };
+    struct iovec iov;
+    union {
+        struct cmsghdr cmsg;
+        char control[CMSG_SPACE(sizeof(int))];
+    } msg_control;
+    struct cmsghdr *cmsg;
+    char c = 0;
+
+    iov.iov_base = &c;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = &msg_control;
+    msg.msg_controllen = sizeof(msg_control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    g_assert_cmpint(sendmsg(server->fd, &msg, 0), ==, 1);
+}
+
+static gpointer server_thread(gpointer data)
+{
+    FakeServer *server = data;
+    const guint32 scanout[] = { 64, 32, 256, 0x34325258 /* XR24 */, 0 };
+    const guint32 draw[] = { 1, 2, 3, 4 };
+
+    server_link(server);
+
+    /* the fd follows its message, and the next message comes right after */
+    server_send_msg(server, SPICE_MSG_DISPLAY_GL_SCANOUT_UNIX,
+                    scanout, G_N_ELEMENTS(scanout));
+    server_send_fd(server, server->passed_fd);
+    server_send_msg(server, SPICE_MSG_DISPLAY_GL_DRAW, draw, G_N_ELEMENTS(draw));
+
+    return NULL;
+}
+
+static void gl_draw(SpiceDisplayChannel *channel,
+                    guint32 x, guint32 y, guint32 w, guint32 h,
+                    gpointer user_data)
+{
+    GMainLoop *loop = user_data;
+
+    g_assert_cmpuint(x, ==, 1);
+    g_assert_cmpuint(y, ==, 2);
+    g_assert_cmpuint(w, ==, 3);
+    g_assert_cmpuint(h, ==, 4);
+    g_main_loop_quit(loop);
+}
+
+static gboolean timeout(gpointer user_data)
+{
+    g_assert_not_reached();
+    return G_SOURCE_REMOVE;
+}
+
+/* the messages are not read ahead past the byte carrying the fd */
+static void test_channel_unix_fd(void)
+{
+    GMainLoop *loop = g_main_loop_new(NULL, FALSE);
+    FakeServer server;
+    SpiceSession *session;
+    SpiceChannel *channel;
+    const SpiceGlScanout *scanout;
+    GThread *thread;
+    int sv[2], passed[2];
+    guint timeout_id;
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), ==, 0);
+    g_assert_cmpint(pipe(passed), ==, 0);
+    server.fd = sv[1];
+    server.passed_fd = passed[0];
+
+    session = spice_session_new();
+    g_object_set(session, "client-sockets", TRUE, NULL);
+    channel = spice_channel_new(session, SPICE_CHANNEL_DISPLAY, 0);
+    g_signal_connect(channel, "gl-draw", G_CALLBACK(gl_draw), loop);
+
+    thread = g_thread_new("fake-server", server_thread, &server);
+    g_assert_true(spice_channel_open_fd(channel, sv[0]));
+
+    timeout_id = g_timeout_add_seconds(10, timeout, NULL);
+    g_main_loop_run(loop);
+    g_source_remove(timeout_id);
+    g_thread_join(thread);
+
+    scanout = spice_display_channel_get_gl_scanout(SPICE_DISPLAY_CHANNEL(channel));
+    g_assert_nonnull(scanout);
+    g_assert_cmpint(scanout->fd, >=, 0);
+    g_assert_cmpuint(scanout->width, ==, 64);
+    g_assert_cmpuint(scanout->height, ==, 32);
+    g_assert_cmpuint(scanout->stride, ==, 256);
+
+    spice_session_disconnect(session);
+    g_object_unref(session);
+    close(sv[1]);
+    close(passed[0]);
+    close(passed[1]);
+    g_main_loop_unref(loop);
+}
+#endif
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+#ifdef G_OS_UNIX
+    g_test_add_func("/channel/unix-fd", test_channel_unix_fd);
+#endif
+
+    return g_test_run();
+}
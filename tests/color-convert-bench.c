@@ -0,0 +1,72 @@
+/*
+ * Measures the throughput of the conversion of 16 bits surfaces to the
+ * 32 bits the widget draws, for every kernel usable on this CPU, on a
+ * full screen update and on narrow damaged rectangles.
+ */
+#include <glib.h>
+
+#include "color-convert.h"
+
+int main(int argc, char* argv[])
+{
+    static const struct {
+        const char *name;
+        int width;
+        int height;
+    } areas[] = {
+        { "1920x1080", 1920, 1080 },
+        { "64x64", 64, 64 },
+        { "13x200", 13, 200 },
+    };
+    /* about 100MB of pixels converted per area, format and kernel */
+    const gsize budget = 100 * 1024 * 1024;
+    const ColorConvertImpl *impls;
+    GRand *rand = g_rand_new_with_seed(42);
+    guint i, j, k, n_impls;
+
+    impls = color_convert_get_impls(&n_impls);
+    for (i = 0; i < G_N_ELEMENTS(areas); i++) {
+        int width = areas[i].width, height = areas[i].height;
+        gsize size = (gsize)width * height * 4;
+        guint16 *src = g_new(guint16, (gsize)width * height);
+        guint32 *dest = g_new(guint32, (gsize)width * height);
+        guint n = MAX(budget / size, 1);
+        gdouble scalar[2] = { 0, 0 };
+
+        for (j = 0; j < (gsize)width * height; j++) {
+            src[j] = g_rand_int(rand);
+        }
+
+        for (k = 0; k < n_impls; k++) {
+            gint format;
+
+            for (format = 0; format < 2; format++) {
+                color_convert_row_func convert = format == 0 ?
+                    impls[k].convert_0555_to_0888 : impls[k].convert_0565_to_0888;
+                gint64 start = g_get_monotonic_time();
+                gdouble elapsed;
+                int y;
+
+                for (j = 0; j < n; j++) {
+                    for (y = 0; y < height; y++) {
+                        convert(src + y * width, dest + y * width, width);
+                    }
+                }
+                elapsed = (g_get_monotonic_time() - start) / 1e6;
+                if (k == 0) {
+                    scalar[format] = elapsed;
+                }
+
+                g_print("%-10s %s %-6s %8.1f MB/s (x%.2f)\n",
+                        areas[i].name, format == 0 ? "555" : "565", impls[k].name,
+                        n * size / elapsed / 1e6, scalar[format] / elapsed);
+            }
+        }
+
+        g_free(src);
+        g_free(dest);
+    }
+    g_rand_free(rand);
+
+    return 0;
+}
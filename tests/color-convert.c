@@ -0,0 +1,87 @@
+#include <string.h>
+#include <glib.h>
+
+#include "color-convert.h"
+
+/* the formats are told apart by the number of green bits */
+static void check(const ColorConvertImpl *impl, gint green_bits,
+                  const guint16 *src, guint32 *dest, gint width)
+{
+    gint x;
+
+    if (green_bits == 5) {
+        impl->convert_0555_to_0888(src, dest, width);
+        for (x = 0; x < width; x++) {
+            g_assert_cmphex(dest[x], ==, CONVERT_0555_TO_0888(src[x]));
+        }
+    } else {
+        impl->convert_0565_to_0888(src, dest, width);
+        for (x = 0; x < width; x++) {
+            g_assert_cmphex(dest[x], ==, CONVERT_0565_TO_0888(src[x]));
+        }
+    }
+}
+
+/* every 16-bit value, in one long row */
+static void test_all_values(gconstpointer data)
+{
+    gint green_bits = GPOINTER_TO_INT(data);
+    guint16 *src = g_new(guint16, 65536);
+    guint32 *dest = g_new(guint32, 65536);
+    const ColorConvertImpl *impls;
+    guint i, n;
+
+    impls = color_convert_get_impls(&n);
+    g_assert_cmpuint(n, >=, 1);
+    g_assert_cmpstr(impls[0].name, ==, "scalar");
+
+    for (i = 0; i < 65536; i++) {
+        src[i] = i;
+    }
+    for (i = 0; i < n; i++) {
+        g_test_message("checking %s", impls[i].name);
+        check(&impls[i], green_bits, src, dest, 65536);
+    }
+
+    g_free(src);
+    g_free(dest);
+}
+
+/* short rows at every alignment, which must not write past their end */
+static void test_widths(gconstpointer data)
+{
+    gint green_bits = GPOINTER_TO_INT(data);
+    GRand *rand = g_rand_new_with_seed(42);
+    guint16 src[64 + 8];
+    guint32 dest[64 + 8];
+    const ColorConvertImpl *impls;
+    guint i, n;
+    gint width, offset;
+
+    impls = color_convert_get_impls(&n);
+    for (i = 0; i < G_N_ELEMENTS(src); i++) {
+        src[i] = g_rand_int(rand);
+    }
+    for (i = 0; i < n; i++) {
+        for (width = 0; width <= 64; width++) {
+            for (offset = 0; offset < 8; offset++) {
+                memset(dest, 0x5a, sizeof(dest));
+                check(&impls[i], green_bits, src + offset, dest + offset, width);
+                g_assert_cmphex(dest[offset + width], ==, 0x5a5a5a5a);
+            }
+        }
+    }
+    g_rand_free(rand);
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_data_func("/color-convert/0555/all-values", GINT_TO_POINTER(5), test_all_values);
+    g_test_add_data_func("/color-convert/0565/all-values", GINT_TO_POINTER(6), test_all_values);
+    g_test_add_data_func("/color-convert/0555/widths", GINT_TO_POINTER(5), test_widths);
+    g_test_add_data_func("/color-convert/0565/widths", GINT_TO_POINTER(6), test_widths);
+
+    return g_test_run();
+}
@@ -0,0 +1,202 @@
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "image-store.h"
+
+static pixman_image_t *create_image(int width, int height, guint32 color)
+{
+    pixman_image_t *image = pixman_image_create_bits(PIXMAN_x8r8g8b8, width, height, NULL, 0);
+    uint32_t *data = pixman_image_get_data(image);
+    int i;
+
+    for (i = 0; i < width * height; i++)
+        data[i] = color;
+
+    return image;
+}
+
+static void check_image(pixman_image_t *image, int width, int height, guint32 color)
+{
+    uint32_t *data;
+    int i;
+
+    g_assert_nonnull(image);
+    g_assert_cmpint(pixman_image_get_width(image), ==, width);
+    g_assert_cmpint(pixman_image_get_height(image), ==, height);
+    g_assert_cmpint(pixman_image_get_format(image), ==, PIXMAN_x8r8g8b8);
+
+    data = pixman_image_get_data(image);
+    for (i = 0; i < width * height; i++)
+        g_assert_cmphex(data[i], ==, color);
+}
+
+static void make_digest(guint8 digest[IMAGE_STORE_DIGEST_SIZE], guint8 seed)
+{
+    memset(digest, seed, IMAGE_STORE_DIGEST_SIZE);
+}
+
+static void remove_dir(const gchar *path)
+{
+    GDir *dir = g_dir_open(path, 0, NULL);
+    const gchar *name;
+
+    g_assert_nonnull(dir);
+    while ((name = g_dir_read_name(dir)) != NULL) {
+        gchar *file = g_build_filename(path, name, NULL);
+        g_unlink(file);
+        g_free(file);
+    }
+    g_dir_close(dir);
+    g_rmdir(path);
+}
+
+static void test_image_store_persist(void)
+{
+    gchar *dir = g_dir_make_tmp("spice-image-store-XXXXXX", NULL);
+    SpiceImageStore *store = image_store_new(dir, G_MAXUINT64);
+    pixman_image_t *image;
+    guint8 digest[IMAGE_STORE_DIGEST_SIZE];
+
+    make_digest(digest, 1);
+    image = create_image(16, 8, 0x00123456);
+    image_store_put(store, 42, digest, image);
+    pixman_image_unref(image);
+    g_assert_true(image_store_contains(store, 42));
+    image_store_free(store);
+
+    /* reopened, as when connecting again */
+    store = image_store_new(dir, G_MAXUINT64);
+    g_assert_true(image_store_contains(store, 42));
+    g_assert_false(image_store_contains(store, 43));
+    g_assert_null(image_store_lookup(store, 43, digest, 16, 8));
+
+    image = image_store_lookup(store, 42, digest, 16, 8);
+    check_image(image, 16, 8, 0x00123456);
+    pixman_image_unref(image);
+
+    image = image_store_lookup(store, 42, NULL, -1, -1);
+    check_image(image, 16, 8, 0x00123456);
+    /* the mapping outlives the store */
+    image_store_free(store);
+    check_image(image, 16, 8, 0x00123456);
+    pixman_image_unref(image);
+
+    remove_dir(dir);
+    g_free(dir);
+}
+
+static void test_image_store_corrupt(void)
+{
+    gchar *dir = g_dir_make_tmp("spice-image-store-XXXXXX", NULL);
+    SpiceImageStore *store = image_store_new(dir, G_MAXUINT64);
+    pixman_image_t *image;
+    guint8 digest[IMAGE_STORE_DIGEST_SIZE];
+    gchar *path, *contents;
+    gsize length;
+
+    make_digest(digest, 1);
+    image = create_image(16, 8, 0x00123456);
+    image_store_put(store, 42, digest, image);
+    pixman_image_unref(image);
+    image_store_free(store);
+
+    /* claims an 8-bit format, the pixels would be read past the file */
+    path = g_build_filename(dir, "000000000000002a", NULL);
+    g_assert_true(g_file_get_contents(path, &contents, &length, NULL));
+    ((guint32 *)contents)[2] = PIXMAN_a8;
+    g_assert_true(g_file_set_contents(path, contents, length, NULL));
+    g_free(contents);
+    g_free(path);
+
+    store = image_store_new(dir, G_MAXUINT64);
+    g_assert_true(image_store_contains(store, 42));
+    g_assert_null(image_store_lookup(store, 42, NULL, -1, -1));
+    g_assert_false(image_store_contains(store, 42));
+    image_store_free(store);
+
+    remove_dir(dir);
+    g_free(dir);
+}
+
+/* an id reused for another image, or another encoding of it */
+static void test_image_store_stale(void)
+{
+    gchar *dir = g_dir_make_tmp("spice-image-store-XXXXXX", NULL);
+    SpiceImageStore *store = image_store_new(dir, G_MAXUINT64);
+    pixman_image_t *image;
+    guint8 digest[IMAGE_STORE_DIGEST_SIZE], other[IMAGE_STORE_DIGEST_SIZE];
+
+    make_digest(digest, 1);
+    make_digest(other, 2);
+    image = create_image(16, 8, 0x00123456);
+    image_store_put(store, 42, digest, image);
+    pixman_image_unref(image);
+
+    /* different size, or different digest, the stale image goes away */
+    g_assert_null(image_store_lookup(store, 42, digest, 8, 16));
+    g_assert_false(image_store_contains(store, 42));
+
+    image = create_image(16, 8, 0x00123456);
+    image_store_put(store, 42, digest, image);
+    pixman_image_unref(image);
+    g_assert_null(image_store_lookup(store, 42, other, 16, 8));
+    g_assert_false(image_store_contains(store, 42));
+
+    /* and the new one can be stored */
+    image = create_image(16, 8, 0x00654321);
+    image_store_put(store, 42, other, image);
+    pixman_image_unref(image);
+    image = image_store_lookup(store, 42, other, 16, 8);
+    check_image(image, 16, 8, 0x00654321);
+    pixman_image_unref(image);
+    image_store_free(store);
+
+    remove_dir(dir);
+    g_free(dir);
+}
+
+static void test_image_store_budget(void)
+{
+    gchar *dir = g_dir_make_tmp("spice-image-store-XXXXXX", NULL);
+    /* room for 2 images and their headers */
+    SpiceImageStore *store = image_store_new(dir, 2 * (64 * 64 * 4 + 64));
+    pixman_image_t *image;
+    guint8 digest[IMAGE_STORE_DIGEST_SIZE];
+    guint64 id;
+
+    for (id = 1; id <= 3; id++) {
+        make_digest(digest, id);
+        image = create_image(64, 64, id);
+        image_store_put(store, id, digest, image);
+        pixman_image_unref(image);
+
+        if (id == 2) {
+            /* 1 becomes the most recently used */
+            make_digest(digest, 1);
+            image = image_store_lookup(store, 1, digest, 64, 64);
+            check_image(image, 64, 64, 1);
+            pixman_image_unref(image);
+        }
+    }
+
+    g_assert_true(image_store_contains(store, 1));
+    g_assert_false(image_store_contains(store, 2));
+    g_assert_true(image_store_contains(store, 3));
+    image_store_free(store);
+
+    remove_dir(dir);
+    g_free(dir);
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/image-store/persist", test_image_store_persist);
+    g_test_add_func("/image-store/corrupt", test_image_store_corrupt);
+    g_test_add_func("/image-store/stale", test_image_store_stale);
+    g_test_add_func("/image-store/budget", test_image_store_budget);
+
+    return g_test_run();
+}
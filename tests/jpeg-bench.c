@@ -0,0 +1,243 @@
+/*
+ * Measures the throughput of the JPEG image decoder, compared to the
+ * implementation it replaced (RGB scanlines read one at a time, then
+ * converted to BGRX), on payloads resembling the lossy images sent by
+ * the server: photos, text and flat user interface elements.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+#include <jpeglib.h>
+
+#include "decode.h"
+
+typedef enum {
+    CONTENT_PHOTO,
+    CONTENT_TEXT,
+    CONTENT_UI,
+} Content;
+
+static guint8 *make_rgb(Content content, int width, int height)
+{
+    guint8 *rgb = g_malloc((gsize)width * height * 3);
+    GRand *rand = g_rand_new_with_seed(42);
+    int x, y;
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            guint8 *p = rgb + ((gsize)y * width + x) * 3;
+
+            switch (content) {
+            case CONTENT_PHOTO:
+                /* smooth gradients with some noise */
+                p[0] = (x * 255 / width + g_rand_int_range(rand, 0, 16)) & 0xff;
+                p[1] = (y * 255 / height + g_rand_int_range(rand, 0, 16)) & 0xff;
+                p[2] = ((x + y) * 127 / (width + height) + g_rand_int_range(rand, 0, 16)) & 0xff;
+                break;
+            case CONTENT_TEXT:
+                /* dark glyph-like strokes on a white background */
+                p[0] = p[1] = p[2] =
+                    (y % 16 < 11 && (x * 7 + y * 3) % 9 < 2) ? 0x20 : 0xff;
+                break;
+            case CONTENT_UI:
+                /* flat rectangles */
+                p[0] = (x / 64) * 40 & 0xff;
+                p[1] = (y / 32) * 24 & 0xff;
+                p[2] = 0xc0;
+                break;
+            }
+        }
+    }
+    g_rand_free(rand);
+
+    return rgb;
+}
+
+/* memory destination, jpeg_mem_dest() isn't available with libjpeg 6b */
+typedef struct {
+    struct jpeg_destination_mgr base;
+    GByteArray *array;
+    guint8 buffer[4096];
+} MemDest;
+
+static void mem_init_destination(j_compress_ptr cinfo)
+{
+    MemDest *dest = (MemDest *)cinfo->dest;
+
+    dest->base.next_output_byte = dest->buffer;
+    dest->base.free_in_buffer = sizeof(dest->buffer);
+}
+
+static boolean mem_empty_output_buffer(j_compress_ptr cinfo)
+{
+    MemDest *dest = (MemDest *)cinfo->dest;
+
+    g_byte_array_append(dest->array, dest->buffer, sizeof(dest->buffer));
+    mem_init_destination(cinfo);
+
+    return TRUE;
+}
+
+static void mem_term_destination(j_compress_ptr cinfo)
+{
+    MemDest *dest = (MemDest *)cinfo->dest;
+
+    g_byte_array_append(dest->array, dest->buffer,
+                        sizeof(dest->buffer) - dest->base.free_in_buffer);
+}
+
+static GByteArray *encode(const guint8 *rgb, int width, int height, int quality)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    MemDest dest = {
+        .base = {
+            .init_destination = mem_init_destination,
+            .empty_output_buffer = mem_empty_output_buffer,
+            .term_destination = mem_term_destination,
+        },
+        .array = g_byte_array_new(),
+    };
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    cinfo.dest = &dest.base;
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW row = (JSAMPROW)rgb + (gsize)cinfo.next_scanline * width * 3;
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+
+    return dest.array;
+}
+
+/* the replaced implementation */
+static void legacy_init_source(j_decompress_ptr cinfo)
+{
+}
+
+static boolean legacy_fill_input_buffer(j_decompress_ptr cinfo)
+{
+    return FALSE;
+}
+
+static void legacy_skip_input_data(j_decompress_ptr cinfo, long num_bytes)
+{
+    cinfo->src->next_input_byte += num_bytes;
+    cinfo->src->bytes_in_buffer -= num_bytes;
+}
+
+static void legacy_term_source(j_decompress_ptr cinfo)
+{
+}
+
+static void legacy_decode(GByteArray *jpeg, guint8 *dest, int stride)
+{
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    struct jpeg_source_mgr src = {
+        .next_input_byte = jpeg->data,
+        .bytes_in_buffer = jpeg->len,
+        .init_source = legacy_init_source,
+        .fill_input_buffer = legacy_fill_input_buffer,
+        .skip_input_data = legacy_skip_input_data,
+        .resync_to_restart = jpeg_resync_to_restart,
+        .term_source = legacy_term_source,
+    };
+    guint8 *scan_line;
+    JDIMENSION x, row;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+    cinfo.src = &src;
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = JCS_RGB;
+    scan_line = g_alloca(cinfo.image_width * 3);
+
+    jpeg_start_decompress(&cinfo);
+    for (row = 0; row < cinfo.image_height; row++) {
+        guint8 *s = scan_line, *d = dest;
+
+        jpeg_read_scanlines(&cinfo, &scan_line, 1);
+        for (x = 0; x < cinfo.image_width; x++) {
+            *d++ = s[2];
+            *d++ = s[1];
+            *d++ = s[0];
+            *d++ = 0;
+            s += 3;
+        }
+        dest += stride;
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+}
+
+static void spice_decode(SpiceJpegDecoder *decoder, GByteArray *jpeg,
+                         guint8 *dest, int stride)
+{
+    int width, height;
+
+    decoder->ops->begin_decode(decoder, jpeg->data, jpeg->len, &width, &height);
+    decoder->ops->decode(decoder, dest, stride, SPICE_BITMAP_FMT_32BIT);
+}
+
+int main(int argc, char* argv[])
+{
+    static const struct {
+        const char *name;
+        Content content;
+        int width;
+        int height;
+    } payloads[] = {
+        { "photo 1920x1080", CONTENT_PHOTO, 1920, 1080 },
+        { "photo 256x256", CONTENT_PHOTO, 256, 256 },
+        { "text 1280x720", CONTENT_TEXT, 1280, 720 },
+        { "text 400x64", CONTENT_TEXT, 400, 64 },
+        { "ui 1024x768", CONTENT_UI, 1024, 768 },
+    };
+    /* about 50MB of pixels decoded per payload and implementation */
+    const gsize budget = 50 * 1024 * 1024;
+    SpiceJpegDecoder *decoder = jpeg_decoder_new();
+    guint i, j;
+
+    for (i = 0; i < G_N_ELEMENTS(payloads); i++) {
+        int width = payloads[i].width, height = payloads[i].height;
+        int stride = width * 4;
+        gsize size = (gsize)stride * height;
+        guint8 *rgb = make_rgb(payloads[i].content, width, height);
+        GByteArray *jpeg = encode(rgb, width, height, 85);
+        guint8 *dest = g_malloc(size);
+        guint n = MAX(budget / size, 1);
+        gint64 start;
+        gdouble legacy, current;
+
+        start = g_get_monotonic_time();
+        for (j = 0; j < n; j++)
+            legacy_decode(jpeg, dest, stride);
+        legacy = (g_get_monotonic_time() - start) / 1e6;
+
+        start = g_get_monotonic_time();
+        for (j = 0; j < n; j++)
+            spice_decode(decoder, jpeg, dest, stride);
+        current = (g_get_monotonic_time() - start) / 1e6;
+
+        g_print("%-16s %7u bytes: before %8.1f MB/s, after %8.1f MB/s (x%.2f)\n",
+                payloads[i].name, jpeg->len,
+                n * size / legacy / 1e6, n * size / current / 1e6, legacy / current);
+
+        g_free(dest);
+        g_byte_array_unref(jpeg);
+        g_free(rgb);
+    }
+    jpeg_decoder_destroy(decoder);
+
+    return 0;
+}
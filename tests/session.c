@@ -1,5 +1,7 @@
 #include <spice-client.h>
 
+#include "spice-session-priv.h"
+
 typedef struct {
     const gchar *port;
     const gchar *tls_port;
@@ -333,6 +335,50 @@ static void test_session_uri_unix_good(void)
     test_session_uri_good(tests, G_N_ELEMENTS(tests));
 }
 
+/* the address resolved for a host is not reused for another one */
+static void test_session_connect_address(void)
+{
+    SpiceSession *s = spice_session_new();
+    GInetAddress *address = g_inet_address_new_loopback(G_SOCKET_FAMILY_IPV4);
+    GInetAddress *cached;
+
+    g_object_set(s, "uri", "spice://host1:5900", NULL);
+    spice_session_set_connect_address(s, address);
+    cached = spice_session_get_connect_address(s);
+    g_assert_true(cached == address);
+    g_object_unref(cached);
+
+    g_object_set(s, "uri", "spice://host2:5900", NULL);
+    g_assert_null(spice_session_get_connect_address(s));
+
+    spice_session_set_connect_address(s, address);
+    g_object_set(s, "port", "5901", NULL);
+    g_assert_null(spice_session_get_connect_address(s));
+
+    g_object_unref(address);
+    g_object_unref(s);
+}
+
+/* a TLS session is not resumed with another host */
+static void test_session_tls_session(void)
+{
+    SpiceSession *s = spice_session_new();
+    SSL_SESSION *tls_session = SSL_SESSION_new();
+    SSL_SESSION *cached;
+
+    g_object_set(s, "uri", "spice://host1?tls-port=5901", NULL);
+    spice_session_set_tls_session(s, tls_session);
+    cached = spice_session_get_tls_session(s);
+    g_assert_true(cached == tls_session);
+    SSL_SESSION_free(cached);
+
+    g_object_set(s, "uri", "spice://host2?tls-port=5901", NULL);
+    g_assert_null(spice_session_get_tls_session(s));
+
+    SSL_SESSION_free(tls_session);
+    g_object_unref(s);
+}
+
 int main(int argc, char* argv[])
 {
     g_test_init(&argc, &argv, NULL);
@@ -341,6 +387,8 @@ int main(int argc, char* argv[])
     g_test_add_func("/session/good-ipv4-uri", test_session_uri_ipv4_good);
     g_test_add_func("/session/good-ipv6-uri", test_session_uri_ipv6_good);
     g_test_add_func("/session/good-unix", test_session_uri_unix_good);
+    g_test_add_func("/session/connect-address", test_session_connect_address);
+    g_test_add_func("/session/tls-session", test_session_tls_session);
 
     return g_test_run();
 }